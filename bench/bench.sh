@@ -0,0 +1,166 @@
+#!/bin/bash
+# Comparative benchmark: nhex against xxd, hexdump and od, ntree against tree and find.
+#
+#   bench/bench.sh [--quick] [--runs N] [--out DIR] [--network-dir DIR]   (run from the repository root after `make`)
+#
+# Generates the corpora (random and zero-filled files, a wide and a deep directory tree)
+# in a temporary directory, runs every tool on every input RUNS times with output to
+# /dev/null, and keeps the fastest run. Results go to DIR/results.csv and DIR/results.md
+# (default bench/out): wall time, user and system CPU time, max RSS and, when strace is
+# installed, the number of system calls. Tools that are not installed are skipped.
+# Before timing anything, bench/verify.sh checks that the commands' fast paths still match
+# their --reference output; a benchmark of wrong output is worthless.
+# With --network-dir, the wide tree is also copied into that directory, which should be on
+# a network mount (for instance a local NFS export mounted over loopback), and walked with
+# and without ntree --network. Without it, or when DIR is not writable, those walks are skipped.
+
+set -u
+
+RUNS=3
+OUT=bench/out
+QUICK=0
+NETWORK_DIR=
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --quick) QUICK=1 ;;
+        --runs) RUNS=$2; shift ;;
+        --out) OUT=$2; shift ;;
+        --network-dir) NETWORK_DIR=$2; shift ;;
+        *) echo "Usage: $0 [--quick] [--runs N] [--out DIR] [--network-dir DIR]" >&2; exit 1 ;;
+    esac
+    shift
+done
+
+if [ ! -x nhex/nhex ] || [ ! -x ntree/ntree ]; then
+    echo "Build the commands first: make" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d) || exit 1
+NETWORK_WORK=
+trap 'rm -rf "$WORK" ${NETWORK_WORK:+"$NETWORK_WORK"}' EXIT
+mkdir -p "$OUT"
+
+# Fast paths must produce the reference output before their speed means anything
+if [ "$QUICK" = 1 ]; then
+    bench/verify.sh --quick || { echo "Output differs from --reference; not benchmarking" >&2; exit 1; }
+else
+    bench/verify.sh || { echo "Output differs from --reference; not benchmarking" >&2; exit 1; }
+fi
+
+# The timing helper (GNU time is not always installed)
+cc -O2 -o "$WORK/measure" bench/measure.c || exit 1
+
+# --- Corpora ---------------------------------------------------------------
+
+if [ "$QUICK" = 1 ]; then
+    FILE_MB=4; TREE_DIRS=20; TREE_FILES=50; DEPTH=20
+else
+    FILE_MB=64; TREE_DIRS=200; TREE_FILES=200; DEPTH=100
+fi
+
+echo "Generating corpora in $WORK ..." >&2
+head -c $((FILE_MB * 1024 * 1024)) /dev/urandom > "$WORK/random.bin"
+head -c $((FILE_MB * 1024 * 1024)) /dev/zero > "$WORK/zero.bin"
+head -c 4096 /dev/urandom > "$WORK/small.bin"
+
+# Wide tree: TREE_DIRS directories of TREE_FILES files each
+mkdir "$WORK/wide"
+for d in $(seq 1 "$TREE_DIRS"); do
+    mkdir "$WORK/wide/dir$d"
+    (cd "$WORK/wide/dir$d" && seq -f "file%g.txt" 1 "$TREE_FILES" | xargs touch)
+done
+
+# Deep tree: a chain of DEPTH directories with a few files at every level
+path="$WORK/deep"
+for level in $(seq 1 "$DEPTH"); do
+    mkdir -p "$path"
+    touch "$path/a" "$path/b" "$path/c"
+    path="$path/level$level"
+done
+
+# --- Measurements ----------------------------------------------------------
+
+CSV="$OUT/results.csv"
+echo "benchmark,tool,input,wall_s,user_s,sys_s,max_rss_kb,syscalls" > "$CSV"
+
+# bench BENCHMARK TOOL INPUT COMMAND...: runs COMMAND RUNS times and records its fastest run
+bench() {
+    local benchmark=$1 tool=$2 input=$3
+    shift 3
+    if ! command -v "$1" > /dev/null; then
+        echo "  skipping $tool (not installed)" >&2
+        return
+    fi
+
+    rm -f "$WORK/runs"
+    for _ in $(seq 1 "$RUNS"); do
+        "$WORK/measure" "$WORK/runs" "$@" > /dev/null 2>&1
+    done
+    local best
+    best=$(sort -n "$WORK/runs" | head -n 1)
+    local wall user sys rss status
+    read -r wall user sys rss status <<< "$best"
+    if [ "$status" != 0 ]; then
+        echo "  $tool on $input exited with status $status" >&2
+    fi
+
+    # One more run under strace -c; the calls column of its "total" line counts every syscall
+    local syscalls=n/a
+    if command -v strace > /dev/null && strace -f -c -o "$WORK/strace" "$@" > /dev/null 2>&1; then
+        syscalls=$(awk '$NF == "total" { print $4 }' "$WORK/strace")
+        [ -n "$syscalls" ] || syscalls=n/a
+    fi
+
+    echo "$benchmark,$tool,$input,$wall,$user,$sys,$rss,$syscalls" >> "$CSV"
+    printf '  %-8s %-10s %-12s %10ss\n' "$benchmark" "$tool" "$input" "$wall" >&2
+}
+
+echo "Hex dumps ($FILE_MB MiB, best of $RUNS)" >&2
+for input in random.bin zero.bin small.bin; do
+    bench dump nhex "$input" nhex/nhex "$WORK/$input"
+    bench dump xxd "$input" xxd "$WORK/$input"
+    bench dump "hexdump -C" "$input" hexdump -C "$WORK/$input"
+    bench dump "od" "$input" od -A x -t x1z -v "$WORK/$input"
+done
+
+echo "Tree walks (best of $RUNS)" >&2
+for input in wide deep; do
+    bench walk ntree "$input" ntree/ntree "$WORK/$input"
+    bench walk tree "$input" tree -a "$WORK/$input"
+    bench walk find "$input" find "$WORK/$input"
+done
+
+# Network walks: the same wide tree on a network mount, where every stat is a round trip
+if [ -z "$NETWORK_DIR" ]; then
+    echo "Skipping network walks (no --network-dir given)" >&2
+elif ! NETWORK_WORK=$(mktemp -d "$NETWORK_DIR/ntree-bench.XXXXXX"); then
+    echo "Skipping network walks ($NETWORK_DIR is not writable)" >&2
+else
+    fs_type=$(stat -f -c %T "$NETWORK_WORK")
+    echo "Network walks on $fs_type (best of $RUNS)" >&2
+    cp -r "$WORK/wide" "$NETWORK_WORK/wide"
+    bench network ntree "wide ($fs_type)" ntree/ntree "$NETWORK_WORK/wide"
+    bench network "ntree --network" "wide ($fs_type)" ntree/ntree --network "$NETWORK_WORK/wide"
+    bench network "ntree --network --by-owner" "wide ($fs_type)" ntree/ntree --network --by-owner "$NETWORK_WORK/wide"
+    bench network tree "wide ($fs_type)" tree -a "$NETWORK_WORK/wide"
+    bench network find "wide ($fs_type)" find "$NETWORK_WORK/wide"
+fi
+
+# --- Markdown report -------------------------------------------------------
+
+MD="$OUT/results.md"
+{
+    echo "# ncommands benchmark"
+    echo
+    echo "$(date -u '+%Y-%m-%d %H:%M UTC'), $(uname -srm), $(nproc) CPU(s), best of $RUNS runs, output to /dev/null."
+    echo
+    echo "| Benchmark | Tool | Input | Wall (s) | User (s) | Sys (s) | Max RSS (KiB) | Syscalls |"
+    echo "|---|---|---|---:|---:|---:|---:|---:|"
+    tail -n +2 "$CSV" | while IFS=, read -r benchmark tool input wall user sys rss syscalls; do
+        echo "| $benchmark | $tool | $input | $wall | $user | $sys | $rss | $syscalls |"
+    done
+} > "$MD"
+
+echo "Wrote $CSV and $MD" >&2
@@ -0,0 +1,93 @@
+#define _GNU_SOURCE    // For posix_spawn_file_actions_addopen
+#include <stdio.h>     // For printf, fprintf, perror
+#include <stdlib.h>    // For atoi, malloc, qsort, EXIT_FAILURE
+#include <string.h>    // For strerror
+#include <fcntl.h>     // For O_WRONLY
+#include <spawn.h>     // For posix_spawnp and its file actions
+#include <time.h>      // For clock_gettime, CLOCK_MONOTONIC
+#include <unistd.h>    // For STDOUT_FILENO
+#include <sys/resource.h> // For getrusage, RUSAGE_CHILDREN
+#include <sys/wait.h>  // For waitpid, WIFEXITED, WEXITSTATUS
+
+/*
+ * latency - invocation latency microbenchmark, for bench/startup.sh.
+ *
+ *   latency RUNS COMMAND [ARG...]
+ *
+ * Starts COMMAND RUNS times, one after another, with its standard output on /dev/null,
+ * and prints the distribution of exec-to-exit times in microseconds (min, median, p90,
+ * p99, mean) plus the mean user and system CPU time per run. posix_spawn and a
+ * monotonic clock per run keep the loop overhead far below what a shell loop adds, so
+ * differences of a few microseconds in startup work show up. The minimum and median are
+ * the numbers to compare; the tail mostly measures the machine.
+ */
+
+extern char **environ;
+
+// Microseconds between two clock readings
+static double elapsed_us(const struct timespec *start, const struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e6 + (double)(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+// qsort comparator for doubles
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Microseconds in a timeval
+static double timeval_us(struct timeval tv) {
+    return (double)tv.tv_sec * 1e6 + (double)tv.tv_usec;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || atoi(argv[1]) < 1) {
+        fprintf(stderr, "Usage: %s RUNS COMMAND [ARG...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int runs = atoi(argv[1]);
+    double *times = (double *)malloc((size_t)runs * sizeof(double));
+    if (!times) {
+        perror("Error: Memory allocation failed");
+        return EXIT_FAILURE;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    double total = 0;
+    for (int i = 0; i < runs; i++) {
+        struct timespec start, end;
+        pid_t child;
+        int status;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int error = posix_spawnp(&child, argv[2], &actions, NULL, &argv[2], environ);
+        if (error != 0) {
+            fprintf(stderr, "%s: cannot start: %s\n", argv[2], strerror(error));
+            return EXIT_FAILURE;
+        }
+        if (waitpid(child, &status, 0) < 0) {
+            perror("Error: waitpid failed");
+            return EXIT_FAILURE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s: failed (status %d)\n", argv[2], status);
+            return EXIT_FAILURE;
+        }
+        times[i] = elapsed_us(&start, &end);
+        total += times[i];
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    qsort(times, (size_t)runs, sizeof(double), compare_doubles);
+    printf("%9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", times[0], times[runs / 2], times[runs * 9 / 10],
+           times[runs * 99 / 100], total / runs, timeval_us(usage.ru_utime) / runs,
+           timeval_us(usage.ru_stime) / runs);
+    free(times);
+    return 0;
+}
@@ -0,0 +1,65 @@
+#define _GNU_SOURCE    // For wait4
+#include <stdio.h>     // For fopen, fprintf, perror
+#include <stdlib.h>    // For EXIT_FAILURE
+#include <time.h>      // For clock_gettime, CLOCK_MONOTONIC
+#include <unistd.h>    // For fork, execvp, _exit
+#include <sys/resource.h> // For struct rusage
+#include <sys/wait.h>  // For wait4, WIFEXITED, WEXITSTATUS
+
+/*
+ * measure - runs a command once and reports what it cost, for bench/bench.sh.
+ *
+ *   measure RESULT_FILE COMMAND [ARG...]
+ *
+ * Appends one line to RESULT_FILE: wall seconds, user CPU seconds, system CPU seconds,
+ * maximum resident set size in KiB and the command's exit status. The command's own
+ * output is left alone (the benchmark sends it to /dev/null). This stands in for
+ * GNU time, which is not installed everywhere.
+ */
+
+// Seconds in a timeval
+static double seconds(struct timeval tv) {
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    struct timespec start, end;
+    struct rusage usage;
+    int status;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s RESULT_FILE COMMAND [ARG...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    FILE *result = fopen(argv[1], "ae");
+    if (!result) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t child = fork();
+    if (child < 0) {
+        perror("Error: Cannot fork");
+        return EXIT_FAILURE;
+    }
+    if (child == 0) {
+        execvp(argv[2], &argv[2]);
+        perror(argv[2]);
+        _exit(127);
+    }
+    if (wait4(child, &status, 0, &usage) < 0) {
+        perror("Error: wait4 failed");
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double wall = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(result, "%.6f %.6f %.6f %ld %d\n", wall, seconds(usage.ru_utime), seconds(usage.ru_stime),
+            usage.ru_maxrss, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    if (fclose(result) != 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
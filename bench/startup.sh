@@ -0,0 +1,45 @@
+#!/bin/sh
+# Measures invocation latency of the commands on tiny inputs.
+#
+#   bench/startup.sh [RUNS]      (run from the repository root after `make`; `make multicall` adds the multicall binary)
+#
+# Every command is started RUNS times on a tiny file or directory, so the time is dominated by
+# process startup and setup: exec, dynamic loading and relocation (none of that for the static
+# multicall binary), then the commands' own initialization. bench/latency.c does the spawning
+# and prints the distribution in microseconds per run.
+
+RUNS=${1:-2000}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+for binary in nhex/nhex ntree/ntree; do
+    if [ ! -x "$binary" ]; then
+        echo "$binary is missing; run make first" >&2
+        exit 1
+    fi
+done
+cc -O2 -o "$WORK/latency" bench/latency.c || exit 1
+
+mkdir "$WORK/dir"
+printf 'ncommands' > "$WORK/file"
+printf 'a' > "$WORK/dir/a"
+printf 'b' > "$WORK/dir/b"
+mkdir "$WORK/dir/c"
+
+# time_runs LABEL COMMAND...: starts COMMAND RUNS times and prints the latency distribution
+time_runs() {
+    label=$1
+    shift
+    printf '%-30s ' "$label"
+    "$WORK/latency" "$RUNS" "$@"
+}
+
+echo "$RUNS runs each, microseconds per run"
+printf '%-30s %9s %9s %9s %9s %9s %9s %9s\n' "" min median p90 p99 mean user sys
+time_runs "/bin/true (baseline)" /bin/true
+time_runs "nhex (9-byte file)" nhex/nhex "$WORK/file"
+time_runs "ntree (3-entry directory)" ntree/ntree "$WORK/dir"
+if [ -x multicall/ncommands ]; then
+    time_runs "multicall nhex" multicall/nhex "$WORK/file"
+    time_runs "multicall ntree" multicall/ntree "$WORK/dir"
+fi
@@ -0,0 +1,404 @@
+#!/bin/bash
+# Differential check: every optimized mode of nhex and ntree must match --reference byte for byte.
+#
+#   bench/verify.sh [--quick] [--seed N]   (run from the repository root after `make`)
+#
+# --reference runs the original, unoptimized code paths (stdio nhex; single-threaded,
+# in-memory ntree). This script generates randomized files and trees, including the edge
+# cases the fast paths are most likely to get wrong (empty files, partial last lines,
+# sizes around the read chunk and output buffer, names sharing long prefixes, huge
+# directories, dangling links), runs every mode combination and compares the outputs.
+# bench/bench.sh runs it before timing anything. Exits 1 if any output differs.
+
+set -u
+
+QUICK=0
+SEED=$$
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --quick) QUICK=1 ;;
+        --seed) SEED=$2; shift ;;
+        *) echo "Usage: $0 [--quick] [--seed N]" >&2; exit 1 ;;
+    esac
+    shift
+done
+
+if [ ! -x nhex/nhex ] || [ ! -x ntree/ntree ]; then
+    echo "Build the commands first: make" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+RANDOM=$SEED
+CHECKS=0
+FAILURES=0
+
+# The standalone commands, plus the multicall binary when it has been built
+NHEX=(nhex/nhex)
+NTREE=(ntree/ntree)
+if [ -x multicall/ncommands ]; then
+    NHEX+=("multicall/ncommands nhex")
+    NTREE+=("multicall/ncommands ntree")
+fi
+
+# same LABEL EXPECTED ACTUAL: compares two output files
+same() {
+    CHECKS=$((CHECKS + 1))
+    if ! cmp -s "$2" "$3"; then
+        FAILURES=$((FAILURES + 1))
+        echo "MISMATCH: $1" >&2
+        diff <(head -c 200000 "$2") <(head -c 200000 "$3") | head -n 10 >&2
+    fi
+}
+
+# --- nhex ------------------------------------------------------------------
+
+echo "Checking nhex (seed $SEED) ..." >&2
+mkdir "$WORK/files"
+
+# Sizes around every boundary: a line (16), the read chunk (16 KiB at 16 bytes per line)
+# and the output buffer (64 KiB), plus a few random ones
+sizes="0 1 2 7 8 9 15 16 17 31 32 33 255 256 257 16383 16384 16385 65535 65536 65537 1048576"
+for _ in 1 2 3 4 5; do
+    sizes="$sizes $((RANDOM * 37 + RANDOM % 16))"
+done
+for size in $sizes; do
+    head -c "$size" /dev/urandom > "$WORK/files/random-$size"
+done
+head -c 100000 /dev/zero > "$WORK/files/zeros"
+for i in $(seq 0 255); do printf "\\$(printf '%03o' "$i")"; done > "$WORK/files/all-bytes"
+printf 'plain ASCII text\twith tabs\r\nand line ends\n' > "$WORK/files/text"
+
+for file in "$WORK"/files/*; do
+    nhex/nhex --reference "$file" > "$WORK/expected"
+    for command in "${NHEX[@]}"; do
+        $command "$file" > "$WORK/actual"
+        same "$command $(basename "$file")" "$WORK/expected" "$WORK/actual"
+    done
+    nhex/nhex /dev/stdin < "$file" > "$WORK/actual"
+    same "nhex /dev/stdin < $(basename "$file")" "$WORK/expected" "$WORK/actual"
+done
+
+# Record layouts (-c): widths below, at and far above a line, on small files and across read chunks
+for record in 1 3 16 100 4096 5000; do
+    for file in "$WORK/files/random-257" "$WORK/files/random-65537" "$WORK/files/random-1048576"; do
+        nhex/nhex --reference -c "$record" "$file" > "$WORK/expected"
+        nhex/nhex -c "$record" "$file" > "$WORK/actual"
+        same "nhex -c $record $(basename "$file")" "$WORK/expected" "$WORK/actual"
+    done
+done
+
+# Terminal widths change the bytes per line; script(1) gives the commands a terminal
+if command -v script > /dev/null; then
+    for columns in 20 40 57 80 133 300; do
+        for file in "$WORK/files/random-257" "$WORK/files/all-bytes"; do
+            script -qec "stty cols $columns; nhex/nhex --reference $file" /dev/null > "$WORK/expected"
+            script -qec "stty cols $columns; nhex/nhex $file" /dev/null > "$WORK/actual"
+            same "nhex at $columns columns on $(basename "$file")" "$WORK/expected" "$WORK/actual"
+            # Records wider than the terminal wrap over several lines
+            script -qec "stty cols $columns; nhex/nhex --reference -c 100 $file" /dev/null > "$WORK/expected"
+            script -qec "stty cols $columns; nhex/nhex -c 100 $file" /dev/null > "$WORK/actual"
+            same "nhex -c 100 at $columns columns on $(basename "$file")" "$WORK/expected" "$WORK/actual"
+        done
+    done
+fi
+
+# --regex has no reference path, but its output must not depend on the thread count (the file
+# is searched in 1 MiB ranges) or on whether the file could be mapped. The pattern sample has
+# matches that cross range boundaries, and one that spans several ranges.
+{ head -c 1048570 /dev/urandom; head -c 2500000 /dev/zero; head -c 1500000 /dev/urandom; } > "$WORK/regex-data"
+for pattern in '[[:print:]]{4,}' '\x00+' '\x00{3}|\xFF' '[\x00-\x1F]\x00[^\x00]' 'no such bytes'; do
+    nhex/nhex --threads 1 -e "$pattern" "$WORK/regex-data" > "$WORK/expected"
+    for threads in 2 3 8; do
+        nhex/nhex --threads "$threads" -e "$pattern" "$WORK/regex-data" > "$WORK/actual"
+        same "nhex --regex '$pattern' --threads $threads" "$WORK/expected" "$WORK/actual"
+    done
+    nhex/nhex -e "$pattern" /dev/stdin < "$WORK/regex-data" > "$WORK/actual"
+    same "nhex --regex '$pattern' /dev/stdin" "$WORK/expected" "$WORK/actual"
+done
+
+# A pattern whose beginning matches a long stretch and then fails (\x00+\x01 over zeros, [a-z]+\x00
+# over text) must cost time linear in the stretch: trying each position on its own took hours on these
+head -c 3000000 /dev/zero > "$WORK/regex-zeros"
+yes abcdefghijklmnopqrstuvwxyz | tr -d '\n' | head -c 3000000 > "$WORK/regex-text"
+for search in "\\x00+\\x01 regex-zeros" "[a-z]+\\x00 regex-text"; do
+    read -r pattern file <<< "$search"
+    : > "$WORK/expected"
+    if command -v timeout > /dev/null; then
+        timeout 20 nhex/nhex --threads 1 -e "$pattern" "$WORK/$file" > "$WORK/actual"
+    else
+        nhex/nhex --threads 1 -e "$pattern" "$WORK/$file" > "$WORK/actual"
+    fi
+    [ $? = 1 ] || echo "no 'no match' exit status" >> "$WORK/actual"
+    same "nhex --regex '$pattern' on $file in linear time" "$WORK/expected" "$WORK/actual"
+done
+
+# --ranges reads nearby ranges together, in batches; listing the ranges one per run must give the same
+# output. The list has overlapping, adjacent, repeated, far-apart and out-of-order ranges, one past the
+# end of the file and one larger than a batch.
+head -c 20000000 /dev/urandom > "$WORK/ranges-data"
+printf '0x100:40\n10 20\n299990:100\n0:16\n5000:3\n4096:8K\n0x100:40\n4099:1\n19999990:100\n# comment\n\n100:17M\n' > "$WORK/ranges"
+for _ in $(seq 1 50); do
+    echo "$((RANDOM * 600 + RANDOM % 600)):$((RANDOM % 5000 + 1))"
+done >> "$WORK/ranges"
+nhex/nhex --ranges "$WORK/ranges" "$WORK/ranges-data" > "$WORK/actual" 2> /dev/null
+grep -v '^#' "$WORK/ranges" | grep . | while read -r range; do
+    echo "$range" > "$WORK/one-range"
+    nhex/nhex --ranges "$WORK/one-range" "$WORK/ranges-data" 2> /dev/null
+done > "$WORK/expected"
+same "nhex --ranges" "$WORK/expected" "$WORK/actual"
+
+# --watch-region logs its first snapshot like a dump of the region when the output is not a terminal;
+# a long interval keeps it to a single tick before SIGINT ends it
+if command -v timeout > /dev/null; then
+    echo '0x1FF:1000' > "$WORK/watch-range"
+    nhex/nhex --ranges "$WORK/watch-range" "$WORK/ranges-data" > "$WORK/expected"
+    timeout -s INT 0.5 nhex/nhex --watch-region 0x1FF:1000 60 "$WORK/ranges-data" > "$WORK/actual"
+    same "nhex --watch-region, one tick" "$WORK/expected" "$WORK/actual"
+fi
+
+# --labels only adds header lines: without them the output is the plain dump (and the --ranges output)
+awk 'BEGIN { srand('"$SEED"'); print "# regions"; for (i = 0; i < 5000; i++)
+         printf "%d:%d r%d\n", int(rand() * 20000000), int(rand() * 70000), i }' > "$WORK/labels"
+for args in "" "-c 100" "--ranges $WORK/ranges"; do
+    # shellcheck disable=SC2086
+    nhex/nhex $args "$WORK/ranges-data" > "$WORK/expected" 2> /dev/null
+    # shellcheck disable=SC2086
+    nhex/nhex --labels "$WORK/labels" $args "$WORK/ranges-data" 2> /dev/null | grep -v '^-- ' > "$WORK/actual"
+    same "nhex --labels $args" "$WORK/expected" "$WORK/actual"
+done
+
+# --detect-stride splits the lags over threads; the suggestions must not depend on how many, and
+# -c auto must dump 37-byte records like -c 37
+for i in $(seq 1 2000); do printf 'rec%05d\001\002' "$i"; head -c 27 /dev/urandom; done > "$WORK/records"
+nhex/nhex --threads 1 --detect-stride "$WORK/records" > "$WORK/expected"
+nhex/nhex --threads 3 --detect-stride "$WORK/records" > "$WORK/actual"
+same "nhex --detect-stride --threads 3" "$WORK/expected" "$WORK/actual"
+nhex/nhex -c 37 "$WORK/records" > "$WORK/expected"
+nhex/nhex -c auto "$WORK/records" > "$WORK/actual" 2> /dev/null
+same "nhex -c auto" "$WORK/expected" "$WORK/actual"
+
+# Which headers --labels prints, and in what order, against a linear scan of the regions for every
+# line: random regions plus nested, touching, zero-length and file-spanning ones. Regions are
+# sorted by start, longest first (the order nhex announces them in) and have distinct extents.
+awk 'BEGIN { srand('"$SEED"');
+             for (i = 0; i < 300; i++) { s = int(rand() * 65537); printf "%d %d\n", s, int(rand() * 3000) }
+             for (i = 0; i < 40; i++) { s = int(rand() * 60000); l = 1 + int(rand() * 500)
+                                        printf "%d %d\n%d %d\n%d %d\n%d 0\n", s, l, s + 1, l - 1, s + l, l, s }
+             print "0 65537" }' | sort -u -k1,1n -k2,2n | sort -k1,1n -k2,2nr |
+    awk '{ printf "%d:%d r%d\n", $1, $2, NR }' > "$WORK/brute-labels"
+# nhex gets them shuffled, so it has to sort them itself
+awk 'BEGIN { srand('"$SEED"' + 2) } { printf "%.9f %s\n", rand(), $0 }' "$WORK/brute-labels" | sort -k1,1 |
+    cut -d ' ' -f 2- > "$WORK/shuffled-labels"
+# Ranges start in many places, each one a query of the interval index for the regions around it
+awk 'BEGIN { srand('"$SEED"' + 1); print "16 100"; print "7 9"
+             for (i = 0; i < 200; i++) printf "%d %d\n", int(rand() * 65000), 1 + int(rand() * 40) }' > "$WORK/brute-stretches"
+tr ' ' ':' < "$WORK/brute-stretches" > "$WORK/brute-ranges"
+# brute_labels STRETCHES: the headers and line offsets expected for "OFFSET LENGTH" stretches on stdin
+brute_labels() {
+    awk 'BEGIN { n = 0 }
+         function header(i) { printf "-- %s @ %08X, %d bytes\n", name[i], start[i], end[i] - start[i] }
+         FNR == NR { split($1, field, ":"); start[n] = field[1] + 0; end[n] = field[1] + field[2]; name[n++] = $2; next }
+         { offset = $1 + 0; stop = offset + $2
+           for (i = 0; i < n; i++) if (start[i] < offset && end[i] > offset) header(i)
+           for (line = offset; line < stop; line += 16) {
+               last = line + 16 < stop ? line + 16 : stop
+               for (i = 0; i < n; i++) if (start[i] >= line && start[i] < last) header(i)
+               printf "%08X:\n", line } }' "$WORK/brute-labels" -
+}
+echo "0 65537" | brute_labels > "$WORK/expected"
+nhex/nhex --labels "$WORK/shuffled-labels" "$WORK/files/random-65537" | awk '/^-- / { print; next } { print $1 }' > "$WORK/actual"
+same "nhex --labels headers against a linear scan" "$WORK/expected" "$WORK/actual"
+brute_labels < "$WORK/brute-stretches" > "$WORK/expected"
+nhex/nhex --labels "$WORK/shuffled-labels" --ranges "$WORK/brute-ranges" "$WORK/files/random-65537" |
+    awk '/^-- / { print; next } { print $1 }' > "$WORK/actual"
+same "nhex --labels --ranges headers against a linear scan" "$WORK/expected" "$WORK/actual"
+
+# --block-hashes hashes spans of blocks on each thread; the manifest must not depend on how many.
+# Comparing it with the manifest of a copy with two changed bytes and a longer tail must find
+# exactly the three blocks concerned, as --ranges input.
+nhex/nhex --threads 1 --block-hashes 4K "$WORK/ranges-data" > "$WORK/expected"
+nhex/nhex --threads 3 --block-hashes 4K "$WORK/ranges-data" > "$WORK/actual"
+same "nhex --block-hashes --threads 3" "$WORK/expected" "$WORK/actual"
+cp "$WORK/ranges-data" "$WORK/changed-data"
+printf 'X' | dd of="$WORK/changed-data" bs=1 seek=5000 conv=notrunc 2> /dev/null
+printf 'Y' | dd of="$WORK/changed-data" bs=1 seek=19000000 conv=notrunc 2> /dev/null
+printf 'tail' >> "$WORK/changed-data"
+nhex/nhex --block-hashes 4K "$WORK/changed-data" > "$WORK/changed-manifest"
+printf '0x1000:4096\n0x121E000:4096\n0x1312000:3332\n' > "$WORK/expected"
+nhex/nhex --compare-manifest "$WORK/actual" "$WORK/changed-manifest" > "$WORK/differences" 2> /dev/null
+same "nhex --compare-manifest" "$WORK/expected" "$WORK/differences"
+# ... also when a manifest arrives through a pipe, as from ssh
+nhex/nhex --compare-manifest "$WORK/actual" <(nhex/nhex --block-hashes 4K "$WORK/changed-data") > "$WORK/differences" 2> /dev/null
+same "nhex --compare-manifest from a pipe" "$WORK/expected" "$WORK/differences"
+
+# --- ntree -----------------------------------------------------------------
+
+echo "Checking ntree ..." >&2
+
+# A random tree: nested directories, names with spaces, dots, UTF-8 and long shared prefixes
+# (the parallel sort compares 8-byte prefixes first), empty directories and symbolic links
+TREE="$WORK/tree"
+mkdir "$TREE"
+make_tree() {
+    local dir=$1 depth=$2
+    local count=$((RANDOM % 12))
+    for i in $(seq 1 "$count"); do
+        case $((RANDOM % 6)) in
+            0) name="common-prefix-$RANDOM" ;;
+            1) name=".hidden$RANDOM" ;;
+            2) name="with space $RANDOM" ;;
+            3) name="ünïcødé-$RANDOM" ;;
+            4) name="UPPER$RANDOM" ;;
+            *) name="f$RANDOM.$i" ;;
+        esac
+        if [ "$depth" -gt 0 ] && [ $((RANDOM % 3)) = 0 ]; then
+            mkdir -p "$dir/$name" && make_tree "$dir/$name" $((depth - 1))
+        else
+            head -c $((RANDOM % 300)) /dev/urandom > "$dir/$name"
+        fi
+    done
+}
+make_tree "$TREE" 5
+mkdir "$TREE/empty"
+ln -s "$TREE/empty" "$TREE/link-to-dir"
+ln -s "$TREE/does-not-exist" "$TREE/dangling"
+
+# check_ntree LABEL FAST_ARGS... -- REFERENCE_ARGS...: compares one mode on $TREE with its reference.
+# Only standard output is compared: with --processes every worker reads the top level
+# itself, so an unreadable top-level entry is reported once per worker on stderr.
+check_ntree() {
+    local label=$1
+    shift
+    local fast=() reference=()
+    while [ "$1" != "--" ]; do fast+=("$1"); shift; done
+    shift
+    reference=("$@")
+    ntree/ntree --reference "${reference[@]}" "$TREE" > "$WORK/expected" 2> /dev/null
+    for command in "${NTREE[@]}"; do
+        $command "${fast[@]}" "$TREE" > "$WORK/actual" 2> /dev/null
+        same "$command $label" "$WORK/expected" "$WORK/actual"
+    done
+}
+
+for order in "" --inode-order; do
+    for threads in 1 4; do
+        for spill in 0 1 7 1000; do
+            for network in "" --network; do
+                args=(--threads "$threads")
+                [ -n "$order" ] && args+=("$order")
+                [ "$spill" != 0 ] && args+=(--spill "$spill")
+                [ -n "$network" ] && args+=("$network")
+                check_ntree "${args[*]}" "${args[@]}" --
+                check_ntree "--by-owner ${args[*]}" --by-owner "${args[@]}" -- --by-owner
+                check_ntree "--peek 40 ${args[*]}" --peek 40 "${args[@]}" -- --peek 40
+                check_ntree "--audit ${args[*]}" --audit "${args[@]}" -- --audit
+            done
+        done
+    done
+done
+
+for processes in 2 3; do
+    check_ntree "--processes $processes" --processes "$processes" --
+    check_ntree "--by-owner --processes $processes" --by-owner --processes "$processes" -- --by-owner
+done
+
+# --by-owner charges a symbolic link its own size (the length of its target), not the target's,
+# and does not walk into linked directories: 1000000 + 3 + 6 + 3 bytes in 4 files
+mkdir -p "$WORK/owned/top/sub"
+truncate -s 1000000 "$WORK/owned/top/big"
+ln -s big "$WORK/owned/top/link1"
+ln -s ../big "$WORK/owned/top/sub/link2"
+ln -s sub "$WORK/owned/top/linkdir"
+echo "4 1000012" > "$WORK/expected"
+for command in "${NTREE[@]}"; do
+    for args in "" "--network" "--processes 2" "--reference"; do
+        # shellcheck disable=SC2086
+        $command --by-owner $args "$WORK/owned" | awk '$1 == "top" { print $4, $5 }' > "$WORK/actual"
+        same "$command --by-owner $args with symbolic links" "$WORK/expected" "$WORK/actual"
+    done
+done
+
+# A directory big enough for the parallel sort (65536 entries and more), in fewer modes
+if [ "$QUICK" = 0 ]; then
+    mkdir -p "$WORK/huge/dir"
+    (cd "$WORK/huge/dir" && seq -f "common-prefix-entry-%g" 1 70000 | xargs touch)
+    ntree/ntree --reference "$WORK/huge" > "$WORK/expected"
+    for args in "--threads 1" "--threads 2" "--threads 4" "--spill 5000" "--threads 4 --spill 30000"; do
+        # shellcheck disable=SC2086
+        ntree/ntree $args "$WORK/huge" > "$WORK/actual"
+        same "$args on 70000 entries" "$WORK/expected" "$WORK/actual"
+    done
+fi
+
+# --spill in a deep tree: every level is spilled to many runs, but the parent's runs are
+# folded into one before descending, so 40 levels of 21 runs fit in 128 descriptors
+path="$WORK/deep-spill"
+for level in $(seq 1 40); do
+    mkdir -p "$path"
+    (cd "$path" && seq -f "file%g" 1 20 | xargs touch)
+    path="$path/level$level"
+done
+for args in "" "--audit" "--by-owner" "--processes 2"; do
+    # shellcheck disable=SC2086
+    ntree/ntree --reference $args "$WORK/deep-spill" > "$WORK/expected" 2> /dev/null
+    # shellcheck disable=SC2086
+    (ulimit -n 128 && ntree/ntree --spill 1 $args "$WORK/deep-spill" > "$WORK/actual" 2> /dev/null)
+    same "--spill 1 $args in a 40-level tree with 128 descriptors" "$WORK/expected" "$WORK/actual"
+done
+
+# Shards written separately and merged
+ntree/ntree --reference --by-owner "$TREE" > "$WORK/expected" 2> /dev/null
+ntree/ntree --by-owner --shard 1/2 --spill 3 "$TREE" > "$WORK/shard1" 2> /dev/null
+ntree/ntree --by-owner --shard 0/2 --threads 4 "$TREE" > "$WORK/shard0" 2> /dev/null
+ntree/ntree --merge "$WORK/shard1" "$WORK/shard0" > "$WORK/actual"
+same "--shard 0/2 + 1/2, --merge" "$WORK/expected" "$WORK/actual"
+# Shards of different directories must not merge
+ntree/ntree --shard 1/2 "$WORK/files" > "$WORK/shard1" 2> /dev/null
+CHECKS=$((CHECKS + 1))
+if ntree/ntree --merge "$WORK/shard1" "$WORK/shard0" > /dev/null 2>&1; then
+    FAILURES=$((FAILURES + 1))
+    echo "MISMATCH: --merge accepted shards of different directories" >&2
+fi
+
+# The archive itself must not depend on the mode either
+ntree/ntree --reference --tar "$WORK/expected.tar" "$TREE" > /dev/null 2>&1
+for args in "--spill 5" "--threads 4 --network"; do
+    # shellcheck disable=SC2086
+    ntree/ntree $args --tar "$WORK/actual.tar" "$TREE" > /dev/null 2>&1
+    same "--tar with $args" "$WORK/expected.tar" "$WORK/actual.tar"
+done
+# Symbolic links are archived as links and never followed: the dangling one too, and nothing below the
+# link to a directory
+if command -v tar > /dev/null; then
+    printf 'dangling -> %s\nlink-to-dir -> %s\n' "$TREE/does-not-exist" "$TREE/empty" > "$WORK/expected"
+    { tar tvf "$WORK/expected.tar" | awk '/^l/ { print $6, $7, $8 }'; tar tf "$WORK/expected.tar" | grep '^link-to-dir/'; } > "$WORK/actual"
+    same "--tar stores symbolic links" "$WORK/expected" "$WORK/actual"
+fi
+# An archive written inside the tree does not go into itself
+mkdir "$WORK/self"
+echo a > "$WORK/self/a"
+ntree/ntree --tar "$WORK/self/self.tar" "$WORK/self" > /dev/null 2>&1
+if command -v tar > /dev/null; then
+    echo a > "$WORK/expected"
+    tar tf "$WORK/self/self.tar" > "$WORK/actual"
+    same "--tar inside the tree" "$WORK/expected" "$WORK/actual"
+fi
+# An entry left out of the archive (a FIFO here) makes --tar fail, so an incomplete archive is noticed
+if mkfifo "$WORK/self/fifo" 2> /dev/null; then
+    CHECKS=$((CHECKS + 1))
+    if ntree/ntree --tar "$WORK/fifo.tar" "$WORK/self" > /dev/null 2>&1; then
+        FAILURES=$((FAILURES + 1))
+        echo "MISMATCH: --tar exited 0 after leaving out a FIFO" >&2
+    fi
+fi
+
+# One job runs the batches in order, so --exec output is deterministic too
+ntree/ntree --reference --exec-jobs 1 --exec printf '%s\n' {} + "$TREE" > "$WORK/expected" 2> /dev/null
+ntree/ntree --spill 3 --threads 4 --exec-jobs 1 --exec printf '%s\n' {} + "$TREE" > "$WORK/actual" 2> /dev/null
+same "--exec with --spill 3 --threads 4" "$WORK/expected" "$WORK/actual"
+
+echo "$CHECKS comparisons, $FAILURES mismatches" >&2
+[ "$FAILURES" = 0 ]
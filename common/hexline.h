@@ -0,0 +1,72 @@
+#ifndef NCOMMANDS_HEXLINE_H
+#define NCOMMANDS_HEXLINE_H
+
+#include <stddef.h>    // For size_t
+
+// Upper bound on the length of one formatted line for n bytes per line (including the newline).
+// Offset "XXXXXXXX: " (up to 16 digits on huge offsets) + hex 3n + middle space + " |" + ASCII n + "|\n"
+#define HEX_LINE_SIZE(n) (18 + 4 * (size_t)(n) + 5)
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+/**
+ * @brief Formats one line of a hex dump into dst, exactly as nhex prints it:
+ *
+ *     XXXXXXXX: HH HH HH HH  HH HH HH HH  |........|
+ *
+ * The hex block is padded to bytes_per_line so the ASCII column stays aligned on a short
+ * last line, and an extra space separates the two halves of the hex block.
+ *
+ * @param dst Destination buffer, at least HEX_LINE_SIZE(bytes_per_line) bytes long.
+ * @param offset The file offset of the first byte, printed as the line's address.
+ * @param bytes The bytes to show on this line.
+ * @param count The number of valid bytes (at most bytes_per_line).
+ * @param bytes_per_line The width of a full line.
+ * @return The number of characters written (no terminating NUL is added).
+ */
+static inline size_t format_hex_line(char *dst, unsigned long offset, const unsigned char *bytes,
+                                     int count, int bytes_per_line) {
+    char *out = dst;
+
+    // Print the file offset (address) in hexadecimal, at least 8 digits like "%08lX"
+    int digits = 8;
+    while (digits < (int)(2 * sizeof(offset)) && (offset >> (4 * digits)) != 0) {
+        digits++;
+    }
+    for (int shift = 4 * (digits - 1); shift >= 0; shift -= 4) {
+        *out++ = hex_digits[(offset >> shift) & 0xF];
+    }
+    *out++ = ':';
+    *out++ = ' ';
+
+    // Print hexadecimal representation of each byte
+    for (int i = 0; i < bytes_per_line; i++) {
+        if (i < count) {
+            *out++ = hex_digits[bytes[i] >> 4];
+            *out++ = hex_digits[bytes[i] & 0xF];
+            *out++ = ' ';
+        } else {
+            // Pad if the last line is not full
+            *out++ = ' ';
+            *out++ = ' ';
+            *out++ = ' ';
+        }
+        // Add an extra space in the middle of the hex block for readability
+        if (bytes_per_line >= 2 && i == (bytes_per_line / 2) - 1) {
+            *out++ = ' ';
+        }
+    }
+
+    // Print ASCII representation of each byte (printable ASCII or '.')
+    *out++ = ' ';
+    *out++ = '|';
+    for (int i = 0; i < count; i++) {
+        *out++ = (bytes[i] >= 0x20 && bytes[i] < 0x7F) ? (char)bytes[i] : '.';
+    }
+    *out++ = '|';
+    *out++ = '\n';
+
+    return (size_t)(out - dst);
+}
+
+#endif // NCOMMANDS_HEXLINE_H
@@ -0,0 +1,941 @@
+#include "ncore.h"
+
+#include <stdio.h>     // For fprintf, vsnprintf
+#include <stdlib.h>    // For malloc, realloc, free, strtoull
+#include <string.h>    // For memcpy, strcmp, strncmp, strchr, strlen
+#include <errno.h>     // For errno, EINTR
+#include <unistd.h>    // For write
+#include <pthread.h>   // For pthread_create, pthread_join, mutexes and condition variables
+#include <stdint.h>    // For uint64_t
+#include <time.h>      // For clock_gettime, CLOCK_MONOTONIC
+#include <sys/ioctl.h> // For ioctl
+#include <sys/syscall.h> // For SYS_perf_event_open
+#include <linux/perf_event.h> // For struct perf_event_attr, PERF_* constants
+
+/* ------------------------------------------------------------------------- */
+/* NWriter                                                                   */
+/* ------------------------------------------------------------------------- */
+
+int nw_init(NWriter *writer, int fd, size_t capacity) {
+    writer->fd = fd;
+    writer->length = 0;
+    writer->capacity = capacity ? capacity : NW_DEFAULT_CAPACITY;
+    writer->failed = 0;
+    writer->borrowed = 0;
+    writer->buffer = (char *)malloc(writer->capacity);
+    if (!writer->buffer) {
+        writer->capacity = 0;
+        writer->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+void nw_init_buffer(NWriter *writer, int fd, char *buffer, size_t capacity) {
+    writer->fd = fd;
+    writer->buffer = buffer;
+    writer->length = 0;
+    writer->capacity = capacity;
+    writer->failed = 0;
+    writer->borrowed = 1;
+}
+
+int nw_flush(NWriter *writer) {
+    if (writer->fd < 0) {
+        return writer->failed ? -1 : 0; // Memory writers keep everything
+    }
+
+    const char *data = writer->buffer;
+    size_t remaining = writer->length;
+    while (remaining > 0 && !writer->failed) {
+        ssize_t written = write(writer->fd, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            writer->failed = 1; // e.g. EPIPE when the reader went away
+            break;
+        }
+        data += written;
+        remaining -= (size_t)written;
+    }
+    writer->length = 0;
+    return writer->failed ? -1 : 0;
+}
+
+void nw_free(NWriter *writer) {
+    if (!writer->borrowed) {
+        free(writer->buffer);
+    }
+    writer->borrowed = 0;
+    writer->buffer = NULL;
+    writer->length = 0;
+    writer->capacity = 0;
+}
+
+char *nw_reserve(NWriter *writer, size_t length) {
+    if (writer->failed) {
+        return NULL;
+    }
+    if (writer->length + length <= writer->capacity) {
+        return writer->buffer + writer->length;
+    }
+
+    // Make room by writing out what is pending; grow only if a single request is bigger than the buffer
+    if (writer->fd >= 0) {
+        nw_flush(writer);
+        if (writer->failed) {
+            return NULL;
+        }
+    }
+    if (writer->length + length > writer->capacity) {
+        size_t new_capacity = writer->capacity ? writer->capacity : NW_DEFAULT_CAPACITY;
+        while (new_capacity < writer->length + length) {
+            new_capacity *= 2;
+        }
+        // A caller's buffer cannot be reallocated; move its contents to the heap instead
+        char *new_buffer = (char *)(writer->borrowed ? malloc(new_capacity) : realloc(writer->buffer, new_capacity));
+        if (!new_buffer) {
+            writer->failed = 1;
+            return NULL;
+        }
+        if (writer->borrowed) {
+            memcpy(new_buffer, writer->buffer, writer->length);
+            writer->borrowed = 0;
+        }
+        writer->buffer = new_buffer;
+        writer->capacity = new_capacity;
+    }
+    return writer->buffer + writer->length;
+}
+
+void nw_write(NWriter *writer, const void *data, size_t length) {
+    // Large writes to a file descriptor bypass the buffer
+    if (writer->fd >= 0 && length >= writer->capacity) {
+        if (nw_flush(writer) != 0) {
+            return;
+        }
+        writer->length = length;
+        char *saved = writer->buffer;
+        writer->buffer = (char *)data;
+        nw_flush(writer);
+        writer->buffer = saved;
+        return;
+    }
+
+    char *out = nw_reserve(writer, length);
+    if (out) {
+        memcpy(out, data, length);
+        writer->length += length;
+    }
+}
+
+void nw_puts(NWriter *writer, const char *string) {
+    nw_write(writer, string, strlen(string));
+}
+
+void nw_vprintf(NWriter *writer, const char *format, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+
+    // Try to format in place; if it doesn't fit, reserve exactly what is needed and format again
+    size_t room = writer->failed ? 0 : writer->capacity - writer->length;
+    int needed = vsnprintf(writer->buffer + writer->length, room, format, args);
+    if (needed < 0) {
+        va_end(copy);
+        return;
+    }
+    if ((size_t)needed < room) {
+        writer->length += (size_t)needed;
+    } else {
+        char *out = nw_reserve(writer, (size_t)needed + 1);
+        if (out) {
+            vsnprintf(out, (size_t)needed + 1, format, copy);
+            writer->length += (size_t)needed;
+        }
+    }
+    va_end(copy);
+}
+
+void nw_printf(NWriter *writer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    nw_vprintf(writer, format, args);
+    va_end(args);
+}
+
+/* ------------------------------------------------------------------------- */
+/* NArena                                                                    */
+/* ------------------------------------------------------------------------- */
+
+struct NArenaBlock {
+    NArenaBlock *next; // Older block
+    size_t size;       // Usable bytes in data
+    size_t used;       // Bytes handed out from data
+    max_align_t data[]; // The memory itself, aligned for any type
+};
+
+void na_init(NArena *arena, size_t block_size) {
+    arena->head = NULL;
+    arena->block_size = block_size ? block_size : NA_DEFAULT_BLOCK_SIZE;
+    arena->next_size = arena->block_size < NA_FIRST_BLOCK_SIZE ? arena->block_size : NA_FIRST_BLOCK_SIZE;
+}
+
+void *na_alloc(NArena *arena, size_t size) {
+    size_t align = sizeof(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+
+    NArenaBlock *block = arena->head;
+    if (!block || block->used + size > block->size) {
+        size_t block_size = size > arena->next_size ? size : arena->next_size;
+        if (arena->next_size < arena->block_size) {
+            arena->next_size = arena->next_size * 2 < arena->block_size ? arena->next_size * 2 : arena->block_size;
+        }
+        block = (NArenaBlock *)malloc(sizeof(NArenaBlock) + block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    void *memory = (char *)block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+char *na_strndup(NArena *arena, const char *string, size_t length) {
+    char *copy = (char *)na_alloc(arena, length + 1);
+    if (copy) {
+        memcpy(copy, string, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+void na_reset(NArena *arena) {
+    if (!arena->head) {
+        return;
+    }
+    NArenaBlock *block = arena->head->next;
+    while (block) {
+        NArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head->next = NULL;
+    arena->head->used = 0;
+}
+
+void na_free(NArena *arena) {
+    na_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+/* NPool                                                                     */
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    NTaskFn fn;
+    void *arg;
+} NTask;
+
+// A worker's tasks: the owner pushes and pops at the tail, thieves take from the head
+typedef struct {
+    pthread_mutex_t lock;
+    NTask *tasks;    // Ring buffer of tasks
+    size_t head;     // Index of the oldest task
+    size_t count;    // Number of queued tasks
+    size_t capacity; // Size of the ring buffer
+} NDeque;
+
+struct NPool {
+    int num_workers;          // Number of worker threads
+    pthread_t *threads;       // The workers
+    NDeque *deques;           // One deque per worker, plus one for threads outside the pool
+    pthread_mutex_t lock;     // Protects the counters below
+    pthread_cond_t work;      // Signalled when a task is queued or the pool stops
+    pthread_cond_t done;      // Signalled when the last unfinished task finishes
+    size_t queued;            // Tasks sitting in deques
+    size_t unfinished;        // Tasks submitted but not yet finished
+    unsigned int next_deque;  // Round-robin target for submissions from outside the pool
+    int stop;                 // Set by np_destroy
+};
+
+// Index of the pool worker running on this thread, or -1 outside the pool
+static __thread int np_worker_index = -1;
+static __thread NPool *np_worker_pool = NULL;
+
+static int deque_push(NDeque *deque, NTask task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        size_t new_capacity = deque->capacity ? deque->capacity * 2 : 64;
+        NTask *new_tasks = (NTask *)malloc(new_capacity * sizeof(NTask));
+        if (!new_tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        for (size_t i = 0; i < deque->count; i++) {
+            new_tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = new_tasks;
+        deque->head = 0;
+        deque->capacity = new_capacity;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+// Takes the newest task (from_tail) or the oldest one. Returns 1 if a task was taken.
+static int deque_take(NDeque *deque, NTask *task, int from_tail) {
+    int taken = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        if (from_tail) {
+            *task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+        } else {
+            *task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        }
+        deque->count--;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+// Finds a task for worker self: its own newest task first, otherwise the oldest task of another deque
+static int pool_find_task(NPool *pool, int self, NTask *task) {
+    int num_deques = pool->num_workers + 1;
+    if (self >= 0 && deque_take(&pool->deques[self], task, 1)) {
+        return 1;
+    }
+    for (int i = 1; i <= num_deques; i++) {
+        int victim = ((self >= 0 ? self : 0) + i) % num_deques;
+        if (deque_take(&pool->deques[victim], task, 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Runs a task taken from a deque and updates the counters
+static void pool_run_task(NPool *pool, NTask task) {
+    pthread_mutex_lock(&pool->lock);
+    pool->queued--;
+    pthread_mutex_unlock(&pool->lock);
+
+    task.fn(task.arg);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->unfinished == 0) {
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *pool_worker(void *arg) {
+    NPool *pool = (NPool *)arg;
+    int self = np_worker_index;
+    NTask task;
+
+    for (;;) {
+        if (pool_find_task(pool, self, &task)) {
+            pool_run_task(pool, task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        int stop = pool->stop && pool->queued == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+// Trampoline that records the worker's index before entering the worker loop
+typedef struct {
+    NPool *pool;
+    int index;
+} NWorkerStart;
+
+static void *pool_worker_start(void *arg) {
+    NWorkerStart start = *(NWorkerStart *)arg;
+    free(arg);
+    np_worker_index = start.index;
+    np_worker_pool = start.pool;
+    return pool_worker(start.pool);
+}
+
+NPool *np_create(int num_workers) {
+    NPool *pool = (NPool *)calloc(1, sizeof(NPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->deques = (NDeque *)calloc((size_t)num_workers + 1, sizeof(NDeque));
+    pool->threads = (pthread_t *)calloc((size_t)num_workers + 1, sizeof(pthread_t));
+    if (!pool->deques || !pool->threads) {
+        free(pool->deques);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i <= num_workers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    // Start the workers; if some cannot be created the pool simply has fewer
+    for (int i = 0; i < num_workers; i++) {
+        NWorkerStart *start = (NWorkerStart *)malloc(sizeof(NWorkerStart));
+        if (!start) {
+            break;
+        }
+        start->pool = pool;
+        start->index = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_worker_start, start) != 0) {
+            free(start);
+            break;
+        }
+        pool->num_workers++;
+    }
+    return pool;
+}
+
+void np_submit(NPool *pool, NTaskFn fn, void *arg) {
+    NTask task = {fn, arg};
+    int target;
+
+    // Workers keep their own subtasks; other threads spread tasks round-robin.
+    // The task is counted before it is pushed: once in a deque it can be stolen and finished at once.
+    pthread_mutex_lock(&pool->lock);
+    if (np_worker_pool == pool && np_worker_index >= 0) {
+        target = np_worker_index;
+    } else {
+        target = (int)(pool->next_deque++ % (unsigned int)(pool->num_workers + 1));
+    }
+    pool->queued++;
+    pool->unfinished++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (deque_push(&pool->deques[target], task) != 0) {
+        // Out of memory: take the count back and run it right here instead
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        if (--pool->unfinished == 0) {
+            pthread_cond_broadcast(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        fn(arg);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void np_wait(NPool *pool) {
+    int self = (np_worker_pool == pool) ? np_worker_index : pool->num_workers;
+    NTask task;
+
+    for (;;) {
+        // Help with the queued work instead of just sleeping
+        if (pool_find_task(pool, self, &task)) {
+            pool_run_task(pool, task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        if (pool->unfinished == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+        if (pool->queued == 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+int np_concurrency(const NPool *pool) {
+    return pool->num_workers + 1;
+}
+
+void np_destroy(NPool *pool) {
+    if (!pool) {
+        return;
+    }
+    np_wait(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (int i = 0; i <= pool->num_workers; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+/* ------------------------------------------------------------------------- */
+/* NOption                                                                   */
+/* ------------------------------------------------------------------------- */
+
+int nopt_next(NOptState *state, int argc, char **argv, const NOption *table) {
+    if (state->index < 1) {
+        state->index = 1;
+    }
+    if (state->index >= argc) {
+        return NOPT_END;
+    }
+
+    const char *argument = argv[state->index++];
+    state->arg = NULL;
+
+    // Positional arguments: anything after "--", a lone "-", or text without a leading dash
+    if (state->only_positional || argument[0] != '-' || argument[1] == '\0') {
+        state->arg = argument;
+        return NOPT_POSITIONAL;
+    }
+    if (strcmp(argument, "--") == 0) {
+        state->only_positional = 1;
+        return nopt_next(state, argc, argv, table);
+    }
+
+    const NOption *option = NULL;
+    const char *inline_value = NULL;
+
+    if (argument[1] == '-') {
+        // --name or --name=value
+        const char *name = argument + 2;
+        const char *equals = strchr(name, '=');
+        size_t name_length = equals ? (size_t)(equals - name) : strlen(name);
+        for (const NOption *candidate = table; candidate->id != 0; candidate++) {
+            if (candidate->name && strncmp(candidate->name, name, name_length) == 0 &&
+                candidate->name[name_length] == '\0') {
+                option = candidate;
+                break;
+            }
+        }
+        if (option && equals) {
+            inline_value = equals + 1;
+        }
+    } else {
+        // -c or -cVALUE
+        for (const NOption *candidate = table; candidate->id != 0; candidate++) {
+            if (candidate->short_name && candidate->short_name == argument[1]) {
+                option = candidate;
+                break;
+            }
+        }
+        if (option && argument[2] != '\0') {
+            inline_value = option->has_arg ? argument + 2 : NULL;
+            if (!option->has_arg) {
+                option = NULL; // Bundled flags are not supported
+            }
+        }
+    }
+
+    if (!option) {
+        fprintf(stderr, "Error: Unknown option '%s'\n", argument);
+        return NOPT_ERROR;
+    }
+    if (option->has_arg) {
+        if (inline_value) {
+            state->arg = inline_value;
+        } else if (state->index < argc) {
+            state->arg = argv[state->index++];
+        } else {
+            fprintf(stderr, "Error: Option '%s' needs a value\n", argument);
+            return NOPT_ERROR;
+        }
+    } else if (inline_value) {
+        fprintf(stderr, "Error: Option '%s' does not take a value\n", argument);
+        return NOPT_ERROR;
+    }
+    return option->id;
+}
+
+int nopt_parse_size(const char *text, unsigned long long *value) {
+    char *end;
+
+    if (!text || *text == '\0' || *text == '-') {
+        return -1;
+    }
+    errno = 0;
+    *value = strtoull(text, &end, 0);
+    if (errno != 0 || end == text) {
+        return -1;
+    }
+
+    unsigned long long multiplier = 1;
+    switch (*end) {
+        case 'k': case 'K': multiplier = 1ULL << 10; end++; break;
+        case 'm': case 'M': multiplier = 1ULL << 20; end++; break;
+        case 'g': case 'G': multiplier = 1ULL << 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || (*value != 0 && multiplier > ~0ULL / *value)) {
+        return -1;
+    }
+    *value *= multiplier;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* NPerf                                                                     */
+/* ------------------------------------------------------------------------- */
+
+#define NPERF_NUM_COUNTERS 4
+
+// The counters, in report order
+static const struct {
+    uint64_t config; // PERF_COUNT_HW_* event
+    const char *name;
+} nperf_events[NPERF_NUM_COUNTERS] = {
+    {PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+    {PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+};
+
+int nperf_active = 0;
+
+static int nperf_group_fd = -1;                  // Group leader (the first counter that opened)
+static int nperf_fds[NPERF_NUM_COUNTERS];        // Every open counter
+static int nperf_slot[NPERF_NUM_COUNTERS];       // Position of each counter in a group read, or -1 if unavailable
+static int nperf_num_open;                       // Number of counters in the group
+static const char *const *nperf_names;           // Phase names
+static int nperf_num_phases;
+static int nperf_current;                        // Phase being charged
+static double nperf_last_time;                   // Clock at the last switch
+static double nperf_last[NPERF_NUM_COUNTERS];    // Counter totals at the last switch
+static double nperf_time[NPERF_MAX_PHASES];      // Wall seconds per phase
+static double nperf_counts[NPERF_MAX_PHASES][NPERF_NUM_COUNTERS]; // Counter deltas per phase
+static int nperf_multiplexed;                    // Set if the kernel had to time-share the counters
+
+static double nperf_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Reads all counters with one read() of the group, scaled up if they were multiplexed
+static void nperf_read(double totals[NPERF_NUM_COUNTERS]) {
+    // Layout of a PERF_FORMAT_GROUP read: nr, time_enabled, time_running, then one value per counter
+    uint64_t data[3 + NPERF_NUM_COUNTERS];
+
+    if (nperf_group_fd < 0 || read(nperf_group_fd, data, sizeof(data)) < (ssize_t)(3 * sizeof(uint64_t))) {
+        return;
+    }
+    double scale = 1.0;
+    if (data[2] > 0 && data[2] < data[1]) {
+        scale = (double)data[1] / (double)data[2];
+        nperf_multiplexed = 1;
+    }
+    for (int c = 0; c < NPERF_NUM_COUNTERS; c++) {
+        if (nperf_slot[c] >= 0 && (uint64_t)nperf_slot[c] < data[0]) {
+            totals[c] = (double)data[3 + nperf_slot[c]] * scale;
+        }
+    }
+}
+
+void nperf_start(const char *const *phase_names, int num_phases, int first_phase) {
+    int error = 0;
+
+    nperf_names = phase_names;
+    nperf_num_phases = num_phases < NPERF_MAX_PHASES ? num_phases : NPERF_MAX_PHASES;
+    nperf_current = first_phase;
+
+    for (int c = 0; c < NPERF_NUM_COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = nperf_events[c].config;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit = 1;        // Count threads (and children) created from now on
+        attr.exclude_kernel = 1; // Allowed at perf_event_paranoid 2, and the kernel is not what we tune
+        attr.exclude_hv = 1;
+
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, nperf_group_fd, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0) {
+            nperf_slot[c] = -1;
+            error = errno;
+            continue;
+        }
+        if (nperf_group_fd < 0) {
+            nperf_group_fd = fd;
+        }
+        nperf_fds[nperf_num_open] = fd;
+        nperf_slot[c] = nperf_num_open++;
+    }
+
+    if (nperf_num_open == 0) {
+        fprintf(stderr, "perf: hardware counters unavailable (%s%s); reporting wall time only\n", strerror(error),
+                error == EACCES || error == EPERM ? ", see /proc/sys/kernel/perf_event_paranoid" : "");
+    } else if (nperf_num_open < NPERF_NUM_COUNTERS) {
+        fprintf(stderr, "perf: some hardware counters are unavailable (%s)\n", strerror(error));
+    }
+
+    nperf_read(nperf_last);
+    nperf_last_time = nperf_now();
+    nperf_active = 1;
+}
+
+void nperf_switch(int phase) {
+    double totals[NPERF_NUM_COUNTERS];
+    memcpy(totals, nperf_last, sizeof(totals));
+    nperf_read(totals);
+    double now = nperf_now();
+
+    if (nperf_current >= 0 && nperf_current < nperf_num_phases) {
+        nperf_time[nperf_current] += now - nperf_last_time;
+        for (int c = 0; c < NPERF_NUM_COUNTERS; c++) {
+            nperf_counts[nperf_current][c] += totals[c] - nperf_last[c];
+        }
+    }
+    memcpy(nperf_last, totals, sizeof(totals));
+    nperf_last_time = now;
+    nperf_current = phase;
+}
+
+// Prints one report row
+static void nperf_print_row(const char *name, double seconds, const double counts[NPERF_NUM_COUNTERS]) {
+    fprintf(stderr, "perf: %-10s %10.3f", name, seconds * 1e3);
+    for (int c = 0; c < NPERF_NUM_COUNTERS; c++) {
+        if (nperf_slot[c] >= 0) {
+            fprintf(stderr, " %14.0f", counts[c]);
+        } else {
+            fprintf(stderr, " %14s", "-");
+        }
+        // IPC follows the instructions column
+        if (c == 1) {
+            if (nperf_slot[0] >= 0 && nperf_slot[1] >= 0 && counts[0] > 0) {
+                fprintf(stderr, " %6.2f", counts[1] / counts[0]);
+            } else {
+                fprintf(stderr, " %6s", "-");
+            }
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+void nperf_report(void) {
+    if (!nperf_active) {
+        return;
+    }
+    nperf_switch(-1);
+    nperf_active = 0;
+
+    fprintf(stderr, "perf: %-10s %10s", "phase", "wall ms");
+    for (int c = 0; c < NPERF_NUM_COUNTERS; c++) {
+        fprintf(stderr, " %14s", nperf_events[c].name);
+        if (c == 1) {
+            fprintf(stderr, " %6s", "IPC");
+        }
+    }
+    fprintf(stderr, "\n");
+
+    double total_time = 0;
+    double totals[NPERF_NUM_COUNTERS] = {0};
+    for (int p = 0; p < nperf_num_phases; p++) {
+        nperf_print_row(nperf_names[p], nperf_time[p], nperf_counts[p]);
+        total_time += nperf_time[p];
+        for (int c = 0; c < NPERF_NUM_COUNTERS; c++) {
+            totals[c] += nperf_counts[p][c];
+        }
+    }
+    nperf_print_row("total", total_time, totals);
+    if (nperf_multiplexed) {
+        fprintf(stderr, "perf: counters were multiplexed; values are scaled estimates\n");
+    }
+
+    for (int i = 0; i < nperf_num_open; i++) {
+        close(nperf_fds[i]);
+    }
+    nperf_group_fd = -1;
+    nperf_num_open = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* NMem                                                                      */
+/* ------------------------------------------------------------------------- */
+
+#ifdef NCORE_MEM_STATS
+
+// The wrappers below call the real allocator
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+#undef strndup
+#undef free
+
+// Most call sites tracked (a power of two); allocations beyond that are only counted in the totals
+#define NMEM_MAX_SITES 512
+// Call sites listed in the report
+#define NMEM_REPORT_SITES 20
+
+// What one call site allocated
+typedef struct {
+    const char *site;         // "file:line", or NULL for a free slot
+    unsigned long long calls; // Allocations (and reallocations) made there
+    unsigned long long bytes; // Bytes requested there
+} NMemSite;
+
+static NMemSite nmem_sites[NMEM_MAX_SITES];
+static pthread_mutex_t nmem_sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Totals, updated atomically since the sort and stat pools allocate from several threads
+static unsigned long long nmem_allocations; // malloc, calloc, strdup, strndup and realloc(NULL, n)
+static unsigned long long nmem_reallocations;
+static unsigned long long nmem_frees;
+static unsigned long long nmem_bytes;       // Bytes requested in all
+static long long nmem_live;                 // Usable bytes currently allocated (less memory from libc freed here)
+static long long nmem_peak;                 // Most usable bytes allocated at once
+
+// Charges size bytes to a call site. The site strings are literals, so their addresses identify them.
+static void nmem_count_site(const char *site, size_t size) {
+    size_t slot = ((uintptr_t)site >> 3) & (NMEM_MAX_SITES - 1);
+
+    pthread_mutex_lock(&nmem_sites_lock);
+    for (size_t probe = 0; probe < NMEM_MAX_SITES; probe++) {
+        NMemSite *entry = &nmem_sites[(slot + probe) & (NMEM_MAX_SITES - 1)];
+        if (entry->site == site || !entry->site) {
+            entry->site = site;
+            entry->calls++;
+            entry->bytes += size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&nmem_sites_lock);
+}
+
+// Adjusts the live byte count by delta (usable sizes) and raises the peak if needed
+static void nmem_count_live(long long delta) {
+    long long live = __atomic_add_fetch(&nmem_live, delta, __ATOMIC_RELAXED);
+    long long peak = __atomic_load_n(&nmem_peak, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&nmem_peak, &peak, live, 1, __ATOMIC_RELAXED,
+                                                       __ATOMIC_RELAXED)) {
+    }
+}
+
+// Counts a new allocation of size bytes at site, if it succeeded. Returns pointer.
+static void *nmem_count(void *pointer, size_t size, const char *site) {
+    if (pointer) {
+        __atomic_add_fetch(&nmem_allocations, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&nmem_bytes, size, __ATOMIC_RELAXED);
+        nmem_count_live((long long)malloc_usable_size(pointer));
+        nmem_count_site(site, size);
+    }
+    return pointer;
+}
+
+void *nmem_malloc(size_t size, const char *site) {
+    return nmem_count(malloc(size), size, site);
+}
+
+void *nmem_calloc(size_t count, size_t size, const char *site) {
+    return nmem_count(calloc(count, size), count * size, site);
+}
+
+char *nmem_strdup(const char *string, const char *site) {
+    return (char *)nmem_count(strdup(string), strlen(string) + 1, site);
+}
+
+char *nmem_strndup(const char *string, size_t length, const char *site) {
+    char *copy = strndup(string, length);
+    return (char *)nmem_count(copy, copy ? strlen(copy) + 1 : 0, site);
+}
+
+void *nmem_realloc(void *pointer, size_t size, const char *site) {
+    if (!pointer) {
+        return nmem_malloc(size, site);
+    }
+    if (size == 0) {
+        nmem_free(pointer); // glibc frees the block and returns NULL: count it as the free it is
+        return NULL;
+    }
+    size_t old_size = malloc_usable_size(pointer);
+    void *grown = realloc(pointer, size);
+    if (grown) {
+        __atomic_add_fetch(&nmem_reallocations, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&nmem_bytes, size, __ATOMIC_RELAXED);
+        nmem_count_live((long long)malloc_usable_size(grown) - (long long)old_size);
+        nmem_count_site(site, size);
+    }
+    return grown;
+}
+
+void nmem_free(void *pointer) {
+    if (pointer) {
+        __atomic_add_fetch(&nmem_frees, 1, __ATOMIC_RELAXED);
+        nmem_count_live(-(long long)malloc_usable_size(pointer));
+        free(pointer);
+    }
+}
+
+// qsort comparator: busiest call sites first, then by bytes
+static int nmem_compare_sites(const void *a, const void *b) {
+    const NMemSite *x = (const NMemSite *)a, *y = (const NMemSite *)b;
+    if (x->calls != y->calls) {
+        return x->calls < y->calls ? 1 : -1;
+    }
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+void nmem_report(void) {
+    NMemSite sites[NMEM_MAX_SITES];
+    size_t num_sites = 0;
+
+    pthread_mutex_lock(&nmem_sites_lock);
+    for (size_t i = 0; i < NMEM_MAX_SITES; i++) {
+        if (nmem_sites[i].site) {
+            sites[num_sites++] = nmem_sites[i];
+        }
+    }
+    pthread_mutex_unlock(&nmem_sites_lock);
+    qsort(sites, num_sites, sizeof(NMemSite), nmem_compare_sites);
+
+    fprintf(stderr, "mem: %llu allocations, %llu reallocations, %llu frees, %llu bytes requested\n",
+            nmem_allocations, nmem_reallocations, nmem_frees, nmem_bytes);
+    fprintf(stderr, "mem: peak %lld bytes live, %lld bytes still live at exit\n", nmem_peak, nmem_live);
+    fprintf(stderr, "mem: %12s %14s  %s\n", "calls", "bytes", "site");
+    for (size_t i = 0; i < num_sites && i < NMEM_REPORT_SITES; i++) {
+        fprintf(stderr, "mem: %12llu %14llu  %s\n", sites[i].calls, sites[i].bytes, sites[i].site);
+    }
+    if (num_sites > NMEM_REPORT_SITES) {
+        fprintf(stderr, "mem: ... %zu more call sites\n", num_sites - NMEM_REPORT_SITES);
+    }
+}
+
+#else
+
+void nmem_report(void) {
+    fprintf(stderr, "mem: allocation counting is not built in; rebuild with make clean && make MEM_STATS=1\n");
+}
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef NCOMMANDS_NCORE_H
+#define NCOMMANDS_NCORE_H
+
+/*
+ * ncore - the small shared library every n-command links against (libncore.a).
+ *
+ *   NWriter  buffered output straight to a file descriptor (or into memory), replacing stdio
+ *   NArena   bump allocator for many small, same-lifetime allocations (e.g. entry names)
+ *   NPool    work-stealing thread pool
+ *   NOption  table-driven command-line option parser
+ *   NPerf    per-phase hardware performance counters (--perf)
+ *   NMem     allocation counting per call site (--mem-stats, built with -DNCORE_MEM_STATS)
+ *
+ * Every command declares its entry point with NCOMMAND_MAIN(name). Built on its own that is
+ * main(); built into the ncommands multicall binary (-DNCOMMANDS_MULTICALL) it becomes
+ * name_main(), which the dispatcher in multicall/ncommands.c calls.
+ */
+
+#include <stddef.h>    // For size_t
+#include <stdarg.h>    // For va_list
+#include <stdio.h>     // For FILE, fopen, fclose
+#include <pwd.h>       // For getpwuid, fgetpwent
+#include <grp.h>       // For getgrgid, fgetgrent
+
+#ifdef NCOMMANDS_MULTICALL
+#define NCOMMAND_MAIN(name) int name##_main(int argc, char *argv[])
+#else
+#define NCOMMAND_MAIN(name) int main(int argc, char *argv[])
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* NWriter: buffered output                                                  */
+/* ------------------------------------------------------------------------- */
+
+// Default buffer size of an NWriter
+#define NW_DEFAULT_CAPACITY (64 * 1024)
+
+typedef struct {
+    int fd;          // Destination file descriptor, or -1 to collect all output in memory
+    char *buffer;    // Pending output
+    size_t length;   // Bytes pending in buffer
+    size_t capacity; // Allocated size of buffer
+    int failed;      // Set once a write or allocation fails; later output is dropped
+    int borrowed;    // Set while buffer is the caller's (nw_init_buffer) rather than allocated
+} NWriter;
+
+/**
+ * @brief Sets up a writer for fd (or for memory when fd is -1).
+ * @return 0 on success, -1 if the buffer cannot be allocated.
+ */
+int nw_init(NWriter *writer, int fd, size_t capacity);
+
+/**
+ * @brief Sets up a writer for fd that buffers in the caller's memory (e.g. on the stack).
+ *
+ * Nothing is allocated, which saves short runs a malloc. Should a memory writer, or a single
+ * request, ever need more than capacity bytes, the contents move to an allocated buffer.
+ */
+void nw_init_buffer(NWriter *writer, int fd, char *buffer, size_t capacity);
+
+// Writes everything pending to the file descriptor. Returns 0 on success, -1 on error.
+int nw_flush(NWriter *writer);
+
+// Releases the buffer (without flushing)
+void nw_free(NWriter *writer);
+
+/**
+ * @brief Makes room for length more bytes and returns where they go.
+ *
+ * Format directly into the returned space, then call nw_commit with the number of bytes used.
+ * Returns NULL (and marks the writer failed) if the room cannot be made.
+ */
+char *nw_reserve(NWriter *writer, size_t length);
+
+// Appends length bytes to the writer
+void nw_write(NWriter *writer, const void *data, size_t length);
+
+// Appends a string to the writer
+void nw_puts(NWriter *writer, const char *string);
+
+// Appends printf-style formatted output to the writer
+void nw_printf(NWriter *writer, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void nw_vprintf(NWriter *writer, const char *format, va_list args);
+
+// Marks length bytes of the space returned by nw_reserve as written
+static inline void nw_commit(NWriter *writer, size_t length) {
+    writer->length += length;
+}
+
+// Appends one character to the writer
+static inline void nw_putc(NWriter *writer, char c) {
+    char *out = nw_reserve(writer, 1);
+    if (out) {
+        *out = c;
+        writer->length++;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* NArena: bump allocator                                                    */
+/* ------------------------------------------------------------------------- */
+
+// Default block size of an NArena
+#define NA_DEFAULT_BLOCK_SIZE (64 * 1024)
+// Size of an arena's first block; each new block doubles up to the arena's block size, so an
+// arena that only ever holds a few names (a small directory) never allocates a full block
+#define NA_FIRST_BLOCK_SIZE 1024
+
+typedef struct NArenaBlock NArenaBlock;
+
+typedef struct {
+    NArenaBlock *head;  // Block currently allocated from (earlier blocks follow its next pointers)
+    size_t block_size;  // Largest size of new blocks (larger requests get a block of their own)
+    size_t next_size;   // Size of the next block, doubling from NA_FIRST_BLOCK_SIZE up to block_size
+} NArena;
+
+// Sets up an empty arena; no memory is allocated until the first na_alloc
+void na_init(NArena *arena, size_t block_size);
+
+// Allocates size bytes aligned for any type. Returns NULL if memory runs out.
+void *na_alloc(NArena *arena, size_t size);
+
+// Copies length bytes of string plus a terminating NUL into the arena. Returns NULL if memory runs out.
+char *na_strndup(NArena *arena, const char *string, size_t length);
+
+// Frees every allocation at once but keeps the most recent block for reuse
+void na_reset(NArena *arena);
+
+// Frees every allocation and all blocks
+void na_free(NArena *arena);
+
+/* ------------------------------------------------------------------------- */
+/* NPool: work-stealing thread pool                                          */
+/* ------------------------------------------------------------------------- */
+
+typedef struct NPool NPool;
+typedef void (*NTaskFn)(void *arg);
+
+/**
+ * @brief Creates a pool with num_workers worker threads (0 is allowed: np_wait then runs every task).
+ *
+ * Every worker has its own task deque. Tasks submitted from a worker go to its own deque and
+ * are taken newest-first; idle workers steal the oldest task of another worker's deque.
+ *
+ * @return The pool, or NULL if it cannot be created.
+ */
+NPool *np_create(int num_workers);
+
+// Queues fn(arg) to run on the pool
+void np_submit(NPool *pool, NTaskFn fn, void *arg);
+
+// Runs queued tasks on the calling thread too, and returns once every submitted task has finished
+void np_wait(NPool *pool);
+
+// Number of threads that work on the pool's tasks during np_wait (the workers plus the caller)
+int np_concurrency(const NPool *pool);
+
+// Waits for outstanding tasks, stops the workers and frees the pool
+void np_destroy(NPool *pool);
+
+/* ------------------------------------------------------------------------- */
+/* User and group names                                                      */
+/* ------------------------------------------------------------------------- */
+
+// A statically linked glibc cannot load NSS modules (systemd, sssd, ldap, ...) and crashes when
+// an id has to be looked up through one. Static builds (-DNCORE_STATIC) therefore only read
+// /etc/passwd and /etc/group; everything else goes through getpwuid/getgrgid.
+
+// Returns the name of a user id, or NULL if it has none. The name is valid until the next lookup.
+static inline const char *nc_user_name(unsigned long uid) {
+#ifdef NCORE_STATIC
+    FILE *passwd = fopen("/etc/passwd", "re");
+    struct passwd *pw = NULL;
+    if (passwd) {
+        while ((pw = fgetpwent(passwd)) && (unsigned long)pw->pw_uid != uid) {
+        }
+        fclose(passwd);
+    }
+#else
+    struct passwd *pw = getpwuid((uid_t)uid);
+#endif
+    return pw ? pw->pw_name : NULL;
+}
+
+// Returns the name of a group id, or NULL if it has none. The name is valid until the next lookup.
+static inline const char *nc_group_name(unsigned long gid) {
+#ifdef NCORE_STATIC
+    FILE *group = fopen("/etc/group", "re");
+    struct group *gr = NULL;
+    if (group) {
+        while ((gr = fgetgrent(group)) && (unsigned long)gr->gr_gid != gid) {
+        }
+        fclose(group);
+    }
+#else
+    struct group *gr = getgrgid((gid_t)gid);
+#endif
+    return gr ? gr->gr_name : NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+/* NOption: command-line option parser                                       */
+/* ------------------------------------------------------------------------- */
+
+// Special results of nopt_next
+#define NOPT_END        0  // No arguments left
+#define NOPT_POSITIONAL -1 // A positional argument, in state->arg
+#define NOPT_ERROR      -2 // Unknown option or missing argument (a message has been printed)
+
+typedef struct {
+    const char *name; // Long name without the dashes ("spill" for --spill), or NULL
+    char short_name;  // Single-letter name ('c' for -c), or 0
+    int has_arg;      // 1 if the option takes an argument (--name VALUE, --name=VALUE, -cVALUE, -c VALUE)
+    int id;           // Positive value returned by nopt_next when the option is found
+} NOption;
+
+typedef struct {
+    int index;       // Index of the next argument to look at (start at 1)
+    const char *arg; // The option's argument, or the positional argument
+    int only_positional; // Set after "--": everything else is positional
+} NOptState;
+
+/**
+ * @brief Returns the next option id from argv, NOPT_POSITIONAL, NOPT_END or NOPT_ERROR.
+ *
+ * The table ends with an entry whose id is 0. Callers may advance state->index themselves
+ * to consume extra arguments (e.g. a command line that runs up to a terminator).
+ */
+int nopt_next(NOptState *state, int argc, char **argv, const NOption *table);
+
+/**
+ * @brief Parses a non-negative number with an optional 0x prefix and K/M/G suffix (powers of 1024).
+ * @return 0 on success, -1 if the text is not such a number.
+ */
+int nopt_parse_size(const char *text, unsigned long long *value);
+
+/* ------------------------------------------------------------------------- */
+/* NPerf: per-phase hardware performance counters                            */
+/* ------------------------------------------------------------------------- */
+
+// Most phases a command can report
+#define NPERF_MAX_PHASES 16
+
+// Set by nperf_start; phase switches cost nothing while it is 0
+extern int nperf_active;
+
+/**
+ * @brief Starts counting cycles, instructions, cache misses and branch misses for the whole process.
+ *
+ * The counters are opened with perf_event_open and inherited by threads created later, so
+ * call this before starting any. Time is charged to the current phase until the next
+ * nperf_phase call. If the kernel refuses some or all counters (perf_event_paranoid,
+ * containers, VMs without a PMU), a note is printed and those columns are reported as "-";
+ * wall time per phase is always available.
+ *
+ * @param phase_names Names of the phases, indexed by phase number.
+ * @param num_phases Number of phases (at most NPERF_MAX_PHASES).
+ * @param first_phase The phase that starts now.
+ */
+void nperf_start(const char *const *phase_names, int num_phases, int first_phase);
+
+// Charges everything since the last switch to the current phase and makes phase current
+void nperf_switch(int phase);
+
+// Switches to another phase (a no-op unless nperf_start was called)
+static inline void nperf_phase(int phase) {
+    if (nperf_active) {
+        nperf_switch(phase);
+    }
+}
+
+// Closes the current phase and prints a table of wall time, counters and IPC per phase to stderr
+void nperf_report(void);
+
+/* ------------------------------------------------------------------------- */
+/* NMem: allocation counting per call site                                   */
+/* ------------------------------------------------------------------------- */
+
+// Built with -DNCORE_MEM_STATS (make MEM_STATS=1), every file that includes this header has its
+// malloc, calloc, realloc, strdup, strndup and free calls routed through counting wrappers that
+// record the call site. Allocations made inside libc (fopen, qsort, ...) are not seen. Sizes are
+// the allocator's usable sizes, so frees need no header and memory from libc can still be freed.
+#ifdef NCORE_MEM_STATS
+#include <stdlib.h>    // For malloc, calloc, realloc, free (declared before the macros below)
+#include <string.h>    // For strdup, strndup
+#include <malloc.h>    // For malloc_usable_size
+
+void *nmem_malloc(size_t size, const char *site);
+void *nmem_calloc(size_t count, size_t size, const char *site);
+void *nmem_realloc(void *pointer, size_t size, const char *site);
+char *nmem_strdup(const char *string, const char *site);
+char *nmem_strndup(const char *string, size_t length, const char *site);
+void nmem_free(void *pointer);
+
+#define NMEM_STRING(x) #x
+#define NMEM_LINE(x) NMEM_STRING(x)
+#define NMEM_SITE __FILE__ ":" NMEM_LINE(__LINE__)
+
+#undef strdup
+#undef strndup
+#define malloc(size) nmem_malloc((size), NMEM_SITE)
+#define calloc(count, size) nmem_calloc((count), (size), NMEM_SITE)
+#define realloc(pointer, size) nmem_realloc((pointer), (size), NMEM_SITE)
+#define strdup(string) nmem_strdup((string), NMEM_SITE)
+#define strndup(string, length) nmem_strndup((string), (length), NMEM_SITE)
+#define free(pointer) nmem_free(pointer)
+#endif
+
+/**
+ * @brief Prints allocation totals, peak live bytes and the busiest call sites to stderr.
+ *
+ * Call it last, after the command has freed what it means to free: whatever is still live
+ * is reported as such. Without -DNCORE_MEM_STATS it prints how to build with counting.
+ */
+void nmem_report(void);
+
+#endif // NCOMMANDS_NCORE_H
@@ -0,0 +1,1159 @@
+#define _GNU_SOURCE    // For memmem (must come before any #include)
+#include "nregex.h"
+
+#include <stdio.h>     // For fprintf
+#include <stdlib.h>    // For malloc, calloc, realloc, free, qsort
+#include <string.h>    // For memmem, memchr, memcmp, memcpy, memset
+#include <ctype.h>     // For isalpha, isprint and the other [:name:] classes
+#include <stdint.h>    // For uint64_t, uint32_t
+#include "ncore.h"     // For NArena (and the allocation counters of MEM_STATS builds)
+
+// Most NFA states a pattern may compile to (counted repetition copies its operand)
+#define NRE_MAX_NFA_STATES 100000
+// Most DFA states; patterns like (a|b)*a(a|b){20} need exponentially many
+#define NRE_MAX_DFA_STATES 10000
+// Longest literal prefix used by the prefilter
+#define NRE_MAX_PREFIX 64
+
+// DFA state 0 is the dead state: once there, no match can follow
+#define NRE_DEAD 0
+
+// DFA state flags
+#define NRE_ACCEPT     1 // A match ends here
+#define NRE_ACCEPT_EOF 2 // A match ends here if this is the end of the data ($)
+
+/* ------------------------------------------------------------------------- */
+/* Parser: pattern -> syntax tree                                            */
+/* ------------------------------------------------------------------------- */
+
+// A set of bytes
+typedef struct {
+    uint64_t bits[4];
+} ByteSet;
+
+static void set_add(ByteSet *set, int byte) {
+    set->bits[byte >> 6] |= (uint64_t)1 << (byte & 63);
+}
+
+static int set_has(const ByteSet *set, int byte) {
+    return (set->bits[byte >> 6] >> (byte & 63)) & 1;
+}
+
+static void set_add_range(ByteSet *set, int low, int high) {
+    for (int byte = low; byte <= high; byte++) {
+        set_add(set, byte);
+    }
+}
+
+static void set_invert(ByteSet *set) {
+    for (int i = 0; i < 4; i++) {
+        set->bits[i] = ~set->bits[i];
+    }
+}
+
+static void set_union(ByteSet *set, const ByteSet *other) {
+    for (int i = 0; i < 4; i++) {
+        set->bits[i] |= other->bits[i];
+    }
+}
+
+typedef enum {
+    NODE_SET,    // One byte out of set
+    NODE_EMPTY,  // The empty string
+    NODE_BEGIN,  // ^
+    NODE_END,    // $
+    NODE_CONCAT, // left then right
+    NODE_ALT,    // left or right
+    NODE_REPEAT, // left, min to max times (max -1 = unbounded)
+} NodeType;
+
+typedef struct Node {
+    NodeType type;
+    ByteSet set;
+    struct Node *left, *right;
+    int min, max;
+} Node;
+
+typedef struct {
+    const char *pattern; // The whole pattern, for error messages
+    const char *p;       // Next character to parse
+    NArena nodes;        // Every Node, freed together
+    const char *error;   // Set on the first error
+} Parser;
+
+static Node *new_node(Parser *parser, NodeType type, Node *left, Node *right) {
+    Node *node = (Node *)na_alloc(&parser->nodes, sizeof(Node));
+    if (!node) {
+        parser->error = "out of memory";
+        return NULL;
+    }
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+// Value of a hexadecimal digit, or -1
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// The [:name:] classes, in the C locale
+static const struct {
+    const char *name;
+    int (*test)(int c);
+} named_classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+    {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+    {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+
+static void set_add_class(ByteSet *set, int (*test)(int c)) {
+    for (int byte = 0; byte < 128; byte++) {
+        if (test(byte)) {
+            set_add(set, byte);
+        }
+    }
+}
+
+/**
+ * @brief Parses the escape after a backslash (parser->p is just past it).
+ *
+ * @param set Receives the bytes the escape stands for.
+ * @return The byte for a single-byte escape, -2 for a class escape (\d, \w, ...), or -1 on error.
+ */
+static int parse_escape(Parser *parser, ByteSet *set) {
+    char c = *parser->p;
+    if (c == '\0') {
+        parser->error = "trailing backslash";
+        return -1;
+    }
+    parser->p++;
+
+    int byte;
+    switch (c) {
+        case 'x': {
+            int high = hex_value(parser->p[0]);
+            int low = high >= 0 ? hex_value(parser->p[1]) : -1;
+            if (low < 0) {
+                parser->error = "\\x needs two hexadecimal digits";
+                return -1;
+            }
+            parser->p += 2;
+            byte = high * 16 + low;
+            break;
+        }
+        case '0': byte = 0; break;
+        case 'a': byte = '\a'; break;
+        case 'e': byte = 0x1B; break;
+        case 'f': byte = '\f'; break;
+        case 'n': byte = '\n'; break;
+        case 'r': byte = '\r'; break;
+        case 't': byte = '\t'; break;
+        case 'v': byte = '\v'; break;
+        case 'd': case 'D':
+            set_add_range(set, '0', '9');
+            if (c == 'D') {
+                set_invert(set);
+            }
+            return -2;
+        case 'w': case 'W':
+            set_add_range(set, 'a', 'z');
+            set_add_range(set, 'A', 'Z');
+            set_add_range(set, '0', '9');
+            set_add(set, '_');
+            if (c == 'W') {
+                set_invert(set);
+            }
+            return -2;
+        case 's': case 'S':
+            set_add_class(set, isspace);
+            if (c == 'S') {
+                set_invert(set);
+            }
+            return -2;
+        default:
+            if (isalnum((unsigned char)c)) {
+                parser->error = "unknown escape";
+                return -1;
+            }
+            byte = (unsigned char)c;
+    }
+    set_add(set, byte);
+    return byte;
+}
+
+// Parses a [...] class (parser->p is just past the '[')
+static Node *parse_class(Parser *parser) {
+    ByteSet set = {{0}};
+    int negate = 0;
+
+    if (*parser->p == '^') {
+        negate = 1;
+        parser->p++;
+    }
+    int first = 1;
+    while (first || *parser->p != ']') {
+        first = 0;
+        if (*parser->p == '\0') {
+            parser->error = "missing ]";
+            return NULL;
+        }
+
+        // [:name:]
+        if (parser->p[0] == '[' && parser->p[1] == ':') {
+            const char *name = parser->p + 2;
+            const char *close = strstr(name, ":]");
+            size_t i;
+            for (i = 0; close && i < sizeof(named_classes) / sizeof(named_classes[0]); i++) {
+                if (strlen(named_classes[i].name) == (size_t)(close - name) &&
+                    memcmp(named_classes[i].name, name, (size_t)(close - name)) == 0) {
+                    break;
+                }
+            }
+            if (!close || i == sizeof(named_classes) / sizeof(named_classes[0])) {
+                parser->error = "unknown [:class:]";
+                return NULL;
+            }
+            set_add_class(&set, named_classes[i].test);
+            parser->p = close + 2;
+            continue;
+        }
+
+        // A byte, possibly the start of a range
+        int low;
+        if (*parser->p == '\\') {
+            parser->p++;
+            ByteSet escaped = {{0}};
+            if ((low = parse_escape(parser, &escaped)) == -1) {
+                return NULL;
+            }
+            if (low == -2) {
+                set_union(&set, &escaped);
+                continue;
+            }
+        } else {
+            low = (unsigned char)*parser->p++;
+        }
+        if (parser->p[0] != '-' || parser->p[1] == ']' || parser->p[1] == '\0') {
+            set_add(&set, low);
+            continue;
+        }
+        parser->p++;
+        int high;
+        if (*parser->p == '\\') {
+            parser->p++;
+            ByteSet escaped = {{0}};
+            if ((high = parse_escape(parser, &escaped)) == -1) {
+                return NULL;
+            }
+            if (high == -2) {
+                parser->error = "class escape in a range";
+                return NULL;
+            }
+        } else {
+            high = (unsigned char)*parser->p++;
+        }
+        if (high < low) {
+            parser->error = "range out of order";
+            return NULL;
+        }
+        set_add_range(&set, low, high);
+    }
+    parser->p++; // The ']'
+
+    if (negate) {
+        set_invert(&set);
+    }
+    Node *node = new_node(parser, NODE_SET, NULL, NULL);
+    if (node) {
+        node->set = set;
+    }
+    return node;
+}
+
+static Node *parse_alternation(Parser *parser);
+
+// Parses a number of at most NRE_MAX_REPEAT digits in a {n,m} repetition
+static int parse_repeat_count(Parser *parser) {
+    int value = 0;
+    if (*parser->p < '0' || *parser->p > '9') {
+        parser->error = "bad {n,m} repetition";
+        return -1;
+    }
+    while (*parser->p >= '0' && *parser->p <= '9') {
+        value = value * 10 + (*parser->p++ - '0');
+        if (value > NRE_MAX_REPEAT) {
+            parser->error = "repetition count too large";
+            return -1;
+        }
+    }
+    return value;
+}
+
+// Parses one atom: a byte, a class, a group or an anchor
+static Node *parse_atom(Parser *parser) {
+    char c = *parser->p++;
+    Node *node;
+
+    switch (c) {
+        case '(':
+            node = parse_alternation(parser);
+            if (node && *parser->p != ')') {
+                parser->error = "missing )";
+                return NULL;
+            }
+            parser->p++;
+            return node;
+        case '[':
+            return parse_class(parser);
+        case '^':
+            return new_node(parser, NODE_BEGIN, NULL, NULL);
+        case '$':
+            return new_node(parser, NODE_END, NULL, NULL);
+        case '.':
+            if ((node = new_node(parser, NODE_SET, NULL, NULL))) {
+                set_invert(&node->set);
+            }
+            return node;
+        case '*': case '+': case '?':
+            parser->error = "repetition without an operand";
+            return NULL;
+        case '\\': {
+            ByteSet set = {{0}};
+            if (parse_escape(parser, &set) == -1) {
+                return NULL;
+            }
+            if ((node = new_node(parser, NODE_SET, NULL, NULL))) {
+                node->set = set;
+            }
+            return node;
+        }
+        default:
+            if ((node = new_node(parser, NODE_SET, NULL, NULL))) {
+                set_add(&node->set, (unsigned char)c);
+            }
+            return node;
+    }
+}
+
+// Parses an atom followed by any number of repetition operators
+static Node *parse_repeat(Parser *parser) {
+    Node *node = parse_atom(parser);
+
+    while (node) {
+        int min, max;
+        char c = *parser->p;
+        if (c == '*') {
+            min = 0, max = -1;
+        } else if (c == '+') {
+            min = 1, max = -1;
+        } else if (c == '?') {
+            min = 0, max = 1;
+        } else if (c == '{' && parser->p[1] >= '0' && parser->p[1] <= '9') {
+            parser->p++;
+            if ((min = parse_repeat_count(parser)) < 0) {
+                return NULL;
+            }
+            max = min;
+            if (*parser->p == ',') {
+                parser->p++;
+                max = -1;
+                if (*parser->p != '}' && (max = parse_repeat_count(parser)) < 0) {
+                    return NULL;
+                }
+            }
+            if (*parser->p != '}' || (max >= 0 && max < min)) {
+                parser->error = "bad {n,m} repetition";
+                return NULL;
+            }
+        } else {
+            break; // A '{' not followed by a digit is an ordinary byte
+        }
+        parser->p++;
+
+        Node *repeat = new_node(parser, NODE_REPEAT, node, NULL);
+        if (repeat) {
+            repeat->min = min;
+            repeat->max = max;
+        }
+        node = repeat;
+    }
+    return node;
+}
+
+// Parses a sequence of repeated atoms, up to '|', ')' or the end
+static Node *parse_concatenation(Parser *parser) {
+    Node *node = new_node(parser, NODE_EMPTY, NULL, NULL);
+
+    while (node && *parser->p && *parser->p != '|' && *parser->p != ')') {
+        Node *next = parse_repeat(parser);
+        if (!next) {
+            return NULL;
+        }
+        node = node->type == NODE_EMPTY ? next : new_node(parser, NODE_CONCAT, node, next);
+    }
+    return node;
+}
+
+static Node *parse_alternation(Parser *parser) {
+    Node *node = parse_concatenation(parser);
+
+    while (node && *parser->p == '|') {
+        parser->p++;
+        Node *next = parse_concatenation(parser);
+        if (!next) {
+            return NULL;
+        }
+        node = new_node(parser, NODE_ALT, node, next);
+    }
+    return node;
+}
+
+/* ------------------------------------------------------------------------- */
+/* NFA: syntax tree -> Thompson automaton                                    */
+/* ------------------------------------------------------------------------- */
+
+typedef enum {
+    NFA_SET,     // Consume one byte of set, go to out
+    NFA_SPLIT,   // Go to out and out1
+    NFA_EPSILON, // Go to out
+    NFA_BEGIN,   // Go to out at offset 0
+    NFA_END,     // Go to out at the end of the data
+    NFA_MATCH,   // A match ends here
+} NfaType;
+
+typedef struct {
+    NfaType type;
+    int out, out1;
+    ByteSet set;
+} NfaState;
+
+typedef struct {
+    NfaState *states;
+    int num_states;
+    int capacity;
+} Nfa;
+
+// Appends a state and returns its index, or -1 if the automaton is too large
+static int nfa_add(Nfa *nfa, NfaType type, int out, int out1) {
+    if (nfa->num_states >= NRE_MAX_NFA_STATES) {
+        return -1;
+    }
+    if (nfa->num_states == nfa->capacity) {
+        int new_capacity = nfa->capacity ? nfa->capacity * 2 : 64;
+        NfaState *new_states = (NfaState *)realloc(nfa->states, (size_t)new_capacity * sizeof(NfaState));
+        if (!new_states) {
+            return -1;
+        }
+        nfa->states = new_states;
+        nfa->capacity = new_capacity;
+    }
+    NfaState *state = &nfa->states[nfa->num_states];
+    memset(state, 0, sizeof(*state));
+    state->type = type;
+    state->out = out;
+    state->out1 = out1;
+    return nfa->num_states++;
+}
+
+/**
+ * @brief Compiles node so that it continues at state next, working from the end of the pattern back.
+ * @return The fragment's first state, or -1 if the automaton grew too large.
+ */
+static int nfa_compile(Nfa *nfa, const Node *node, int next) {
+    int start, left, right;
+
+    switch (node->type) {
+        case NODE_SET:
+            if ((start = nfa_add(nfa, NFA_SET, next, -1)) >= 0) {
+                nfa->states[start].set = node->set;
+            }
+            return start;
+        case NODE_EMPTY:
+            return next;
+        case NODE_BEGIN:
+            return nfa_add(nfa, NFA_BEGIN, next, -1);
+        case NODE_END:
+            return nfa_add(nfa, NFA_END, next, -1);
+        case NODE_CONCAT:
+            if ((right = nfa_compile(nfa, node->right, next)) < 0) {
+                return -1;
+            }
+            return nfa_compile(nfa, node->left, right);
+        case NODE_ALT:
+            if ((left = nfa_compile(nfa, node->left, next)) < 0 || (right = nfa_compile(nfa, node->right, next)) < 0) {
+                return -1;
+            }
+            return nfa_add(nfa, NFA_SPLIT, left, right);
+        case NODE_REPEAT:
+            start = next;
+            if (node->max < 0) {
+                // A loop: split into another round or on to next
+                int loop = nfa_add(nfa, NFA_SPLIT, -1, next);
+                int body = loop >= 0 ? nfa_compile(nfa, node->left, loop) : -1;
+                if (body < 0) {
+                    return -1;
+                }
+                nfa->states[loop].out = body;
+                start = loop;
+            } else {
+                // max - min optional rounds, each of which may skip straight to next
+                for (int i = node->min; i < node->max; i++) {
+                    int body = nfa_compile(nfa, node->left, start);
+                    if (body < 0 || (start = nfa_add(nfa, NFA_SPLIT, body, next)) < 0) {
+                        return -1;
+                    }
+                }
+            }
+            for (int i = 0; i < node->min; i++) {
+                if ((start = nfa_compile(nfa, node->left, start)) < 0) {
+                    return -1;
+                }
+            }
+            return start;
+    }
+    return -1;
+}
+
+/* ------------------------------------------------------------------------- */
+/* DFA: subset construction                                                  */
+/* ------------------------------------------------------------------------- */
+
+struct NRegex {
+    int num_classes;              // Byte equivalence classes
+    unsigned char class_of[256];  // Class of every byte
+    int num_states;
+    int *transitions;             // num_states x num_classes next states
+    unsigned char *flags;         // NRE_ACCEPT and NRE_ACCEPT_EOF per state
+    int start;                    // Start state for a match that does not begin at offset 0
+    int start_bof;                // Start state at offset 0, where ^ holds
+    unsigned char first[256];     // 1 for the bytes a match not at offset 0 can begin with
+    unsigned char prefix[NRE_MAX_PREFIX]; // Literal bytes every match not at offset 0 begins with
+    size_t prefix_length;
+};
+
+// State of the subset construction
+typedef struct {
+    const Nfa *nfa;
+    NRegex *regex;
+    int *marks;          // Per NFA state: generation it was last visited in
+    int generation;
+    int *stack;          // DFS stack
+    int *list;           // The set being built
+    int list_length;
+    int *sets;           // The NFA sets of all DFA states, back to back
+    size_t sets_length, sets_capacity;
+    size_t *set_offsets; // Where each DFA state's set starts in sets
+    int *set_lengths;
+    int *table;          // Hash table of DFA states (index + 1, 0 = empty)
+    size_t table_size;
+    int capacity;        // DFA states allocated
+} Builder;
+
+// Adds the states reachable from state without consuming a byte to builder->list
+static void add_closure(Builder *builder, int state, int at_begin) {
+    const NfaState *states = builder->nfa->states;
+    int depth = 0;
+
+    builder->stack[depth++] = state;
+    while (depth > 0) {
+        int s = builder->stack[--depth];
+        if (s < 0 || builder->marks[s] == builder->generation) {
+            continue;
+        }
+        builder->marks[s] = builder->generation;
+        switch (states[s].type) {
+            case NFA_EPSILON:
+                builder->stack[depth++] = states[s].out;
+                break;
+            case NFA_SPLIT:
+                builder->stack[depth++] = states[s].out1;
+                builder->stack[depth++] = states[s].out;
+                break;
+            case NFA_BEGIN:
+                if (at_begin) {
+                    builder->stack[depth++] = states[s].out;
+                }
+                break;
+            default: // NFA_SET, NFA_END and NFA_MATCH are what a DFA state is made of
+                builder->list[builder->list_length++] = s;
+        }
+    }
+}
+
+// Returns 1 if a match is reachable from state once the data has ended (following $)
+static int accepts_at_end(Builder *builder, int state) {
+    const NfaState *states = builder->nfa->states;
+    int depth = 0;
+
+    builder->generation++;
+    builder->stack[depth++] = state;
+    while (depth > 0) {
+        int s = builder->stack[--depth];
+        if (s < 0 || builder->marks[s] == builder->generation) {
+            continue;
+        }
+        builder->marks[s] = builder->generation;
+        switch (states[s].type) {
+            case NFA_MATCH:
+                return 1;
+            case NFA_SPLIT:
+                builder->stack[depth++] = states[s].out1;
+                // fall through
+            case NFA_EPSILON:
+            case NFA_END:
+                builder->stack[depth++] = states[s].out;
+                break;
+            default:
+                break;
+        }
+    }
+    return 0;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t hash_list(const int *list, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ (uint32_t)list[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Returns the DFA state for the set in builder->list, adding it if it is new.
+ * @return The state, or -1 if there would be too many states or memory ran out.
+ */
+static int dfa_state(Builder *builder) {
+    NRegex *regex = builder->regex;
+    qsort(builder->list, (size_t)builder->list_length, sizeof(int), compare_ints);
+
+    size_t slot = hash_list(builder->list, builder->list_length) & (builder->table_size - 1);
+    while (builder->table[slot]) {
+        int existing = builder->table[slot] - 1;
+        if (builder->set_lengths[existing] == builder->list_length &&
+            memcmp(builder->sets + builder->set_offsets[existing], builder->list,
+                   (size_t)builder->list_length * sizeof(int)) == 0) {
+            return existing;
+        }
+        slot = (slot + 1) & (builder->table_size - 1);
+    }
+
+    if (regex->num_states >= NRE_MAX_DFA_STATES) {
+        return -1;
+    }
+    if (regex->num_states == builder->capacity) {
+        int new_capacity = builder->capacity * 2;
+        int *transitions = (int *)realloc(regex->transitions,
+                                          (size_t)new_capacity * (size_t)regex->num_classes * sizeof(int));
+        if (transitions) {
+            regex->transitions = transitions;
+        }
+        unsigned char *flags = (unsigned char *)realloc(regex->flags, (size_t)new_capacity);
+        if (flags) {
+            regex->flags = flags;
+        }
+        size_t *offsets = (size_t *)realloc(builder->set_offsets, (size_t)new_capacity * sizeof(size_t));
+        if (offsets) {
+            builder->set_offsets = offsets;
+        }
+        int *lengths = (int *)realloc(builder->set_lengths, (size_t)new_capacity * sizeof(int));
+        if (lengths) {
+            builder->set_lengths = lengths;
+        }
+        if (!transitions || !flags || !offsets || !lengths) {
+            return -1;
+        }
+        builder->capacity = new_capacity;
+    }
+    if (builder->sets_length + (size_t)builder->list_length > builder->sets_capacity) {
+        size_t new_capacity = builder->sets_capacity * 2 + (size_t)builder->list_length;
+        int *sets = (int *)realloc(builder->sets, new_capacity * sizeof(int));
+        if (!sets) {
+            return -1;
+        }
+        builder->sets = sets;
+        builder->sets_capacity = new_capacity;
+    }
+
+    int state = regex->num_states++;
+    builder->set_offsets[state] = builder->sets_length;
+    builder->set_lengths[state] = builder->list_length;
+    memcpy(builder->sets + builder->sets_length, builder->list, (size_t)builder->list_length * sizeof(int));
+    builder->sets_length += (size_t)builder->list_length;
+    builder->table[slot] = state + 1;
+
+    unsigned char flags = 0;
+    for (int i = 0; i < builder->list_length; i++) {
+        const NfaState *s = &builder->nfa->states[builder->list[i]];
+        if (s->type == NFA_MATCH) {
+            flags |= NRE_ACCEPT | NRE_ACCEPT_EOF;
+        } else if (s->type == NFA_END && accepts_at_end(builder, builder->list[i])) {
+            flags |= NRE_ACCEPT_EOF;
+        }
+    }
+    regex->flags[state] = flags;
+    return state;
+}
+
+// Splits the 256 byte values into classes that every byte set of the NFA treats alike
+static void compute_byte_classes(const Nfa *nfa, NRegex *regex) {
+    int num_classes = 1;
+    memset(regex->class_of, 0, sizeof(regex->class_of));
+
+    for (int s = 0; s < nfa->num_states; s++) {
+        if (nfa->states[s].type != NFA_SET) {
+            continue;
+        }
+        // Split every class into its bytes inside and outside this set
+        int renumber[512];
+        int count = 0;
+        memset(renumber, -1, sizeof(renumber));
+        for (int byte = 0; byte < 256; byte++) {
+            int key = regex->class_of[byte] * 2 + set_has(&nfa->states[s].set, byte);
+            if (renumber[key] < 0) {
+                renumber[key] = count++;
+            }
+            regex->class_of[byte] = (unsigned char)renumber[key];
+        }
+        num_classes = count;
+    }
+    regex->num_classes = num_classes;
+}
+
+// Builds the DFA of nfa (starting at nfa_start) into regex. Returns 0 on success, -1 if it is too large.
+static int build_dfa(const Nfa *nfa, int nfa_start, NRegex *regex) {
+    Builder builder = {0};
+    int status = -1;
+
+    compute_byte_classes(nfa, regex);
+    builder.nfa = nfa;
+    builder.regex = regex;
+    builder.capacity = 64;
+    builder.table_size = 2;
+    while (builder.table_size < 2 * NRE_MAX_DFA_STATES) {
+        builder.table_size *= 2;
+    }
+    builder.marks = (int *)calloc((size_t)nfa->num_states, sizeof(int));
+    builder.stack = (int *)malloc(((size_t)nfa->num_states * 2 + 1) * sizeof(int)); // Up to two pushes per state
+    builder.list = (int *)malloc((size_t)nfa->num_states * sizeof(int));
+    builder.table = (int *)calloc(builder.table_size, sizeof(int));
+    builder.set_offsets = (size_t *)malloc((size_t)builder.capacity * sizeof(size_t));
+    builder.set_lengths = (int *)malloc((size_t)builder.capacity * sizeof(int));
+    builder.sets_capacity = (size_t)nfa->num_states; // Allocated before the first (empty) state is compared or copied
+    builder.sets = (int *)malloc(builder.sets_capacity * sizeof(int));
+    regex->transitions = (int *)malloc((size_t)builder.capacity * (size_t)regex->num_classes * sizeof(int));
+    regex->flags = (unsigned char *)malloc((size_t)builder.capacity);
+    if (!builder.marks || !builder.stack || !builder.list || !builder.table || !builder.set_offsets ||
+        !builder.set_lengths || !builder.sets || !regex->transitions || !regex->flags) {
+        goto done;
+    }
+
+    // State 0 is the empty set: the dead state
+    builder.list_length = 0;
+    if (dfa_state(&builder) != NRE_DEAD) {
+        goto done;
+    }
+    builder.generation++;
+    builder.list_length = 0;
+    add_closure(&builder, nfa_start, 0);
+    if ((regex->start = dfa_state(&builder)) < 0) {
+        goto done;
+    }
+    builder.generation++;
+    builder.list_length = 0;
+    add_closure(&builder, nfa_start, 1);
+    if ((regex->start_bof = dfa_state(&builder)) < 0) {
+        goto done;
+    }
+
+    // One representative byte per class
+    int representative[256];
+    for (int byte = 255; byte >= 0; byte--) {
+        representative[regex->class_of[byte]] = byte;
+    }
+
+    // Fill in the transitions of every state, creating states as they are reached
+    for (int state = 0; state < regex->num_states; state++) {
+        for (int c = 0; c < regex->num_classes; c++) {
+            builder.generation++;
+            builder.list_length = 0;
+            for (int i = 0; i < builder.set_lengths[state]; i++) {
+                const NfaState *s = &nfa->states[builder.sets[builder.set_offsets[state] + (size_t)i]];
+                if (s->type == NFA_SET && set_has(&s->set, representative[c])) {
+                    add_closure(&builder, s->out, 0);
+                }
+            }
+            int next = dfa_state(&builder);
+            if (next < 0) {
+                goto done;
+            }
+            regex->transitions[(size_t)state * (size_t)regex->num_classes + (size_t)c] = next;
+        }
+    }
+    status = 0;
+
+done:
+    free(builder.marks);
+    free(builder.stack);
+    free(builder.list);
+    free(builder.table);
+    free(builder.sets);
+    free(builder.set_offsets);
+    free(builder.set_lengths);
+    return status;
+}
+
+// Next state after byte
+static inline int dfa_next(const NRegex *regex, int state, unsigned char byte) {
+    return regex->transitions[(size_t)state * (size_t)regex->num_classes + regex->class_of[byte]];
+}
+
+// Works out the prefilter: the bytes a match can begin with, and the literal prefix all matches share
+static void compute_prefilter(NRegex *regex) {
+    for (int byte = 0; byte < 256; byte++) {
+        regex->first[byte] = dfa_next(regex, regex->start, (unsigned char)byte) != NRE_DEAD;
+    }
+
+    // Follow the start state as long as exactly one byte leads anywhere and no match can end yet
+    int state = regex->start;
+    regex->prefix_length = 0;
+    while (regex->prefix_length < NRE_MAX_PREFIX && (regex->prefix_length == 0 || !regex->flags[state])) {
+        int only = -1;
+        for (int byte = 0; byte < 256; byte++) {
+            if (dfa_next(regex, state, (unsigned char)byte) != NRE_DEAD) {
+                if (only >= 0) {
+                    return;
+                }
+                only = byte;
+            }
+        }
+        if (only < 0) {
+            return;
+        }
+        regex->prefix[regex->prefix_length++] = (unsigned char)only;
+        state = dfa_next(regex, state, (unsigned char)only);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* Compiling and searching                                                   */
+/* ------------------------------------------------------------------------- */
+
+NRegex *nre_compile(const char *pattern) {
+    Parser parser = {pattern, pattern, {0}, NULL};
+    Nfa nfa = {0};
+    NRegex *regex = NULL;
+
+    na_init(&parser.nodes, 0);
+    Node *root = parse_alternation(&parser);
+    if (root && *parser.p == ')') {
+        parser.error = "unmatched )";
+    }
+    if (!root || parser.error) {
+        fprintf(stderr, "Error: invalid regex '%s': %s at offset %ld\n", pattern,
+                parser.error ? parser.error : "out of memory", (long)(parser.p - pattern));
+        na_free(&parser.nodes);
+        return NULL;
+    }
+
+    int match = nfa_add(&nfa, NFA_MATCH, -1, -1);
+    int start = match >= 0 ? nfa_compile(&nfa, root, match) : -1;
+    na_free(&parser.nodes);
+    if (start < 0) {
+        fprintf(stderr, "Error: regex '%s' is too large (more than %d NFA states)\n", pattern, NRE_MAX_NFA_STATES);
+        free(nfa.states);
+        return NULL;
+    }
+
+    regex = (NRegex *)calloc(1, sizeof(NRegex));
+    if (!regex || build_dfa(&nfa, start, regex) != 0) {
+        fprintf(stderr, "Error: regex '%s' is too complex (more than %d DFA states)\n", pattern, NRE_MAX_DFA_STATES);
+        free(nfa.states);
+        nre_free(regex);
+        return NULL;
+    }
+    free(nfa.states);
+    compute_prefilter(regex);
+    return regex;
+}
+
+void nre_free(NRegex *regex) {
+    if (regex) {
+        free(regex->transitions);
+        free(regex->flags);
+        free(regex);
+    }
+}
+
+// A match being followed: the DFA state it has reached, and the offset it began at
+typedef struct {
+    int state;
+    size_t start;
+} Attempt;
+
+// Attempts search_together follows without allocating (DFAs with more states need the heap)
+#define NRE_STACK_ATTEMPTS 64
+// Bytes an attempt may read before failing and have nre_search go on one position at a time
+#define NRE_SHORT_ATTEMPT 32
+
+/**
+ * @brief Runs the DFA from offset start to find the longest non-empty match there.
+ *
+ * @param max_end Where to stop following the DFA if the data goes on.
+ * @return 1 with the end in *end, 0 if no match begins at start (with where the DFA died
+ *         in *end), or 2 if the DFA was still alive at max_end, so that a match (or a
+ *         longer one) may yet end past it.
+ */
+static int match_at(const NRegex *regex, int state, const unsigned char *data, size_t length, size_t start,
+                    size_t max_end, size_t *end) {
+    size_t last = start; // End of the longest match so far (start = none, empty matches don't count)
+    size_t stop = max_end < length ? max_end : length;
+
+    for (size_t i = start; i < stop; i++) {
+        state = dfa_next(regex, state, data[i]);
+        if (state == NRE_DEAD) {
+            *end = last > start ? last : i + 1;
+            return last > start;
+        }
+        if (regex->flags[state] & NRE_ACCEPT) {
+            last = i + 1;
+        }
+    }
+    if (stop < length) {
+        return 2;
+    }
+    if (regex->flags[state] & NRE_ACCEPT_EOF) {
+        last = length;
+    }
+    *end = last > start ? last : length;
+    return last > start;
+}
+
+// Returns the first position in [pos, limit) a match not at offset 0 can begin at, or limit if there is none
+static size_t next_candidate(const NRegex *regex, const unsigned char *data, size_t length, size_t pos,
+                             size_t limit) {
+    if (regex->prefix_length > 1) {
+        size_t window = limit - pos + regex->prefix_length - 1; // The prefix must begin before limit
+        if (window > length - pos) {
+            window = length - pos;
+        }
+        const unsigned char *hit = (const unsigned char *)memmem(data + pos, window, regex->prefix,
+                                                                 regex->prefix_length);
+        return hit ? (size_t)(hit - data) : limit;
+    }
+    if (regex->prefix_length == 1) {
+        const unsigned char *hit = (const unsigned char *)memchr(data + pos, regex->prefix[0], limit - pos);
+        return hit ? (size_t)(hit - data) : limit;
+    }
+    while (pos < limit && !regex->first[data[pos]]) {
+        pos++;
+    }
+    return pos;
+}
+
+/**
+ * @brief nre_search from offset from > 0, following the attempts begun at every position at once.
+ *
+ * Attempts that reach the same DFA state match the same ends from there on, so only the one
+ * begun earliest is kept: at most one attempt per state is in flight, and every byte is read
+ * once per attempt instead of once per position before it. Once an attempt has matched, no
+ * later one is begun (it could not be leftmost), and the search ends when no attempt begun
+ * no later than the match is left to extend or beat it.
+ *
+ * @return As nre_search, or -1 if memory for the attempts ran out.
+ */
+static int search_together(const NRegex *regex, const unsigned char *data, size_t length, size_t from,
+                           size_t limit, size_t max_end, size_t *start, size_t *end) {
+    size_t stop = max_end < length ? max_end : length;
+
+    // The attempts in flight, the array the next byte's go to, and per DFA state its attempt's index
+    Attempt stack_attempts[2 * NRE_STACK_ATTEMPTS];
+    int stack_slots[NRE_STACK_ATTEMPTS];
+    Attempt *attempts = stack_attempts, *next = stack_attempts + NRE_STACK_ATTEMPTS;
+    int *slot = stack_slots;
+    void *heap = NULL;
+    size_t num_states = (size_t)regex->num_states;
+    if (num_states > NRE_STACK_ATTEMPTS) {
+        if (!(heap = malloc(num_states * (2 * sizeof(Attempt) + sizeof(int))))) {
+            return -1;
+        }
+        attempts = (Attempt *)heap;
+        next = attempts + num_states;
+        slot = (int *)(next + num_states);
+    }
+    memset(slot, -1, num_states * sizeof(int));
+
+    int count = 0;
+    int found = 0, open = 0;
+    size_t best_start = 0, best_end = 0;
+    for (size_t i = from;; i++) {
+        // While the one attempt in flight neither dies nor matches, and every attempt begun beside it
+        // dies at once or joins it (a run of zeros under \x00+\x01), there is nothing to keep track of
+        if (count == 1 && !found) {
+            int state = attempts[0].state;
+            size_t run_end = stop < limit ? stop : limit;
+            for (; i < run_end; i++) {
+                int moved = dfa_next(regex, state, data[i]);
+                if (moved == NRE_DEAD || (regex->flags[moved] & NRE_ACCEPT)) {
+                    break;
+                }
+                if (regex->first[data[i]]) {
+                    int fresh = dfa_next(regex, regex->start, data[i]);
+                    if (fresh != NRE_DEAD && fresh != moved) {
+                        break;
+                    }
+                }
+                state = moved;
+            }
+            slot[attempts[0].state] = -1;
+            slot[state] = 0;
+            attempts[0].state = state;
+        }
+
+        // Whether to begin an attempt at i: not once a match has begun (a later one could not be leftmost)
+        int begin = !found && i < limit;
+        if (begin && count == 0 && (i = next_candidate(regex, data, length, i, limit)) == limit) {
+            break;
+        }
+        begin = begin && regex->first[data[i]];
+        if (count == 0 && !begin) {
+            if (found || i >= limit) {
+                break;
+            }
+            continue;
+        }
+
+        if (i >= stop) {
+            if (stop < length) {
+                // Attempts go on past max_end: report the earliest (or the match, if it began earlier) as open
+                best_start = found ? best_start : count > 0 ? attempts[0].start : i;
+                for (int a = 0; a < count; a++) {
+                    best_start = attempts[a].start < best_start ? attempts[a].start : best_start;
+                }
+                found = open = 1;
+            } else {
+                for (int a = 0; a < count; a++) {
+                    if ((regex->flags[attempts[a].state] & NRE_ACCEPT_EOF) &&
+                        (!found || attempts[a].start <= best_start)) {
+                        best_start = attempts[a].start;
+                        best_end = length;
+                        found = 1;
+                    }
+                }
+            }
+            break;
+        }
+
+        // Follow every attempt over data[i], merging those that meet in a state into the earliest
+        int next_count = 0;
+        for (int a = 0; a < count; a++) {
+            slot[attempts[a].state] = -1;
+        }
+        for (int a = 0; a < count; a++) {
+            int state = dfa_next(regex, attempts[a].state, data[i]);
+            size_t begun = attempts[a].start;
+            if (state == NRE_DEAD) {
+                continue;
+            }
+            if ((regex->flags[state] & NRE_ACCEPT) && (!found || begun <= best_start)) {
+                best_start = begun;
+                best_end = i + 1;
+                found = 1;
+            }
+            if (slot[state] < 0) {
+                slot[state] = next_count;
+                next[next_count++] = (Attempt){state, begun};
+            } else if (begun < next[slot[state]].start) {
+                next[slot[state]].start = begun;
+            }
+        }
+        // The attempt begun at i comes last: it began after all the others, so it only joins a state none is in
+        if (begin) {
+            int state = dfa_next(regex, regex->start, data[i]);
+            if (state != NRE_DEAD && slot[state] < 0) {
+                if ((regex->flags[state] & NRE_ACCEPT) && !found) {
+                    best_start = i;
+                    best_end = i + 1;
+                    found = 1;
+                }
+                slot[state] = next_count;
+                next[next_count++] = (Attempt){state, i};
+            }
+        }
+
+        // Attempts begun after the match can no longer be leftmost
+        count = next_count;
+        if (found) {
+            count = 0;
+            for (int a = 0; a < next_count; a++) {
+                if (next[a].start > best_start) {
+                    slot[next[a].state] = -1;
+                } else {
+                    slot[next[a].state] = count;
+                    next[count++] = next[a];
+                }
+            }
+        }
+        Attempt *swap = attempts;
+        attempts = next;
+        next = swap;
+    }
+    free(heap);
+
+    if (!found) {
+        return 0;
+    }
+    *start = best_start;
+    *end = open ? NRE_OPEN : best_end;
+    return 1;
+}
+
+int nre_search(const NRegex *regex, const unsigned char *data, size_t length, size_t from, size_t limit,
+               size_t max_end, size_t *start, size_t *end) {
+    if (limit > length) {
+        limit = length;
+    }
+    size_t pos = from;
+    int found;
+    int together = 1; // Cleared if search_together had no memory
+
+    while (pos < limit) {
+        // Only a match at offset 0 can use ^; elsewhere, skip to the next position a match can begin at
+        if (pos > 0 && (pos = next_candidate(regex, data, length, pos, limit)) == limit) {
+            return 0;
+        }
+        if ((found = match_at(regex, pos == 0 ? regex->start_bof : regex->start, data, length, pos, max_end,
+                              end))) {
+            *start = pos;
+            if (found == 2) {
+                *end = NRE_OPEN;
+            }
+            return 1;
+        }
+        // The attempt read a long stretch before failing: trying every position in it would be quadratic
+        if (together && *end - pos > NRE_SHORT_ATTEMPT) {
+            if ((found = search_together(regex, data, length, pos + 1, limit, max_end, start, end)) >= 0) {
+                return found;
+            }
+            together = 0;
+        }
+        pos++;
+    }
+    return 0;
+}
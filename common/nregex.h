@@ -0,0 +1,59 @@
+#ifndef NCOMMANDS_NREGEX_H
+#define NCOMMANDS_NREGEX_H
+
+/*
+ * nregex - byte-oriented regular expressions compiled to a DFA (part of libncore).
+ *
+ * Patterns work on raw bytes rather than characters or lines, which is what binary data needs:
+ *
+ *   .              any byte, newlines included
+ *   \xHH           the byte 0xHH; \0 \a \e \f \n \r \t \v as in C; \ before punctuation escapes it
+ *   [...]  [^...]  a byte class: bytes, ranges (a-z, \x00-\x1F), escapes and [:print:]-style names
+ *   \d \w \s       digits, word bytes, whitespace (\D \W \S for their complements)
+ *   * + ? {n} {n,} {n,m}   repetition (n and m at most NRE_MAX_REPEAT)
+ *   a|b  (...)     alternation and grouping
+ *   ^ $            the start and the end of the data
+ *
+ * Matches are leftmost-longest, non-overlapping and never empty. The pattern is compiled once
+ * into a DFA over byte equivalence classes, so matching costs one table lookup per byte. Before
+ * trying a position, a search skips ahead with memmem or memchr when every match starts with the
+ * same literal bytes, or with a table of the bytes a match can start with otherwise. Once a
+ * position's attempt has read a long stretch and failed (\x00+\x02 over megabytes of zeros),
+ * the attempts from all later positions are followed together in one pass, so finding the
+ * next match takes time linear in the data before it.
+ */
+
+#include <stddef.h>    // For size_t
+
+// Largest count allowed in {n,m}
+#define NRE_MAX_REPEAT 1000
+
+typedef struct NRegex NRegex;
+
+/**
+ * @brief Compiles a pattern.
+ * @return The compiled regex, or NULL after printing why (bad syntax, or a DFA that would be too large).
+ */
+NRegex *nre_compile(const char *pattern);
+
+// Frees a compiled regex
+void nre_free(NRegex *regex);
+
+// End reported for a match that nre_search stopped following at max_end
+#define NRE_OPEN ((size_t)-1)
+
+/**
+ * @brief Finds the first match that starts in [from, limit) of data[0, length).
+ *
+ * A match may run on past limit, and ^ and $ always refer to offsets 0 and length, so
+ * threads can split the data into ranges and search one each on the same buffer. To keep
+ * such a range's work bounded, matches are only followed up to max_end (pass length to
+ * follow them to the end): if one may go on past it, or a match is still possible there,
+ * the search stops and reports *end as NRE_OPEN. Search again from *start to settle it.
+ *
+ * @return 1 with the match in [*start, *end), or 0 if there is none.
+ */
+int nre_search(const NRegex *regex, const unsigned char *data, size_t length, size_t from, size_t limit,
+               size_t max_end, size_t *start, size_t *end);
+
+#endif // NCOMMANDS_NREGEX_H
@@ -0,0 +1,41 @@
+#ifndef NCOMMANDS_NTRACE_H
+#define NCOMMANDS_NTRACE_H
+
+/*
+ * ntrace - USDT (user statically-defined tracing) probes for the n-commands.
+ *
+ * Each probe compiles to a single nop plus an ELF note describing where its arguments
+ * live, so it costs nothing until a tracer attaches. With bpftrace, for example:
+ *
+ *   bpftrace -e 'usdt:./ntree:ntree:stat_start { @s[tid] = nsecs; }
+ *                usdt:./ntree:ntree:stat_done /@s[tid]/ { @us = hist((nsecs - @s[tid]) / 1000); delete(@s[tid]); }'
+ *
+ * The provider is the command name: define NTRACE_PROVIDER before including this header.
+ * Probes are built in when <sys/sdt.h> (systemtap-sdt-dev) is installed; without it, or with
+ * -DNCOMMANDS_NO_USDT, every NTRACE macro expands to nothing.
+ */
+
+#ifndef NTRACE_PROVIDER
+#error "Define NTRACE_PROVIDER (the command name) before including ntrace.h"
+#endif
+
+#if !defined(NCOMMANDS_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>   // For DTRACE_PROBE*
+#define NTRACE_ENABLED 1
+#endif
+#endif
+
+#ifdef NTRACE_ENABLED
+#define NTRACE0(name)             DTRACE_PROBE(NTRACE_PROVIDER, name)
+#define NTRACE1(name, a)          DTRACE_PROBE1(NTRACE_PROVIDER, name, a)
+#define NTRACE2(name, a, b)       DTRACE_PROBE2(NTRACE_PROVIDER, name, a, b)
+#define NTRACE3(name, a, b, c)    DTRACE_PROBE3(NTRACE_PROVIDER, name, a, b, c)
+#else
+#define NTRACE0(name)             do { } while (0)
+#define NTRACE1(name, a)          do { } while (0)
+#define NTRACE2(name, a, b)       do { } while (0)
+#define NTRACE3(name, a, b, c)    do { } while (0)
+#endif
+
+#endif // NCOMMANDS_NTRACE_H
@@ -0,0 +1,84 @@
+#include <stdio.h>     // For fprintf, printf
+#include <string.h>    // For strcmp, strrchr
+#include "../common/ncore.h" // For NCOMMAND_MAIN
+
+/*
+ * ncommands - every n-command in one (optionally static) binary, busybox style.
+ *
+ * The command to run is taken from the name the binary was invoked as, so a symlink
+ * nhex -> ncommands behaves exactly like the standalone nhex. Invoked as ncommands
+ * itself, the first argument names the command: ncommands nhex file.bin
+ *
+ * A single statically linked executable skips the dynamic loader entirely (no library
+ * lookup, no relocation processing, no PLT setup), which is most of what a short run
+ * costs when scripts start the commands tens of thousands of times.
+ */
+
+NCOMMAND_MAIN(nhex);
+NCOMMAND_MAIN(ntree);
+
+// The commands built into the binary
+typedef struct {
+    const char *name;                    // Command name (and symlink name)
+    int (*run)(int argc, char *argv[]);  // Its entry point
+} Command;
+
+static const Command commands[] = {
+    {"nhex", nhex_main},
+    {"ntree", ntree_main},
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+// Returns the command with the given name, or NULL
+static const Command *find_command(const char *name) {
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        if (strcmp(commands[i].name, name) == 0) {
+            return &commands[i];
+        }
+    }
+    return NULL;
+}
+
+// Prints the usage and the list of built-in commands
+static void print_usage(FILE *stream) {
+    fprintf(stream, "Usage: ncommands <command> [arguments...]\n");
+    fprintf(stream, "       <command> [arguments...]   (through a symlink named after the command)\n");
+    fprintf(stream, "Commands:");
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        fprintf(stream, " %s", commands[i].name);
+    }
+    fprintf(stream, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    // Dispatch on the name we were started as, ignoring any directory part
+    const char *name = argc > 0 ? argv[0] : "ncommands";
+    const char *slash = strrchr(name, '/');
+    if (slash) {
+        name = slash + 1;
+    }
+
+    const Command *command = find_command(name);
+    if (command) {
+        return command->run(argc, argv);
+    }
+
+    // ncommands <command> ...: the command sees its own name as argv[0]
+    if (argc < 2 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) {
+        print_usage(argc < 2 ? stderr : stdout);
+        return argc < 2 ? 1 : 0;
+    }
+    if (strcmp(argv[1], "--list") == 0) {
+        for (size_t i = 0; i < NUM_COMMANDS; i++) {
+            printf("%s\n", commands[i].name);
+        }
+        return 0;
+    }
+    if (!(command = find_command(argv[1]))) {
+        fprintf(stderr, "ncommands: unknown command '%s'\n", argv[1]);
+        print_usage(stderr);
+        return 1;
+    }
+    return command->run(argc - 1, argv + 1);
+}
@@ -1,9 +1,22 @@
-#include <stdio.h>     // For printf, fprintf, perror, fopen, fclose, fread
-#include <stdlib.h>    // For EXIT_SUCCESS, EXIT_FAILURE, malloc, free
+#include <stdio.h>     // For fprintf, perror
+#include <stdlib.h>    // For EXIT_SUCCESS, EXIT_FAILURE, malloc, realloc, free
+#include <string.h>    // For memset
+#include <stdint.h>    // For uint64_t
 #include <ctype.h>     // For isprint
+#include <errno.h>     // For errno, EINTR
+#include <fcntl.h>     // For open, O_RDONLY
 #include <sys/ioctl.h> // For ioctl and TIOCGWINSZ
 #include <termios.h>   // For struct winsize (contains terminal dimensions)
-#include <unistd.h>    // For STDOUT_FILENO (file descriptor for standard output), isatty
+#include <sys/stat.h>  // For fstat, S_ISREG
+#include <sys/mman.h>  // For mmap, munmap
+#include <signal.h>    // For sigaction, sig_atomic_t (--watch-region runs until interrupted)
+#include <time.h>      // For clock_gettime, clock_nanosleep
+#include <unistd.h>    // For STDOUT_FILENO (file descriptor for standard output), read, pread, close, sysconf
+#include "../common/ncore.h"   // For NWriter, NPool, nopt_next
+#include "../common/nregex.h"  // For nre_compile, nre_search (--regex)
+#include "../common/hexline.h" // For format_hex_line, HEX_LINE_SIZE (shared with ntree --peek)
+#define NTRACE_PROVIDER nhex
+#include "../common/ntrace.h"  // For the NTRACE probes
 
 // Default bytes per line if terminal width cannot be determined or is too small
 #define DEFAULT_BYTES_PER_LINE 16
@@ -11,23 +24,2322 @@
 #define MIN_BYTES_PER_LINE 4 // Must be at least 1, 4 is a decent minimum
 // Maximum bytes per line to prevent excessively wide lines even on huge monitors
 #define MAX_BYTES_PER_LINE 64
+// Number of lines read from the file at once
+#define LINES_PER_READ 1024
+// Regular files smaller than this are read and formatted in stack buffers, with no malloc at all:
+// most runs are on small files, where setup costs more than the dump itself
+#define SMALL_FILE_SIZE 4096
+// Output buffer for small files (the writer flushes if a narrow terminal needs more)
+#define SMALL_OUTPUT_SIZE (16 * 1024)
+// --regex searches the data in ranges of this many bytes, one per thread at a time
+#define REGEX_RANGE_SIZE (1024 * 1024)
+// Most threads --regex, --detect-stride and --block-hashes use
+#define MAX_THREADS 64
+// --ranges merges ranges less than this far apart into one read
+#define RANGE_MERGE_GAP 4096
+// --ranges reads at most this many ranges, or this many bytes of them, at a time
+#define RANGE_BATCH_COUNT 4096
+#define RANGE_BATCH_SIZE (16 * 1024 * 1024)
+// Longest line of a --labels file, newline and NUL included
+#define MAX_LABEL_LINE 4096
+// Largest record -c/--record takes
+#define MAX_RECORD_SIZE (1024 * 1024)
+// --column-stats updates columns in blocks of this many, a loop the compiler vectorizes
+#define COLUMN_BLOCK 32
+// --detect-stride and -c auto look at this much of the start of the file
+#define STRIDE_SAMPLE_SIZE (1024 * 1024)
+// Longest stride they try (the sample must also hold at least four records of it)
+#define MAX_STRIDE 4096
+// Strides scoring less than this are not suggested (0 is random data, 1 a perfectly periodic one)
+#define MIN_STRIDE_SCORE 0.05
+// Number of strides --detect-stride suggests
+#define STRIDE_CANDIDATES 5
+// Block sizes --block-hashes takes
+#define MIN_HASH_BLOCK 512
+#define MAX_HASH_BLOCK (1024 * 1024 * 1024)
+// --block-hashes reads (and hashes) blocks this many bytes at a time
+#define HASH_PIECE_SIZE (1024 * 1024)
+// Largest region --watch-region takes (it keeps two snapshots)
+#define MAX_WATCH_SIZE (64 * 1024 * 1024)
+// Longest --watch-region line: a hex line, reverse video on and off around every byte of both columns,
+// and the cursor movement in front
+#define WATCH_LINE_SIZE(n) (HEX_LINE_SIZE(n) + 16 * (size_t)(n) + 32)
+
+// Option ids for nopt_next
+enum {
+    OPT_HELP = 1,
+    OPT_PERF,
+    OPT_REFERENCE,
+    OPT_MEM_STATS,
+    OPT_REGEX,
+    OPT_THREADS,
+    OPT_WATCH_REGION,
+    OPT_RECORD,
+    OPT_COLUMN_STATS,
+    OPT_RANGES,
+    OPT_LABELS,
+    OPT_DETECT_STRIDE,
+    OPT_BLOCK_HASHES,
+    OPT_COMPARE_MANIFEST,
+};
+
+static const NOption nhex_options[] = {
+    {"help", 'h', 0, OPT_HELP},
+    {"perf", 0, 0, OPT_PERF},
+    {"reference", 0, 0, OPT_REFERENCE},
+    {"mem-stats", 0, 0, OPT_MEM_STATS},
+    {"regex", 'e', 1, OPT_REGEX},
+    {"threads", 0, 1, OPT_THREADS},
+    {"watch-region", 0, 1, OPT_WATCH_REGION},
+    {"record", 'c', 1, OPT_RECORD},
+    {"column-stats", 0, 0, OPT_COLUMN_STATS},
+    {"ranges", 0, 1, OPT_RANGES},
+    {"labels", 0, 1, OPT_LABELS},
+    {"detect-stride", 0, 0, OPT_DETECT_STRIDE},
+    {"block-hashes", 0, 1, OPT_BLOCK_HASHES},
+    {"compare-manifest", 0, 1, OPT_COMPARE_MANIFEST},
+    {NULL, 0, 0, 0},
+};
+
+// Phases reported by --perf
+enum {
+    PHASE_READ,   // Reading the file
+    PHASE_FORMAT, // Formatting hex lines into the output buffer
+    PHASE_WRITE,  // Writing the output buffer
+    NUM_PHASES
+};
+
+static const char *const phase_names[NUM_PHASES] = {"read", "format", "write"};
+
+// Prints the command-line usage
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--perf | --reference] [--mem-stats] [-c N] [--labels LIST] <file_path>\n", program);
+    fprintf(stderr, "       %s --column-stats [-c N] <file_path>\n", program);
+    fprintf(stderr, "       %s --detect-stride [--threads N] <file_path>\n", program);
+    fprintf(stderr, "       %s --block-hashes SIZE [--threads N] <file_path> > MANIFEST\n", program);
+    fprintf(stderr, "       %s --compare-manifest MANIFEST MANIFEST\n", program);
+    fprintf(stderr, "       %s --regex PATTERN [--threads N] [--labels LIST] <file_path>\n", program);
+    fprintf(stderr, "       %s --watch-region OFFSET:LENGTH SECONDS <file_path>\n", program);
+    fprintf(stderr, "       %s --ranges LIST [-c N] [--labels LIST] <file_path>\n", program);
+    fprintf(stderr, "Displays the binary content of a file in hexadecimal format.\n");
+    fprintf(stderr, "  -e, --regex  print only the bytes matching PATTERN (bytes, [classes], \\xHH, * + ? {n,m}, |, ^ $),\n"
+                    "               one match after another, each labelled with its offset; exit status 1 if none\n");
+    fprintf(stderr, "  --threads    search (detect strides, hash blocks) with at most N threads (default: one per CPU)\n");
+    fprintf(stderr, "  --watch-region  re-read LENGTH bytes at OFFSET every SECONDS (mmap, or pread if the file\n"
+                    "               cannot be mapped) and redraw the lines that changed, highlighted, until interrupted\n");
+    fprintf(stderr, "  --ranges     print the ranges listed in LIST (OFFSET:LENGTH per line) in that order,\n"
+                    "               reading nearby ones together\n");
+    fprintf(stderr, "  --labels     print a header line wherever the dump enters a region listed in LIST\n"
+                    "               (OFFSET:LENGTH NAME per line), and above a match or range of the regions it is in\n");
+    fprintf(stderr, "  -c, --record  show N-byte records, one per line (wrapped at the terminal width on a terminal);\n"
+                    "               -c auto takes the best size --detect-stride finds\n");
+    fprintf(stderr, "  --detect-stride  suggest record sizes, from how often bytes repeat at each distance\n"
+                    "               in the first %d KiB\n", STRIDE_SAMPLE_SIZE / 1024);
+    fprintf(stderr, "  --column-stats  print the min, max and number of distinct values of every byte position\n"
+                    "               of the records (N bytes, or one line's worth without -c)\n");
+    fprintf(stderr, "  --block-hashes  write a binary manifest of the XXH64 hash of every SIZE-byte block, and of\n"
+                    "               a Merkle tree over them, to standard output\n");
+    fprintf(stderr, "  --compare-manifest  print the ranges (OFFSET:LENGTH, for --ranges) where the files of two\n"
+                    "               manifests differ; exit status 1 if they do\n");
+    fprintf(stderr, "  --perf       print cycles, instructions, IPC, cache and branch misses per phase to stderr\n");
+    fprintf(stderr, "  --reference  use the original, unoptimized stdio implementation (to check the fast path against)\n");
+    fprintf(stderr, "  --mem-stats  print allocation counts, peak live bytes and call sites to stderr (make MEM_STATS=1)\n");
+}
+
+/**
+ * @brief Reads until length bytes have arrived or the file ends.
+ *
+ * @return The number of bytes read (short only at end of file), or -1 on error.
+ */
+static ssize_t read_fully(int fd, unsigned char *buffer, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t bytes_read = read(fd, buffer + total, length - total);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        total += (size_t)bytes_read;
+    }
+    return (ssize_t)total;
+}
+
+/* ------------------------------------------------------------------------- */
+/* --labels                                                                  */
+/* ------------------------------------------------------------------------- */
+
+// One region of --labels: [start, end) and its name
+typedef struct {
+    unsigned long long start, end;
+    unsigned long long max_end; // Largest end in this region's subtree of the interval tree
+    const char *name;
+} Label;
+
+/**
+ * The --labels regions, sorted by start and indexed as an implicit interval tree: the array
+ * itself is an in-order layout of a balanced binary tree, where the region at index i sits at
+ * the level given by the number of trailing one bits of i, and max_end bounds its subtree.
+ * Finding the regions that contain an offset costs O(log n) plus the regions found.
+ *
+ * A dump moves forward through the file, so after a seek the regions it enters are simply the
+ * next ones in start order: next is that cursor, and each line only compares one start.
+ */
+typedef struct {
+    Label *labels;
+    size_t count;
+    int root_level; // Level of the tree's root
+    size_t next;    // First region the dump has not reached yet
+    NArena names;
+} LabelIndex;
+
+// qsort comparator: regions by start, enclosing regions before the ones they contain
+static int compare_labels(const void *a, const void *b) {
+    const Label *x = (const Label *)a, *y = (const Label *)b;
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->end > y->end ? -1 : x->end < y->end;
+}
+
+// Byte digit of a region's sort key for pass 0-15 of sort_labels: the end, descending, then the start
+static inline unsigned label_digit(const Label *label, int pass) {
+    unsigned long long key = pass < 8 ? ~label->end : label->start;
+    return (unsigned)(key >> (8 * (pass % 8))) & 0xFF;
+}
+
+/**
+ * @brief Sorts the regions like compare_labels.
+ *
+ * Lists in address order (nm -n, linker maps) are only checked. Others go through an LSD radix
+ * sort, a byte of the key per pass, skipping the bytes every region has in common; millions of
+ * regions sort several times faster than with qsort. Falls back to qsort if the scratch memory
+ * cannot be allocated.
+ */
+static void sort_labels(Label *labels, size_t count) {
+    size_t i = 1;
+    while (i < count && compare_labels(&labels[i - 1], &labels[i]) <= 0) {
+        i++;
+    }
+    if (i >= count) {
+        return;
+    }
+    Label *scratch = (Label *)malloc(count * sizeof(Label));
+    if (!scratch) {
+        qsort(labels, count, sizeof(Label), compare_labels);
+        return;
+    }
+
+    // The histograms of every pass, from one read of the regions
+    size_t counts[16][256] = {{0}};
+    for (i = 0; i < count; i++) {
+        for (int pass = 0; pass < 16; pass++) {
+            counts[pass][label_digit(&labels[i], pass)]++;
+        }
+    }
+    Label *from = labels, *to = scratch;
+    for (int pass = 0; pass < 16; pass++) {
+        if (counts[pass][label_digit(&labels[0], pass)] == count) {
+            continue; // Every region has the same byte here
+        }
+        size_t position = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            size_t digit_count = counts[pass][digit];
+            counts[pass][digit] = position;
+            position += digit_count;
+        }
+        for (i = 0; i < count; i++) {
+            to[counts[pass][label_digit(&from[i], pass)]++] = from[i];
+        }
+        Label *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != labels) {
+        memcpy(labels, from, count * sizeof(Label));
+    }
+    free(scratch);
+}
+
+// Fills in max_end over the sorted regions and returns the level of the root
+static int build_label_tree(Label *labels, size_t count) {
+    size_t last_i = 0;           // The last complete node of the current level
+    unsigned long long last = 0; // Its max_end, which stands in for nodes past the end of the array
+    for (size_t i = 0; i < count; i += 2) {
+        last_i = i;
+        last = labels[i].max_end = labels[i].end;
+    }
+    int level;
+    for (level = 1; ((size_t)1 << level) <= count; level++) {
+        size_t half = (size_t)1 << (level - 1);
+        for (size_t i = 2 * half - 1; i < count; i += 4 * half) {
+            unsigned long long left = labels[i - half].max_end;
+            unsigned long long right = i + half < count ? labels[i + half].max_end : last;
+            unsigned long long max_end = labels[i].end;
+            max_end = left > max_end ? left : max_end;
+            labels[i].max_end = right > max_end ? right : max_end;
+        }
+        last_i = (last_i >> level) & 1 ? last_i - half : last_i + half;
+        if (last_i < count && labels[last_i].max_end > last) {
+            last = labels[last_i].max_end;
+        }
+    }
+    return level - 1;
+}
+
+/**
+ * @brief Reads the --labels file: one OFFSET:LENGTH NAME or OFFSET LENGTH NAME per line, numbers
+ *        as for the other options; the name is the rest of the line. Lines starting with # are skipped.
+ *
+ * Regions may overlap and nest; a LENGTH of 0 labels a single position. Symbols of an ELF file,
+ * for instance: nm -S --defined-only prog | awk '{print "0x" $1, "0x" $2, $4}'
+ *
+ * @return 0, or -1 after printing an error.
+ */
+static int read_labels(const char *path, LabelIndex *index) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("Error opening label list");
+        return -1;
+    }
+    memset(index, 0, sizeof(*index));
+    na_init(&index->names, 0);
+    size_t capacity = 0;
+    char text[MAX_LABEL_LINE];
+    int status = 0;
+    for (long line = 1; fgets(text, sizeof(text), fp); line++) {
+        size_t length = strlen(text);
+        if (length == sizeof(text) - 1 && text[length - 1] != '\n' && !feof(fp)) {
+            fprintf(stderr, "Error: %s:%ld: line longer than %d characters\n", path, line, MAX_LABEL_LINE - 2);
+            status = -1;
+            break;
+        }
+        while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r')) {
+            text[--length] = '\0';
+        }
+        char *pos = text + strspn(text, " \t");
+        if (*pos == '\0' || *pos == '#') {
+            continue;
+        }
+        // OFFSET, then LENGTH after a colon or blanks, then the name
+        char *first = pos;
+        pos += strcspn(pos, ": \t");
+        char *second = pos + strspn(pos, ": \t");
+        *pos = '\0';
+        pos = second + strcspn(second, " \t");
+        char *name = pos + strspn(pos, " \t");
+        *pos = '\0';
+        unsigned long long offset, size;
+        if (*name == '\0' || nopt_parse_size(first, &offset) != 0 || nopt_parse_size(second, &size) != 0 ||
+            offset > ~0ULL - size) {
+            fprintf(stderr, "Error: %s:%ld: expected OFFSET:LENGTH NAME\n", path, line);
+            status = -1;
+            break;
+        }
+        if (index->count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            Label *grown = (Label *)realloc(index->labels, capacity * sizeof(Label));
+            if (!grown) {
+                perror("Error allocating buffer");
+                status = -1;
+                break;
+            }
+            index->labels = grown;
+        }
+        const char *copy = na_strndup(&index->names, name, strlen(name));
+        if (!copy) {
+            perror("Error allocating buffer");
+            status = -1;
+            break;
+        }
+        index->labels[index->count++] = (Label){offset, offset + size, 0, copy};
+    }
+    fclose(fp);
+    if (status != 0) {
+        free(index->labels);
+        na_free(&index->names);
+        return -1;
+    }
+    sort_labels(index->labels, index->count);
+    index->root_level = build_label_tree(index->labels, index->count);
+    return 0;
+}
+
+static void free_labels(LabelIndex *index) {
+    free(index->labels);
+    na_free(&index->names);
+}
+
+// Prints the header line of a region
+static void print_label(NWriter *out, const Label *label) {
+    nw_printf(out, "-- %s @ %08llX, %llu bytes\n", label->name, label->start, label->end - label->start);
+}
+
+/**
+ * @brief Moves a dump to offset: prints the headers of the regions that started before offset and
+ *        still contain it, outermost first, and points the cursor at the first region from offset on.
+ */
+static void seek_labels(LabelIndex *index, NWriter *out, unsigned long long offset) {
+    const Label *labels = index->labels;
+    size_t count = index->count;
+    struct {
+        size_t node;
+        int level;
+        int left_done; // Set once the left subtree has been visited
+    } stack[64];
+    int top = 0;
+
+    if (count > 0) {
+        stack[top].node = ((size_t)1 << index->root_level) - 1;
+        stack[top].level = index->root_level;
+        stack[top++].left_done = 0;
+    }
+    // Visit the tree in order, so the regions come out sorted by start
+    while (top > 0) {
+        size_t node = stack[--top].node;
+        int level = stack[top].level;
+        if (level <= 3) {
+            // A small subtree: scan it
+            size_t first = node >> level << level;
+            size_t last = first + ((size_t)1 << (level + 1)) - 1;
+            for (size_t i = first; i < last && i < count && labels[i].start < offset; i++) {
+                if (labels[i].end > offset) {
+                    print_label(out, &labels[i]);
+                }
+            }
+        } else if (!stack[top].left_done) {
+            // Come back to this node after its left subtree, which is skipped if nothing in it reaches offset
+            size_t left = node - ((size_t)1 << (level - 1));
+            stack[top++].left_done = 1;
+            if (left >= count || labels[left].max_end > offset) {
+                stack[top].node = left;
+                stack[top].level = level - 1;
+                stack[top++].left_done = 0;
+            }
+        } else if (node < count && labels[node].start < offset) {
+            if (labels[node].end > offset) {
+                print_label(out, &labels[node]);
+            }
+            stack[top].node = node + ((size_t)1 << (level - 1));
+            stack[top].level = level - 1;
+            stack[top++].left_done = 0;
+        }
+    }
+
+    // The first region starting at or after offset
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (labels[mid].start < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    index->next = low;
+}
+
+// Prints the headers of the regions a line ending before end enters (a no-op without --labels)
+static inline void enter_labels(LabelIndex *index, NWriter *out, unsigned long long end) {
+    while (index && index->next < index->count && index->labels[index->next].start < end) {
+        print_label(out, &index->labels[index->next++]);
+    }
+}
+
+// Prints length bytes in nhex's layout, bytes_per_line to a line, the first labelled with offset,
+// each line after the headers of the --labels regions starting on it (labels may be NULL)
+static void print_lines(NWriter *out, LabelIndex *labels, unsigned long offset, const unsigned char *bytes,
+                        size_t length, int bytes_per_line) {
+    for (size_t pos = 0; pos < length; pos += (size_t)bytes_per_line) {
+        int count = (int)(length - pos < (size_t)bytes_per_line ? length - pos : (size_t)bytes_per_line);
+        enter_labels(labels, out, (unsigned long long)offset + pos + (size_t)count);
+        char *line = nw_reserve(out, HEX_LINE_SIZE(bytes_per_line));
+        if (!line) {
+            return;
+        }
+        nw_commit(out, format_hex_line(line, offset + pos, bytes + pos, count, bytes_per_line));
+    }
+}
+
+// Prints one stretch of the file (a match, a range) with print_lines, after the headers of the regions containing it
+static void print_stretch(NWriter *out, LabelIndex *labels, unsigned long offset, const unsigned char *bytes,
+                          size_t length, int bytes_per_line) {
+    if (labels) {
+        seek_labels(labels, out, offset);
+    }
+    print_lines(out, labels, offset, bytes, length, bytes_per_line);
+}
+
+/**
+ * @brief Dumps a file with the original implementation: one fread and a printf per field for every line.
+ *
+ * This is deliberately left slow and simple. It is the reference that the optimized path
+ * (and any future one) must match byte for byte; bench/bench.sh checks that before timing.
+ *
+ * @param record_size A line never runs past the end of a record (bytes_per_line for plain dumps).
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the file cannot be read.
+ */
+static int dump_reference(const char *file_path, int bytes_per_line, int record_size) {
+    FILE *fp = fopen(file_path, "rb"); // "rb" means "read binary"
+    if (fp == NULL) {
+        perror("Error opening file");
+        return EXIT_FAILURE;
+    }
+
+    unsigned char *buffer = (unsigned char *)malloc(bytes_per_line);
+    if (buffer == NULL) {
+        perror("Error allocating buffer");
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+
+    size_t bytes_read;   // Number of bytes read in current chunk
+    long offset = 0;     // Current file offset (address)
+
+    for (;;) {
+        int record_left = record_size - (int)(offset % record_size);
+        bytes_read = fread(buffer, 1, record_left < bytes_per_line ? record_left : bytes_per_line, fp);
+        if (bytes_read == 0) {
+            break;
+        }
+        printf("%08lX: ", offset);
+
+        // Hexadecimal column, padded on a short last line, with an extra space in the middle
+        for (int i = 0; i < bytes_per_line; i++) {
+            if ((size_t)i < bytes_read) {
+                printf("%02X ", buffer[i]);
+            } else {
+                printf("   ");
+            }
+            if (bytes_per_line >= 2 && i == (bytes_per_line / 2) - 1) {
+                printf(" ");
+            }
+        }
+
+        // ASCII column
+        printf(" |");
+        for (size_t i = 0; i < bytes_read; i++) {
+            printf("%c", isprint(buffer[i]) ? buffer[i] : '.');
+        }
+        printf("|\n");
+
+        offset += (long)bytes_read;
+    }
+
+    int status = ferror(fp) ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (status != EXIT_SUCCESS) {
+        perror("Error reading file");
+    }
+    free(buffer);
+    fclose(fp);
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/* --regex                                                                   */
+/* ------------------------------------------------------------------------- */
+
+// One match, the bytes [start, end)
+typedef struct {
+    size_t start, end;
+} Match;
+
+// One thread's share of a --regex search
+typedef struct {
+    const NRegex *regex;
+    const unsigned char *data;
+    size_t length;      // Length of all the data (a match may run past limit)
+    size_t from, limit; // This range: the matches that start in [from, limit)
+    Match *matches;     // The matches found, in order
+    size_t num_matches;
+    size_t capacity;
+    int open;           // Set if the search stopped at a match it could not finish within the range
+    size_t open_start;  // Where that match starts
+    int failed;         // Set if memory ran out
+} RegexRange;
+
+/**
+ * @brief Pool task: finds every match of one range, as if no earlier match reached into it.
+ *
+ * Matches are only followed to the end of the range: one that may run on past it is left open
+ * for print_range_matches, which knows whether it is needed. Otherwise a match spanning many
+ * ranges (a long run of zeros, say) would be scanned again from every one of them.
+ */
+static void search_range(void *arg) {
+    RegexRange *range = (RegexRange *)arg;
+    size_t pos = range->from, start, end;
+
+    NTRACE2(search_start, range->from, range->limit - range->from);
+    range->num_matches = 0;
+    range->open = 0;
+    while (nre_search(range->regex, range->data, range->length, pos, range->limit, range->limit, &start, &end)) {
+        if (end == NRE_OPEN) {
+            range->open = 1;
+            range->open_start = start;
+            break;
+        }
+        if (range->num_matches == range->capacity) {
+            size_t new_capacity = range->capacity ? range->capacity * 2 : 256;
+            Match *new_matches = (Match *)realloc(range->matches, new_capacity * sizeof(Match));
+            if (!new_matches) {
+                range->failed = 1;
+                break;
+            }
+            range->matches = new_matches;
+            range->capacity = new_capacity;
+        }
+        range->matches[range->num_matches++] = (Match){start, end};
+        pos = end;
+    }
+    NTRACE2(search_done, range->from, range->num_matches);
+}
+
+/**
+ * @brief Searches the data from pos for print_range_matches, following matches to their end.
+ *
+ * The search is not bounded by the range: a match that begins past it, or none (kept as a match
+ * at the end of the data), goes to *ahead, so the ranges before it need not be searched again.
+ * This keeps a stretch that a pattern's beginning matches without a match (\x00+\x01 over a run
+ * of zeros) from being scanned once per range.
+ *
+ * @return 1 with a match that begins in the range, 0 once *ahead is set.
+ */
+static int next_range_match(const RegexRange *range, size_t pos, Match *ahead, Match *match) {
+    if (!nre_search(range->regex, range->data, range->length, pos, range->length, range->length, &match->start,
+                    &match->end)) {
+        match->start = match->end = range->length;
+    }
+    if (match->start >= range->limit) {
+        *ahead = *match;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Prints the matches of a range, after the ones of the range before it.
+ *
+ * The range was searched as if it began fresh at its start, but a match printed from an
+ * earlier range may reach into it (up to *resume), taking the place of the range's first
+ * matches. The search is then redone from *resume until it meets a match the range already
+ * found: from there on, both searches continue identically. If the range's search stopped at
+ * an open match, the rest of the range is searched here, following matches to their end.
+ * Either search may find the next match past the range; it stays in *ahead (start NRE_OPEN if
+ * there is none pending) until the range it begins in.
+ *
+ * @return The number of matches printed.
+ */
+static size_t print_range_matches(const RegexRange *range, size_t *resume, Match *ahead, NWriter *out,
+                                  LabelIndex *labels, int bytes_per_line) {
+    size_t printed = 0;
+    size_t i = 0;
+    Match match;
+    int searched = 0; // Set once the redone search has covered the whole range
+
+    // A search from an earlier range found no match before *ahead
+    if (ahead->start != NRE_OPEN) {
+        if (ahead->start >= range->limit) {
+            return 0;
+        }
+        print_stretch(out, labels, (unsigned long)ahead->start, range->data + ahead->start,
+                      ahead->end - ahead->start, bytes_per_line);
+        printed++;
+        *resume = ahead->end;
+        ahead->start = NRE_OPEN;
+    }
+    if (*resume > range->from) {
+        size_t j = 0; // The range's first match that does not start before the redone search's match
+        i = range->num_matches; // Unless the search lines up with them, none of the range's matches stand
+        searched = 1;
+        while (next_range_match(range, *resume, ahead, &match)) {
+            while (j < range->num_matches && range->matches[j].start < match.start) {
+                j++;
+            }
+            if (j < range->num_matches && range->matches[j].start == match.start) {
+                i = j;
+                searched = 0;
+                break;
+            }
+            print_stretch(out, labels, (unsigned long)match.start, range->data + match.start,
+                          match.end - match.start, bytes_per_line);
+            printed++;
+            *resume = match.end;
+        }
+    }
+    for (; i < range->num_matches; i++) {
+        print_stretch(out, labels, (unsigned long)range->matches[i].start, range->data + range->matches[i].start,
+                      range->matches[i].end - range->matches[i].start, bytes_per_line);
+        printed++;
+        *resume = range->matches[i].end;
+    }
+    if (range->open && !searched) {
+        size_t pos = *resume > range->open_start ? *resume : range->open_start;
+        while (next_range_match(range, pos, ahead, &match)) {
+            print_stretch(out, labels, (unsigned long)match.start, range->data + match.start,
+                          match.end - match.start, bytes_per_line);
+            printed++;
+            *resume = pos = match.end;
+        }
+    }
+    return printed;
+}
+
+// Returns the number of threads to use: num_threads as given by --threads, or without it
+// (num_threads 0) the number of online CPUs, up to MAX_THREADS
+static int default_threads(int num_threads) {
+    if (num_threads == 0) {
+        long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online_cpus > 0 ? (int)(online_cpus < MAX_THREADS ? online_cpus : MAX_THREADS) : 1;
+    }
+    return num_threads;
+}
+
+/**
+ * @brief Gets the whole file into memory: mapped if it is a regular file, read otherwise (pipes).
+ *
+ * @param mapped Set to 1 if the data is mapped (release with munmap), 0 if allocated (release with free).
+ * @return The data (NULL for an empty file), or NULL with *length set to (size_t)-1 on error.
+ */
+static unsigned char *load_file(int fd, size_t *length, int *mapped) {
+    struct stat st;
+
+    *mapped = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        *length = (size_t)st.st_size;
+        if (*length == 0) {
+            return NULL;
+        }
+        void *data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            *mapped = 1;
+            return (unsigned char *)data;
+        }
+    }
+
+    // Not mappable: read everything
+    unsigned char *data = NULL;
+    size_t capacity = 0;
+    *length = 0;
+    for (;;) {
+        if (*length == capacity) {
+            capacity = capacity ? capacity * 2 : 64 * 1024;
+            unsigned char *grown = (unsigned char *)realloc(data, capacity);
+            if (!grown) {
+                perror("Error allocating buffer");
+                break;
+            }
+            data = grown;
+        }
+        ssize_t bytes_read = read_fully(fd, data + *length, capacity - *length);
+        if (bytes_read < 0) {
+            perror("Error reading file");
+            break;
+        }
+        *length += (size_t)bytes_read;
+        if (*length < capacity) {
+            return data; // read_fully came back short: end of file
+        }
+    }
+    free(data);
+    *length = (size_t)-1;
+    return NULL;
+}
+
+/**
+ * @brief Prints every match of pattern in the file (--regex).
+ *
+ * The data is cut into REGEX_RANGE_SIZE ranges, searched num_threads at a time on a pool;
+ * every round's matches are then printed in order, fixing up where a match crosses into
+ * the next range, so the output does not depend on the number of threads.
+ *
+ * @return 0 if something matched, 1 if nothing did, 2 on error.
+ */
+static int search_regex(const char *file_path, const char *pattern, LabelIndex *labels, int bytes_per_line,
+                        int num_threads) {
+    NRegex *regex = nre_compile(pattern);
+    if (!regex) {
+        return 2;
+    }
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        nre_free(regex);
+        return 2;
+    }
+    size_t length;
+    int mapped;
+    unsigned char *data = load_file(fd, &length, &mapped);
+    close(fd);
+    if (length == (size_t)-1) {
+        nre_free(regex);
+        return 2;
+    }
+
+    // One range per thread and round, but no more threads than ranges
+    size_t num_ranges_total = (length + REGEX_RANGE_SIZE - 1) / REGEX_RANGE_SIZE;
+    num_threads = default_threads(num_threads);
+    if ((size_t)num_threads > num_ranges_total) {
+        num_threads = num_ranges_total > 0 ? (int)num_ranges_total : 1;
+    }
+    RegexRange ranges[num_threads];
+    memset(ranges, 0, sizeof(ranges));
+    NPool *pool = num_threads > 1 ? np_create(num_threads - 1) : NULL;
+
+    NWriter out;
+    if (nw_init(&out, STDOUT_FILENO, 0) != 0) {
+        perror("Error allocating buffer"); // out.failed skips the search, and nw_flush below reports it
+    }
+    size_t matches = 0;
+    size_t resume = 0; // End of the last match printed; the next may not start before it
+    Match ahead = {NRE_OPEN, 0}; // The next match, when a search has already found it past the ranges printed
+    int failed = 0;
+    for (size_t round_start = 0; round_start < length && !failed && !out.failed;
+         round_start += (size_t)num_threads * REGEX_RANGE_SIZE) {
+        int num_ranges = 0;
+        for (int t = 0; t < num_threads && round_start + (size_t)t * REGEX_RANGE_SIZE < length; t++) {
+            RegexRange *range = &ranges[num_ranges++];
+            range->regex = regex;
+            range->data = data;
+            range->length = length;
+            range->from = round_start + (size_t)t * REGEX_RANGE_SIZE;
+            range->limit = range->from + REGEX_RANGE_SIZE < length ? range->from + REGEX_RANGE_SIZE : length;
+            if (pool) {
+                np_submit(pool, search_range, range);
+            } else {
+                search_range(range);
+            }
+        }
+        if (pool) {
+            np_wait(pool);
+        }
+        for (int r = 0; r < num_ranges; r++) {
+            if (ranges[r].failed) {
+                perror("Error: Memory allocation failed for matches");
+                failed = 1;
+                break;
+            }
+            matches += print_range_matches(&ranges[r], &resume, &ahead, &out, labels, bytes_per_line);
+        }
+    }
+    if (nw_flush(&out) != 0) {
+        failed = 1;
+    }
+
+    nw_free(&out);
+    if (pool) {
+        np_destroy(pool);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        free(ranges[t].matches);
+    }
+    if (mapped) {
+        munmap(data, length);
+    } else {
+        free(data);
+    }
+    nre_free(regex);
+    return failed ? 2 : matches > 0 ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------------- */
+/* --watch-region                                                            */
+/* ------------------------------------------------------------------------- */
+
+// Set by SIGINT or SIGTERM to end --watch-region
+static volatile sig_atomic_t watch_stop;
+
+static void handle_watch_signal(int signal_number) {
+    (void)signal_number;
+    watch_stop = 1;
+}
+
+// Where the watched bytes come from
+typedef struct {
+    int fd;
+    unsigned long long offset;
+    size_t length;
+    unsigned char *map;          // Shared mapping of the region's pages, or NULL to use pread
+    size_t map_length;
+    size_t map_delta;            // Offset of the region inside the mapping
+    int regular;                 // A regular file: its size is checked before the mapping is touched
+} WatchSource;
+
+/**
+ * @brief Maps the region if the file allows it (shared memory, /dev/mem, uio devices).
+ *
+ * Files that cannot be mapped, such as sysfs attributes and procfs, are read with pread
+ * instead. A mapping of a regular file is only used while the file still covers the region,
+ * since touching pages past its end raises SIGBUS.
+ */
+static void watch_map(WatchSource *source) {
+    struct stat st;
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long long page_offset = source->offset & ~(unsigned long long)(page_size - 1);
+
+    source->map = NULL;
+    if (fstat(source->fd, &st) != 0) {
+        return;
+    }
+    source->regular = S_ISREG(st.st_mode);
+    if (source->regular && source->offset + source->length > (unsigned long long)st.st_size) {
+        return;
+    }
+    source->map_delta = (size_t)(source->offset - page_offset);
+    source->map_length = source->map_delta + source->length;
+    void *map = mmap(NULL, source->map_length, PROT_READ, MAP_SHARED, source->fd, (off_t)page_offset);
+    if (map != MAP_FAILED) {
+        source->map = (unsigned char *)map;
+    }
+}
+
+/**
+ * @brief Takes a snapshot of the region into buffer.
+ * @return The number of bytes there were (fewer than the region near the end of a file), or -1 on error.
+ */
+static ssize_t watch_snapshot(WatchSource *source, unsigned char *buffer) {
+    if (source->map && source->regular) {
+        struct stat st;
+        if (fstat(source->fd, &st) != 0 || source->offset + source->length > (unsigned long long)st.st_size) {
+            munmap(source->map, source->map_length); // Shrunk: read what is left instead
+            source->map = NULL;
+        }
+    }
+    if (source->map) {
+        memcpy(buffer, source->map + source->map_delta, source->length);
+        return (ssize_t)source->length;
+    }
+
+    size_t total = 0;
+    while (total < source->length) {
+        ssize_t bytes_read = pread(source->fd, buffer + total, source->length - total,
+                                   (off_t)(source->offset + total));
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        total += (size_t)bytes_read;
+    }
+    return (ssize_t)total;
+}
+
+/**
+ * @brief Formats one --watch-region line like format_hex_line, without the newline, showing
+ *        the bytes that differ from old in reverse video in both columns.
+ *
+ * @param old The same bytes in the previous snapshot, or NULL to highlight nothing.
+ * @param old_count How many of those there were.
+ * @return The number of characters written, at most WATCH_LINE_SIZE(bytes_per_line).
+ */
+static size_t format_watch_line(char *dst, unsigned long offset, const unsigned char *bytes, int count,
+                                const unsigned char *old, int old_count, int bytes_per_line) {
+    char *out = dst;
+    int highlighted = 0;
+
+    int digits = 8;
+    while (digits < (int)(2 * sizeof(offset)) && (offset >> (4 * digits)) != 0) {
+        digits++;
+    }
+    for (int shift = 4 * (digits - 1); shift >= 0; shift -= 4) {
+        *out++ = hex_digits[(offset >> shift) & 0xF];
+    }
+    *out++ = ':';
+    *out++ = ' ';
+
+    for (int column = 0; column < 2; column++) { // The hex block, then the ASCII one
+        if (column == 1) {
+            *out++ = ' ';
+            *out++ = '|';
+        }
+        for (int i = 0; i < (column == 0 ? bytes_per_line : count); i++) {
+            int changed = old && i < count && (i >= old_count || bytes[i] != old[i]);
+            if (changed != highlighted) {
+                memcpy(out, changed ? "\033[7m" : "\033[0m", 4);
+                out += 4;
+                highlighted = changed;
+            }
+            if (column == 1) {
+                *out++ = (bytes[i] >= 0x20 && bytes[i] < 0x7F) ? (char)bytes[i] : '.';
+                continue;
+            }
+            if (i < count) {
+                *out++ = hex_digits[bytes[i] >> 4];
+                *out++ = hex_digits[bytes[i] & 0xF];
+            } else {
+                *out++ = ' ';
+                *out++ = ' ';
+            }
+            if (highlighted) { // Keep the separating space plain
+                memcpy(out, "\033[0m", 4);
+                out += 4;
+                highlighted = 0;
+            }
+            *out++ = ' ';
+            if (bytes_per_line >= 2 && i == (bytes_per_line / 2) - 1) {
+                *out++ = ' ';
+            }
+        }
+        if (highlighted) {
+            memcpy(out, "\033[0m", 4);
+            out += 4;
+            highlighted = 0;
+        }
+    }
+    *out++ = '|';
+    return (size_t)(out - dst);
+}
+
+/**
+ * @brief Shows a region of a file and how it changes, until interrupted (--watch-region).
+ *
+ * Every interval the region is copied out of a shared mapping (or read with pread) and
+ * compared with the previous snapshot: memcmp on the whole region first, so an unchanged
+ * tick costs one vectorized pass, then per line. On a terminal the dump stays in place and
+ * only changed lines are redrawn, with the changed bytes in reverse video until the next
+ * tick; the region is cut to fit the screen. Otherwise the first snapshot is printed in
+ * full, then each tick's changed lines under a "--- +SECONDS" header, as a log.
+ *
+ * @return EXIT_SUCCESS when interrupted, EXIT_FAILURE on error.
+ */
+static int watch_region(const char *file_path, unsigned long long offset, unsigned long long length,
+                        double interval, int bytes_per_line) {
+    WatchSource source = {0};
+    source.fd = open(file_path, O_RDONLY);
+    if (source.fd < 0) {
+        perror("Error opening file");
+        return EXIT_FAILURE;
+    }
+    source.offset = offset;
+    source.length = (size_t)length;
+
+    struct winsize ws;
+    int terminal = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0;
+    size_t num_lines = (source.length + (size_t)bytes_per_line - 1) / (size_t)bytes_per_line;
+    if (terminal && ws.ws_row > 1 && num_lines > (size_t)ws.ws_row - 1) {
+        num_lines = (size_t)ws.ws_row - 1; // Row 1 is the header
+        source.length = num_lines * (size_t)bytes_per_line;
+    }
+    watch_map(&source);
+
+    unsigned char *current = (unsigned char *)malloc(source.length);
+    unsigned char *previous = (unsigned char *)malloc(source.length);
+    unsigned char *marked = (unsigned char *)calloc(num_lines, 1); // Lines showing highlights
+    NWriter out;
+    if (!current || !previous || !marked || nw_init(&out, STDOUT_FILENO, 0) != 0) {
+        perror("Error allocating buffer");
+        free(current);
+        free(previous);
+        free(marked);
+        close(source.fd);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = handle_watch_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    struct timespec start, next;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+    ssize_t previous_count = -1; // No snapshot yet
+    int status = EXIT_SUCCESS;
+    for (unsigned long tick = 0; !watch_stop && !out.failed; tick++) {
+        ssize_t count = watch_snapshot(&source, current);
+        if (count < 0) {
+            perror("Error reading file");
+            status = EXIT_FAILURE;
+            break;
+        }
+        int first = previous_count < 0;
+        int same = !first && count == previous_count && memcmp(current, previous, (size_t)count) == 0;
+
+        if (terminal) {
+            // The path is shown with control characters replaced, so a file name cannot drive the terminal
+            nw_printf(&out, "%s%s\033[H", first ? "\033[?25l" : "", first ? "\033[2J" : "");
+            for (const char *c = file_path; *c; c++) {
+                nw_putc(&out, (unsigned char)*c < 0x20 || *c == 0x7F ? '?' : *c);
+            }
+            nw_printf(&out, " 0x%llX:%llu%s every %gs (%s), tick %lu\033[K", offset, length,
+                      source.length < length ? " (cut to the screen)" : "", interval, source.map ? "mmap" : "pread",
+                      tick);
+        }
+        size_t changed_lines = 0;
+        for (size_t line = 0; line < num_lines && (!same || terminal); line++) {
+            size_t line_start = line * (size_t)bytes_per_line;
+            int line_count = count > (ssize_t)line_start ? (int)((size_t)count - line_start) : 0;
+            int old_count = previous_count > (ssize_t)line_start ? (int)((size_t)previous_count - line_start) : 0;
+            line_count = line_count < bytes_per_line ? line_count : bytes_per_line;
+            old_count = old_count < bytes_per_line ? old_count : bytes_per_line;
+            int changed = first || line_count != old_count ||
+                          memcmp(current + line_start, previous + line_start, (size_t)line_count) != 0;
+            if (!changed && !(terminal && marked[line])) {
+                continue;
+            }
+            changed_lines += (size_t)changed;
+            if (terminal) {
+                // Redraw in place: changed bytes highlighted, last tick's highlights cleared
+                char *text = nw_reserve(&out, WATCH_LINE_SIZE(bytes_per_line));
+                if (!text) {
+                    break;
+                }
+                size_t used = (size_t)sprintf(text, "\033[%zu;1H", line + 2);
+                used += format_watch_line(text + used, (unsigned long)(offset + line_start), current + line_start,
+                                          line_count, first || !changed ? NULL : previous + line_start, old_count,
+                                          bytes_per_line);
+                memcpy(text + used, "\033[K", 3);
+                nw_commit(&out, used + 3);
+                marked[line] = (unsigned char)(changed && !first);
+            } else if (line_count > 0) {
+                if (!first && changed_lines == 1) {
+                    struct timespec now;
+                    clock_gettime(CLOCK_MONOTONIC, &now);
+                    char *header = nw_reserve(&out, 64);
+                    if (header) {
+                        nw_commit(&out, (size_t)snprintf(header, 64, "--- +%.3f s\n",
+                                                         (double)(now.tv_sec - start.tv_sec) +
+                                                             (double)(now.tv_nsec - start.tv_nsec) / 1e9));
+                    }
+                }
+                char *text = nw_reserve(&out, HEX_LINE_SIZE(bytes_per_line));
+                if (!text) {
+                    break;
+                }
+                nw_commit(&out, format_hex_line(text, (unsigned long)(offset + line_start), current + line_start,
+                                                line_count, bytes_per_line));
+            }
+        }
+        NTRACE2(watch_tick, tick, changed_lines);
+        if (nw_flush(&out) != 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        unsigned char *swap = previous;
+        previous = current;
+        current = swap;
+        previous_count = count;
+
+        // Sleep to the next tick on an absolute clock, so redrawing does not make the interval drift
+        long long nanoseconds = next.tv_nsec + (long long)(interval * 1e9);
+        next.tv_sec += (time_t)(nanoseconds / 1000000000);
+        next.tv_nsec = (long)(nanoseconds % 1000000000);
+        while (!watch_stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+        }
+    }
+
+    if (terminal) {
+        char *text = nw_reserve(&out, 64);
+        if (text) {
+            nw_commit(&out, (size_t)sprintf(text, "\033[0m\033[%zu;1H\n\033[?25h", num_lines + 1));
+        }
+    }
+    if (nw_flush(&out) != 0) {
+        status = EXIT_FAILURE;
+    }
+    nw_free(&out);
+    if (source.map) {
+        munmap(source.map, source.map_length);
+    }
+    free(current);
+    free(previous);
+    free(marked);
+    close(source.fd);
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/* --column-stats                                                            */
+/* ------------------------------------------------------------------------- */
+
+// Folds one record into the running minimum and maximum of every column. padded is a multiple of
+// COLUMN_BLOCK: the fixed-length inner loop is what lets -O2 vectorize this (up to COLUMN_BLOCK - 1
+// bytes past the record are folded into columns that are never printed).
+static void update_column_bounds(unsigned char *restrict min, unsigned char *restrict max,
+                                 const unsigned char *restrict record, size_t padded) {
+    for (size_t block = 0; block < padded; block += COLUMN_BLOCK) {
+        for (int i = 0; i < COLUMN_BLOCK; i++) {
+            unsigned char byte = record[block + i];
+            min[block + i] = byte < min[block + i] ? byte : min[block + i];
+            max[block + i] = byte > max[block + i] ? byte : max[block + i];
+        }
+    }
+}
+
+/**
+ * @brief Prints the minimum, maximum and number of distinct values of every byte position
+ *        of a file of record_size-byte records (--column-stats).
+ *
+ * One pass over the data: each record updates the bounds (update_column_bounds) and a 256-bit
+ * set of the values seen per column. A partial record at the end is left out and reported.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on error.
+ */
+static int column_stats(const char *file_path, int record_size) {
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return EXIT_FAILURE;
+    }
+
+    size_t padded = ((size_t)record_size + COLUMN_BLOCK - 1) / COLUMN_BLOCK * COLUMN_BLOCK;
+    size_t records_per_read = (size_t)LINES_PER_READ * MAX_BYTES_PER_LINE / (size_t)record_size;
+    if (records_per_read == 0) {
+        records_per_read = 1;
+    }
+    size_t chunk_size = records_per_read * (size_t)record_size;
+    unsigned char *buffer = (unsigned char *)calloc(chunk_size + COLUMN_BLOCK, 1); // Padded for the last block
+    unsigned char *min = (unsigned char *)malloc(padded);
+    unsigned char *max = (unsigned char *)calloc(padded, 1);
+    uint64_t *seen = (uint64_t *)calloc((size_t)record_size * 4, sizeof(uint64_t)); // 256 bits per column
+    NWriter out;
+    if (!buffer || !min || !max || !seen || nw_init(&out, STDOUT_FILENO, 0) != 0) {
+        perror("Error allocating buffer");
+        free(buffer);
+        free(min);
+        free(max);
+        free(seen);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    memset(min, 0xFF, padded);
+
+    unsigned long long num_records = 0;
+    size_t left_over = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = read_fully(fd, buffer, chunk_size)) > 0) {
+        size_t complete = (size_t)bytes_read / (size_t)record_size;
+        for (size_t r = 0; r < complete; r++) {
+            const unsigned char *record = buffer + r * (size_t)record_size;
+            update_column_bounds(min, max, record, padded);
+            for (int i = 0; i < record_size; i++) {
+                seen[i * 4 + (record[i] >> 6)] |= (uint64_t)1 << (record[i] & 63);
+            }
+        }
+        num_records += complete;
+        left_over = (size_t)bytes_read - complete * (size_t)record_size;
+        if ((size_t)bytes_read < chunk_size) {
+            break; // read_fully only comes back short at the end of the file
+        }
+    }
+    int status = EXIT_SUCCESS;
+    if (bytes_read < 0) {
+        perror("Error reading file");
+        status = EXIT_FAILURE;
+    }
+
+    char *text = nw_reserve(&out, 128);
+    if (text) {
+        int length = snprintf(text, 128, "%llu records of %d bytes", num_records, record_size);
+        if (left_over > 0) {
+            length += snprintf(text + length, (size_t)(128 - length), " (%zu bytes after the last one left out)",
+                               left_over);
+        }
+        length += snprintf(text + length, (size_t)(128 - length), "\n  column  min  max  distinct\n");
+        nw_commit(&out, (size_t)length);
+    }
+    for (int i = 0; num_records > 0 && i < record_size; i++) {
+        int distinct = 0;
+        for (int word = 0; word < 4; word++) {
+            distinct += __builtin_popcountll(seen[i * 4 + word]);
+        }
+        char *line = nw_reserve(&out, 64);
+        if (!line) {
+            break;
+        }
+        nw_commit(&out, (size_t)snprintf(line, 64, "%8X   %02X   %02X  %8d\n", i, min[i], max[i], distinct));
+    }
+    if (nw_flush(&out) != 0) {
+        status = EXIT_FAILURE;
+    }
+
+    nw_free(&out);
+    free(buffer);
+    free(min);
+    free(max);
+    free(seen);
+    close(fd);
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/* --ranges                                                                  */
+/* ------------------------------------------------------------------------- */
+
+// One range requested with --ranges
+typedef struct {
+    unsigned long long offset, length;
+    const unsigned char *data; // Its bytes, once its batch has been read
+    size_t available;          // How many of them the file had
+} ByteRange;
+
+// A stretch of the file read with one pread, covering one or more ranges
+typedef struct {
+    unsigned long long offset;
+    size_t length;
+    size_t available; // Bytes actually read (short at the end of the file)
+    unsigned char *data;
+} ReadSpan;
+
+/**
+ * @brief Reads the --ranges file: one OFFSET:LENGTH or OFFSET LENGTH per line, numbers as
+ *        for the other options (0x prefix, K/M/G suffix); blank lines and # comments are skipped.
+ * @return The number of ranges (in *ranges, to be freed), or -1 after printing an error.
+ */
+static ssize_t read_range_list(const char *path, ByteRange **ranges) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("Error opening range list");
+        return -1;
+    }
+    char text[256];
+    size_t count = 0, capacity = 0;
+    *ranges = NULL;
+    for (long line = 1; fgets(text, sizeof(text), fp); line++) {
+        char *comment = strchr(text, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *first = strtok(text, ": \t\r\n");
+        if (!first) {
+            continue;
+        }
+        char *second = strtok(NULL, ": \t\r\n");
+        unsigned long long offset, length;
+        if (!second || strtok(NULL, " \t\r\n") || nopt_parse_size(first, &offset) != 0 ||
+            nopt_parse_size(second, &length) != 0 || length == 0 || offset > ~0ULL - length) {
+            fprintf(stderr, "Error: %s:%ld: expected OFFSET:LENGTH\n", path, line);
+            fclose(fp);
+            free(*ranges);
+            return -1;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            ByteRange *grown = (ByteRange *)realloc(*ranges, capacity * sizeof(ByteRange));
+            if (!grown) {
+                perror("Error allocating buffer");
+                fclose(fp);
+                free(*ranges);
+                return -1;
+            }
+            *ranges = grown;
+        }
+        (*ranges)[count++] = (ByteRange){offset, length, NULL, 0};
+    }
+    fclose(fp);
+    return (ssize_t)count;
+}
+
+// pread until length bytes have arrived or the file ends. Returns the bytes read, or -1 on error.
+static ssize_t pread_fully(int fd, unsigned char *buffer, size_t length, unsigned long long offset) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t bytes_read = pread(fd, buffer + total, length - total, (off_t)(offset + total));
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        total += (size_t)bytes_read;
+    }
+    return (ssize_t)total;
+}
+
+// qsort comparator: ranges by offset
+static int compare_range_offsets(const void *a, const void *b) {
+    const ByteRange *x = *(const ByteRange *const *)a, *y = *(const ByteRange *const *)b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/**
+ * @brief Reads the bytes of a batch of ranges with as few preads as possible.
+ *
+ * The ranges are sorted by offset and merged into spans wherever they overlap or lie less
+ * than RANGE_MERGE_GAP apart (the page cache reads whole pages anyway), and the kernel is told
+ * about every span up front (POSIX_FADV_WILLNEED) so its readahead works on all of them while
+ * they are read one by one. Sets every range's data and available.
+ *
+ * @param spans Space for count spans; each span's data is allocated here and freed by the caller.
+ * @return The number of spans, or -1 on error.
+ */
+static ssize_t read_range_batch(int fd, ByteRange *ranges, size_t count, ByteRange **sorted, ReadSpan *spans) {
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = &ranges[i];
+    }
+    qsort(sorted, count, sizeof(ByteRange *), compare_range_offsets);
+
+    size_t num_spans = 0;
+    for (size_t i = 0; i < count; i++) {
+        unsigned long long end = sorted[i]->offset + sorted[i]->length;
+        ReadSpan *span = num_spans > 0 ? &spans[num_spans - 1] : NULL;
+        if (span && sorted[i]->offset <= span->offset + span->length + RANGE_MERGE_GAP) {
+            if (end > span->offset + span->length) {
+                span->length = (size_t)(end - span->offset);
+            }
+        } else {
+            spans[num_spans++] = (ReadSpan){sorted[i]->offset, (size_t)sorted[i]->length, 0, NULL};
+        }
+    }
+    for (size_t s = 0; s < num_spans; s++) {
+        posix_fadvise(fd, (off_t)spans[s].offset, (off_t)spans[s].length, POSIX_FADV_WILLNEED);
+    }
+
+    size_t s = 0;
+    for (size_t i = 0; i < count; i++) {
+        while (sorted[i]->offset >= spans[s].offset + spans[s].length) {
+            s++;
+        }
+        ReadSpan *span = &spans[s];
+        if (!span->data) {
+            span->data = (unsigned char *)malloc(span->length);
+            ssize_t bytes_read = span->data ? pread_fully(fd, span->data, span->length, span->offset) : -1;
+            if (bytes_read < 0) {
+                perror(span->data ? "Error reading file" : "Error allocating buffer");
+                return -1;
+            }
+            span->available = (size_t)bytes_read;
+        }
+        size_t skip = (size_t)(sorted[i]->offset - span->offset);
+        sorted[i]->data = span->data + skip;
+        sorted[i]->available = span->available > skip ? span->available - skip : 0;
+        if (sorted[i]->available > sorted[i]->length) {
+            sorted[i]->available = (size_t)sorted[i]->length;
+        }
+    }
+    return (ssize_t)num_spans;
+}
+
+/**
+ * @brief Prints every range listed in ranges_path, in the order listed (--ranges).
+ *
+ * Ranges are taken in batches (up to RANGE_BATCH_COUNT ranges and RANGE_BATCH_SIZE bytes),
+ * each read with coalesced preads by read_range_batch and then printed. A range larger than
+ * RANGE_BATCH_SIZE gains nothing from that and is read and printed piecewise on its own.
+ * Each range is printed like a --regex match: lines labelled with offsets, starting at its offset.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on error or if a range runs past the end of the file.
+ */
+static int dump_ranges(const char *file_path, const char *ranges_path, LabelIndex *labels, int bytes_per_line) {
+    ByteRange *ranges;
+    ssize_t num_ranges = read_range_list(ranges_path, &ranges);
+    if (num_ranges < 0) {
+        return EXIT_FAILURE;
+    }
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        free(ranges);
+        return EXIT_FAILURE;
+    }
+
+    size_t batch_capacity = (size_t)num_ranges < RANGE_BATCH_COUNT ? (size_t)num_ranges : RANGE_BATCH_COUNT;
+    ByteRange **sorted = (ByteRange **)malloc((batch_capacity + 1) * sizeof(ByteRange *));
+    ReadSpan *spans = (ReadSpan *)malloc((batch_capacity + 1) * sizeof(ReadSpan));
+    size_t piece_size = (size_t)(RANGE_BATCH_SIZE / bytes_per_line) * (size_t)bytes_per_line;
+    unsigned char *piece = NULL; // For ranges too big to batch
+    NWriter out;
+    if (!sorted || !spans || nw_init(&out, STDOUT_FILENO, 0) != 0) {
+        perror("Error allocating buffer");
+        free(sorted);
+        free(spans);
+        free(ranges);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    size_t first = 0;
+    while (first < (size_t)num_ranges && !out.failed) {
+        ByteRange *range = &ranges[first];
+        if (range->length > RANGE_BATCH_SIZE) {
+            if (!piece && !(piece = (unsigned char *)malloc(piece_size))) {
+                perror("Error allocating buffer");
+                status = EXIT_FAILURE;
+                break;
+            }
+            range->available = 0;
+            while (range->available < range->length && !out.failed) {
+                size_t want = range->length - range->available < piece_size ? (size_t)(range->length - range->available)
+                                                                            : piece_size;
+                ssize_t bytes_read = pread_fully(fd, piece, want, range->offset + range->available);
+                if (bytes_read < 0) {
+                    perror("Error reading file");
+                    status = EXIT_FAILURE;
+                    break;
+                }
+                if (range->available == 0) {
+                    print_stretch(&out, labels, (unsigned long)range->offset, piece, (size_t)bytes_read,
+                                  bytes_per_line);
+                } else {
+                    print_lines(&out, labels, (unsigned long)(range->offset + range->available), piece,
+                                (size_t)bytes_read, bytes_per_line);
+                }
+                range->available += (size_t)bytes_read;
+                if ((size_t)bytes_read < want) {
+                    break;
+                }
+            }
+            if (status != EXIT_SUCCESS) {
+                break;
+            }
+            first++;
+        } else {
+            // The longest run of small ranges from here within the batch limits
+            size_t last = first;
+            unsigned long long batch_bytes = 0;
+            while (last < (size_t)num_ranges && last - first < RANGE_BATCH_COUNT &&
+                   ranges[last].length <= RANGE_BATCH_SIZE - batch_bytes) {
+                batch_bytes += ranges[last++].length;
+            }
+            NTRACE2(ranges_batch, first, last - first);
+            ssize_t num_spans = read_range_batch(fd, ranges + first, last - first, sorted, spans);
+            for (size_t i = first; num_spans >= 0 && i < last; i++) {
+                print_stretch(&out, labels, (unsigned long)ranges[i].offset, ranges[i].data, ranges[i].available,
+                              bytes_per_line);
+            }
+            for (ssize_t s = 0; s < num_spans; s++) {
+                free(spans[s].data);
+            }
+            if (num_spans < 0) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            first = last;
+        }
+    }
+    for (size_t i = 0; i < first; i++) {
+        if (ranges[i].available < ranges[i].length) {
+            fprintf(stderr, "Warning: range 0x%llX:%llu runs past the end of the file\n", ranges[i].offset,
+                    ranges[i].length);
+            status = EXIT_FAILURE;
+        }
+    }
+    if (nw_flush(&out) != 0) {
+        status = EXIT_FAILURE;
+    }
+
+    nw_free(&out);
+    free(piece);
+    free(sorted);
+    free(spans);
+    free(ranges);
+    close(fd);
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/* --detect-stride                                                           */
+/* ------------------------------------------------------------------------- */
+
+// A suggested record size
+typedef struct {
+    int stride;
+    double score;
+} StrideCandidate;
+
+// Lags [first, last) of the autocorrelation, computed on the pool
+typedef struct {
+    const unsigned char *data;
+    size_t compared; // Positions compared per lag (the same for every lag)
+    int first, last;
+    size_t *matches; // matches[lag]: positions i with data[i] == data[i + lag]
+} StrideTask;
+
+// Counts the positions where a and b hold the same byte. Each of COLUMN_BLOCK lanes counts in a
+// byte, folded into the total before it can overflow: the fixed-length inner loop is what lets
+// -O2 turn it into vector compares and subtracts, COLUMN_BLOCK bytes at a time.
+static size_t count_equal_bytes(const unsigned char *restrict a, const unsigned char *restrict b, size_t length) {
+    size_t total = 0;
+    size_t i = 0;
+    while (i + COLUMN_BLOCK <= length) {
+        unsigned char lanes[COLUMN_BLOCK] = {0};
+        for (int round = 0; round < 255 && i + COLUMN_BLOCK <= length; round++, i += COLUMN_BLOCK) {
+            for (int j = 0; j < COLUMN_BLOCK; j++) {
+                lanes[j] += a[i + j] == b[i + j];
+            }
+        }
+        for (int j = 0; j < COLUMN_BLOCK; j++) {
+            total += lanes[j];
+        }
+    }
+    for (; i < length; i++) {
+        total += a[i] == b[i];
+    }
+    return total;
+}
+
+static void stride_task(void *arg) {
+    StrideTask *task = (StrideTask *)arg;
+    for (int lag = task->first; lag < task->last; lag++) {
+        task->matches[lag] = count_equal_bytes(task->data, task->data + lag, task->compared);
+    }
+}
+
+/**
+ * @brief Ranks likely record sizes of data by byte-level autocorrelation.
+ *
+ * For every lag from 2 to MAX_STRIDE (and at most a quarter of the data), counts how often a
+ * byte equals the one lag bytes further on, over the same positions for every lag. The score
+ * is that rate above chance (two bytes drawn from the data's byte histogram being equal),
+ * scaled so a perfectly periodic sample scores 1. Records of stride bytes also make every
+ * multiple of stride score high, so a lag is dropped when one of its divisors scores at
+ * least 90% as much. The lags are spread over num_threads threads: a 1 MiB sample is
+ * about 4 G byte compares.
+ *
+ * @param candidates Room for max_candidates suggestions, best first.
+ * @return The number of suggestions, or -1 if memory runs out.
+ */
+static int detect_strides(const unsigned char *data, size_t length, int num_threads, StrideCandidate *candidates,
+                          int max_candidates) {
+    int max_lag = length / 4 < MAX_STRIDE ? (int)(length / 4) : MAX_STRIDE;
+    if (max_lag < 2) {
+        return 0;
+    }
+    size_t compared = length - (size_t)max_lag;
+
+    // Chance of two bytes being equal
+    size_t histogram[256] = {0};
+    for (size_t i = 0; i < compared; i++) {
+        histogram[data[i]]++;
+    }
+    double chance = 0;
+    for (int value = 0; value < 256; value++) {
+        double share = (double)histogram[value] / (double)compared;
+        chance += share * share;
+    }
+    if (chance >= 1.0) {
+        return 0; // A single byte value: nothing repeats more than anything else
+    }
+
+    size_t *matches = (size_t *)calloc((size_t)max_lag + 1, sizeof(size_t));
+    double *scores = (double *)calloc((size_t)max_lag + 1, sizeof(double));
+    unsigned char *multiple = (unsigned char *)calloc((size_t)max_lag + 1, 1);
+    int num_tasks = (max_lag + 63) / 64;
+    StrideTask *tasks = (StrideTask *)malloc((size_t)num_tasks * sizeof(StrideTask));
+    if (!matches || !scores || !multiple || !tasks) {
+        free(matches);
+        free(scores);
+        free(multiple);
+        free(tasks);
+        return -1;
+    }
+    num_threads = default_threads(num_threads);
+    NPool *pool = num_threads > 1 ? np_create(num_threads - 1) : NULL;
+    for (int t = 0; t < num_tasks; t++) {
+        tasks[t] = (StrideTask){data, compared, 2 + t * 64, 2 + (t + 1) * 64, matches};
+        if (tasks[t].last > max_lag + 1) {
+            tasks[t].last = max_lag + 1;
+        }
+        if (pool) {
+            np_submit(pool, stride_task, &tasks[t]);
+        } else {
+            stride_task(&tasks[t]);
+        }
+    }
+    if (pool) {
+        np_wait(pool);
+        np_destroy(pool);
+    }
+
+    for (int lag = 2; lag <= max_lag; lag++) {
+        scores[lag] = ((double)matches[lag] / (double)compared - chance) / (1.0 - chance);
+    }
+    // Drop the multiples of a stride that explains them
+    for (int divisor = 2; divisor <= max_lag / 2; divisor++) {
+        for (int lag = 2 * divisor; lag <= max_lag; lag += divisor) {
+            if (scores[divisor] >= 0.9 * scores[lag]) {
+                multiple[lag] = 1;
+            }
+        }
+    }
+    // The best of the rest, by insertion into the short candidate list
+    int count = 0;
+    for (int lag = 2; lag <= max_lag; lag++) {
+        if (multiple[lag] || scores[lag] < MIN_STRIDE_SCORE) {
+            continue;
+        }
+        int pos = count < max_candidates ? count++ : max_candidates;
+        while (pos > 0 && candidates[pos - 1].score < scores[lag]) {
+            if (pos < max_candidates) {
+                candidates[pos] = candidates[pos - 1];
+            }
+            pos--;
+        }
+        if (pos < max_candidates) {
+            candidates[pos] = (StrideCandidate){lag, scores[lag]};
+        }
+    }
+
+    free(matches);
+    free(scores);
+    free(multiple);
+    free(tasks);
+    return count;
+}
+
+/**
+ * @brief Reads the first STRIDE_SAMPLE_SIZE bytes of a file and ranks its likely record sizes.
+ *
+ * @param sample_length Set to the number of bytes looked at.
+ * @return The number of candidates, or -1 after printing an error.
+ */
+static int sample_strides(const char *file_path, int num_threads, StrideCandidate *candidates, int max_candidates,
+                          size_t *sample_length) {
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return -1;
+    }
+    unsigned char *sample = (unsigned char *)malloc(STRIDE_SAMPLE_SIZE);
+    if (!sample) {
+        perror("Error allocating buffer");
+        close(fd);
+        return -1;
+    }
+    ssize_t bytes_read = read_fully(fd, sample, STRIDE_SAMPLE_SIZE);
+    int count = -1;
+    if (bytes_read < 0) {
+        perror("Error reading file");
+    } else {
+        *sample_length = (size_t)bytes_read;
+        count = detect_strides(sample, (size_t)bytes_read, num_threads, candidates, max_candidates);
+        if (count < 0) {
+            perror("Error allocating buffer");
+        }
+    }
+    free(sample);
+    close(fd);
+    return count;
+}
+
+// Prints the likely record sizes of a file (--detect-stride). Returns 0, 1 if none stands out, 2 on error.
+static int print_strides(const char *file_path, int num_threads) {
+    StrideCandidate candidates[STRIDE_CANDIDATES];
+    size_t sample_length = 0;
+    int count = sample_strides(file_path, num_threads, candidates, STRIDE_CANDIDATES, &sample_length);
+    NWriter out;
+    if (count < 0 || nw_init(&out, STDOUT_FILENO, 4096) != 0) {
+        return 2;
+    }
+    if (count == 0) {
+        nw_printf(&out, "No record size stands out in the first %zu bytes\n", sample_length);
+    } else {
+        nw_printf(&out, "Likely record sizes, from the first %zu bytes (score: 0 = random, 1 = perfectly periodic):\n"
+                        "  stride  score\n", sample_length);
+        for (int i = 0; i < count; i++) {
+            nw_printf(&out, "%8d  %5.3f\n", candidates[i].stride, candidates[i].score);
+        }
+        nw_printf(&out, "Dump with the best one: nhex -c auto (or -c %d)\n", candidates[0].stride);
+    }
+    int status = nw_flush(&out) != 0 ? 2 : count > 0 ? 0 : 1;
+    nw_free(&out);
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/* --block-hashes, --compare-manifest                                        */
+/* ------------------------------------------------------------------------- */
+
+// XXH64 (xxHash, 64-bit), so a block's hash can be checked with xxhsum -H64
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+// A hash in progress: fed 32-byte stripes by xxh64_update, the rest by xxh64_final
+typedef struct {
+    uint64_t acc[4];
+    uint64_t length;
+} Xxh64;
+
+static inline uint64_t rotl64(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// XXH64 input words and manifest fields are little-endian on every host, so hashes and
+// manifests from different machines compare (compilers turn these into plain loads and stores)
+static inline uint64_t read_le64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static inline uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void write_le64(unsigned char *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static void xxh64_init(Xxh64 *state) {
+    state->acc[0] = XXH_PRIME1 + XXH_PRIME2;
+    state->acc[1] = XXH_PRIME2;
+    state->acc[2] = 0;
+    state->acc[3] = -XXH_PRIME1;
+    state->length = 0;
+}
+
+// Hashes length bytes, a multiple of 32
+static void xxh64_update(Xxh64 *state, const unsigned char *data, size_t length) {
+    uint64_t a0 = state->acc[0], a1 = state->acc[1], a2 = state->acc[2], a3 = state->acc[3];
+    for (size_t i = 0; i < length; i += 32) {
+        a0 = xxh64_round(a0, read_le64(data + i));
+        a1 = xxh64_round(a1, read_le64(data + i + 8));
+        a2 = xxh64_round(a2, read_le64(data + i + 16));
+        a3 = xxh64_round(a3, read_le64(data + i + 24));
+    }
+    state->acc[0] = a0;
+    state->acc[1] = a1;
+    state->acc[2] = a2;
+    state->acc[3] = a3;
+    state->length += length;
+}
+
+// Hashes the last length bytes (any number) and returns the hash
+static uint64_t xxh64_final(Xxh64 *state, const unsigned char *data, size_t length) {
+    size_t stripes = length / 32 * 32;
+    xxh64_update(state, data, stripes);
+    data += stripes;
+    length -= stripes;
+
+    uint64_t hash;
+    if (state->length >= 32) {
+        hash = rotl64(state->acc[0], 1) + rotl64(state->acc[1], 7) + rotl64(state->acc[2], 12) +
+               rotl64(state->acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = (hash ^ xxh64_round(0, state->acc[i])) * XXH_PRIME1 + XXH_PRIME4;
+        }
+    } else {
+        hash = XXH_PRIME5;
+    }
+    hash += state->length + length;
+    for (; length >= 8; data += 8, length -= 8) {
+        hash = rotl64(hash ^ xxh64_round(0, read_le64(data)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (length >= 4) {
+        hash = rotl64(hash ^ (read_le32(data) * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        data += 4;
+        length -= 4;
+    }
+    for (; length > 0; data++, length--) {
+        hash = rotl64(hash ^ (*data * XXH_PRIME5), 11) * XXH_PRIME1;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    return hash ^ (hash >> 32);
+}
+
+/**
+ * The manifest --block-hashes writes: a 48-byte header of little-endian 64-bit fields, then
+ * the hash of every block in file order (the last block may be short).
+ *
+ *     "NHEXMAN1"  block size  file size  number of blocks  Merkle root  0
+ *
+ * The root is the top of a binary tree whose leaves are the block hashes; each parent is the
+ * XXH64 of its two children's hashes, and a node without a sibling moves up unchanged. Equal
+ * roots make --compare-manifest stop without looking at a single block hash.
+ */
+#define MANIFEST_MAGIC "NHEXMAN1"
+#define MANIFEST_HEADER_SIZE 48
+
+// Blocks [first, last) of the file, hashed on the pool
+typedef struct {
+    int fd;
+    unsigned long long file_size;
+    size_t block_size;
+    size_t first, last;
+    uint64_t *hashes;
+    int error; // errno of a failed read or allocation, or 0
+} HashTask;
+
+static void hash_blocks_task(void *arg) {
+    HashTask *task = (HashTask *)arg;
+    size_t piece_size = task->block_size < HASH_PIECE_SIZE ? task->block_size : HASH_PIECE_SIZE;
+    unsigned char *piece = (unsigned char *)malloc(piece_size);
+    if (!piece) {
+        task->error = ENOMEM;
+        return;
+    }
+    for (size_t block = task->first; block < task->last && !task->error; block++) {
+        unsigned long long offset = (unsigned long long)block * task->block_size;
+        unsigned long long end = offset + task->block_size < task->file_size ? offset + task->block_size
+                                                                              : task->file_size;
+        Xxh64 state;
+        xxh64_init(&state);
+        // Every piece but a block's last is HASH_PIECE_SIZE bytes, a multiple of the 32 xxh64_update takes
+        for (;;) {
+            size_t want = end - offset < piece_size ? (size_t)(end - offset) : piece_size;
+            ssize_t bytes_read = pread_fully(task->fd, piece, want, offset);
+            if (bytes_read != (ssize_t)want) {
+                task->error = bytes_read < 0 ? errno : EIO; // The file shrank
+                break;
+            }
+            offset += want;
+            if (offset == end) {
+                task->hashes[block] = xxh64_final(&state, piece, want);
+                break;
+            }
+            xxh64_update(&state, piece, want);
+        }
+    }
+    free(piece);
+}
+
+// Hashes a parent of the Merkle tree from its two children
+static uint64_t merkle_parent(uint64_t left, uint64_t right) {
+    unsigned char pair[16];
+    write_le64(pair, left);
+    write_le64(pair + 8, right);
+    Xxh64 state;
+    xxh64_init(&state);
+    return xxh64_final(&state, pair, sizeof(pair));
+}
+
+/**
+ * @brief Computes the root of the Merkle tree over count block hashes.
+ * @return 0, or -1 if memory runs out.
+ */
+static int merkle_root(const uint64_t *hashes, size_t count, uint64_t *root) {
+    if (count <= 1) {
+        Xxh64 state;
+        xxh64_init(&state);
+        *root = count == 1 ? hashes[0] : xxh64_final(&state, NULL, 0);
+        return 0;
+    }
+    // The level above the leaves, then every level above that in place
+    uint64_t *level = (uint64_t *)malloc((count + 1) / 2 * sizeof(uint64_t));
+    if (!level) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i += 2) {
+        level[i / 2] = i + 1 < count ? merkle_parent(hashes[i], hashes[i + 1]) : hashes[i];
+    }
+    for (count = (count + 1) / 2; count > 1; count = (count + 1) / 2) {
+        for (size_t i = 0; i < count; i += 2) {
+            level[i / 2] = i + 1 < count ? merkle_parent(level[i], level[i + 1]) : level[i];
+        }
+    }
+    *root = level[0];
+    free(level);
+    return 0;
+}
+
+/**
+ * @brief Writes the manifest of a file's block_size-byte blocks to standard output (--block-hashes).
+ *
+ * The blocks are split into a few spans per thread, each hashed on the pool with its own
+ * preads, so a disk image or block device is never copied or mapped as a whole; memory use
+ * is 8 bytes per block plus a piece buffer per thread.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on error.
+ */
+static int write_block_hashes(const char *file_path, size_t block_size, int num_threads) {
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Error: the manifest is binary; redirect it to a file\n");
+        return EXIT_FAILURE;
+    }
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return EXIT_FAILURE;
+    }
+    // The size of a regular file or of a block device alike
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    if (file_size < 0) {
+        fprintf(stderr, "Error: --block-hashes needs a file or block device it can seek in\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    size_t num_blocks = (size_t)(((unsigned long long)file_size + block_size - 1) / block_size);
+
+    num_threads = default_threads(num_threads);
+    size_t num_tasks = (size_t)num_threads * 4 < num_blocks ? (size_t)num_threads * 4 : num_blocks;
+    uint64_t *hashes = (uint64_t *)malloc((num_blocks > 0 ? num_blocks : 1) * sizeof(uint64_t));
+    HashTask *tasks = (HashTask *)calloc(num_tasks > 0 ? num_tasks : 1, sizeof(HashTask));
+    NWriter out;
+    if (!hashes || !tasks || nw_init(&out, STDOUT_FILENO, 0) != 0) {
+        perror("Error allocating buffer");
+        free(hashes);
+        free(tasks);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    NPool *pool = num_threads > 1 && num_tasks > 1 ? np_create(num_threads - 1) : NULL;
+    for (size_t t = 0; t < num_tasks; t++) {
+        tasks[t] = (HashTask){fd, (unsigned long long)file_size, block_size, num_blocks * t / num_tasks,
+                              num_blocks * (t + 1) / num_tasks, hashes, 0};
+        if (pool) {
+            np_submit(pool, hash_blocks_task, &tasks[t]);
+        } else {
+            hash_blocks_task(&tasks[t]);
+        }
+    }
+    if (pool) {
+        np_wait(pool);
+        np_destroy(pool);
+    }
+    int status = EXIT_SUCCESS;
+    for (size_t t = 0; t < num_tasks; t++) {
+        if (tasks[t].error) {
+            errno = tasks[t].error;
+            perror("Error reading file");
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    uint64_t root = 0;
+    if (status == EXIT_SUCCESS && merkle_root(hashes, num_blocks, &root) != 0) {
+        perror("Error allocating buffer");
+        status = EXIT_FAILURE;
+    }
+    if (status == EXIT_SUCCESS) {
+        unsigned char header[MANIFEST_HEADER_SIZE] = {0};
+        memcpy(header, MANIFEST_MAGIC, 8);
+        write_le64(header + 8, block_size);
+        write_le64(header + 16, (uint64_t)file_size);
+        write_le64(header + 24, num_blocks);
+        write_le64(header + 32, root);
+        nw_write(&out, header, sizeof(header));
+        for (size_t block = 0; block < num_blocks; block++) {
+            unsigned char *hash = (unsigned char *)nw_reserve(&out, 8);
+            if (!hash) {
+                break;
+            }
+            write_le64(hash, hashes[block]);
+            nw_commit(&out, 8);
+        }
+    }
+    if (nw_flush(&out) != 0) {
+        status = EXIT_FAILURE;
+    }
+
+    nw_free(&out);
+    free(hashes);
+    free(tasks);
+    close(fd);
+    return status;
+}
+
+// A manifest read back by --compare-manifest
+typedef struct {
+    unsigned long long block_size, file_size, root;
+    size_t num_blocks;
+    uint64_t *hashes;
+} Manifest;
+
+// Reads and checks a manifest, from a file or a pipe (<(ssh host nhex --block-hashes ...)).
+// Returns 0, or -1 after printing an error.
+static int read_manifest(const char *path, Manifest *manifest) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening manifest");
+        return -1;
+    }
+    size_t length;
+    int mapped;
+    unsigned char *data = load_file(fd, &length, &mapped);
+    close(fd);
+    if (length == (size_t)-1) {
+        return -1;
+    }
+    int status = 0;
+    manifest->hashes = NULL;
+    if (length >= MANIFEST_HEADER_SIZE) {
+        manifest->block_size = read_le64(data + 8);
+        manifest->file_size = read_le64(data + 16);
+        manifest->num_blocks = (size_t)read_le64(data + 24);
+        manifest->root = read_le64(data + 32);
+    }
+    if (length < MANIFEST_HEADER_SIZE || memcmp(data, MANIFEST_MAGIC, 8) != 0 ||
+        manifest->block_size < MIN_HASH_BLOCK || manifest->block_size > MAX_HASH_BLOCK ||
+        manifest->num_blocks != (manifest->file_size + manifest->block_size - 1) / manifest->block_size ||
+        length != MANIFEST_HEADER_SIZE + manifest->num_blocks * sizeof(uint64_t)) {
+        fprintf(stderr, "Error: %s is not a manifest written by nhex --block-hashes\n", path);
+        status = -1;
+    } else if (!(manifest->hashes = (uint64_t *)malloc((manifest->num_blocks + 1) * sizeof(uint64_t)))) {
+        perror("Error allocating buffer");
+        status = -1;
+    } else {
+        for (size_t block = 0; block < manifest->num_blocks; block++) {
+            manifest->hashes[block] = read_le64(data + MANIFEST_HEADER_SIZE + block * 8);
+        }
+    }
+    if (mapped) {
+        munmap(data, length);
+    } else {
+        free(data);
+    }
+    return status;
+}
+
+/**
+ * @brief Prints where the files of two manifests differ (--compare-manifest).
+ *
+ * Every run of differing blocks is printed as one OFFSET:LENGTH line, the format --ranges
+ * reads, so the differences can be dumped from each copy without moving the whole file:
+ *
+ *     nhex --compare-manifest a.man b.man > diff.txt; nhex --ranges diff.txt image
+ *
+ * Blocks past the end of the shorter file differ. A count goes to stderr.
+ *
+ * @return 0 if the files are the same, 1 if they differ, 2 on error.
+ */
+static int compare_manifests(const char *path_a, const char *path_b) {
+    Manifest a, b;
+    if (read_manifest(path_a, &a) != 0) {
+        return 2;
+    }
+    if (read_manifest(path_b, &b) != 0) {
+        free(a.hashes);
+        return 2;
+    }
+    if (a.block_size != b.block_size) {
+        fprintf(stderr, "Error: the manifests have different block sizes (%llu and %llu bytes)\n", a.block_size,
+                b.block_size);
+        free(a.hashes);
+        free(b.hashes);
+        return 2;
+    }
+
+    NWriter out;
+    if (nw_init(&out, STDOUT_FILENO, 0) != 0) {
+        perror("Error allocating buffer");
+        free(a.hashes);
+        free(b.hashes);
+        return 2;
+    }
+    size_t num_blocks = a.num_blocks > b.num_blocks ? a.num_blocks : b.num_blocks;
+    unsigned long long file_size = a.file_size > b.file_size ? a.file_size : b.file_size;
+    size_t differing = 0;
+    unsigned long long differing_bytes = 0;
+    // Equal roots over equally long files: the same blocks, without looking at them
+    if (a.root != b.root || a.file_size != b.file_size) {
+        size_t block = 0;
+        while (block < num_blocks) {
+            if (block < a.num_blocks && block < b.num_blocks && a.hashes[block] == b.hashes[block]) {
+                block++;
+                continue;
+            }
+            size_t first = block;
+            while (block < num_blocks &&
+                   (block >= a.num_blocks || block >= b.num_blocks || a.hashes[block] != b.hashes[block])) {
+                block++;
+            }
+            unsigned long long start = (unsigned long long)first * a.block_size;
+            unsigned long long end = (unsigned long long)block * a.block_size;
+            if (end > file_size) {
+                end = file_size;
+            }
+            nw_printf(&out, "0x%llX:%llu\n", start, end - start);
+            differing += block - first;
+            differing_bytes += end - start;
+        }
+    }
+    int status = differing > 0 ? 1 : 0;
+    if (nw_flush(&out) != 0) {
+        status = 2;
+    }
+    fprintf(stderr, "%zu of %zu blocks of %llu bytes differ (%llu bytes)\n", differing, num_blocks, a.block_size,
+            differing_bytes);
+
+    nw_free(&out);
+    free(a.hashes);
+    free(b.hashes);
+    return status;
+}
+
+NCOMMAND_MAIN(nhex) {
+    const char *file_path = NULL;
+    int perf = 0;
+    int reference = 0;
+    int mem_stats = 0;
+    const char *regex = NULL; // --regex PATTERN
+    int num_threads = 0;      // --threads N (0 = one per CPU)
+    int watch = 0;            // --watch-region OFFSET:LENGTH SECONDS
+    unsigned long long watch_offset = 0, watch_length = 0;
+    double watch_interval = 0;
+    int record_size = 0;      // -c N (0 = as many bytes as fit on a line)
+    int show_column_stats = 0;
+    const char *ranges_path = NULL; // --ranges LIST
+    const char *labels_path = NULL; // --labels LIST
+    int record_auto = 0;      // -c auto
+    int detect_stride = 0;
+    size_t hash_block_size = 0;  // --block-hashes SIZE
+    const char *manifest_a = NULL, *manifest_b = NULL; // --compare-manifest A B
 
-int main(int argc, char *argv[]) {
     // 1. Handle command-line arguments
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <file_path>\n", argv[0]);
-        fprintf(stderr, "Displays the binary content of a file in hexadecimal format.\n");
+    NOptState opts = {0};
+    int opt;
+    while ((opt = nopt_next(&opts, argc, argv, nhex_options)) != NOPT_END) {
+        if (opt == NOPT_POSITIONAL && !file_path) {
+            file_path = opts.arg;
+        } else if (opt == OPT_PERF) {
+            perf = 1;
+        } else if (opt == OPT_REFERENCE) {
+            reference = 1;
+        } else if (opt == OPT_MEM_STATS) {
+            mem_stats = 1;
+        } else if (opt == OPT_REGEX) {
+            regex = opts.arg;
+        } else if (opt == OPT_THREADS) {
+            unsigned long long value;
+            if (nopt_parse_size(opts.arg, &value) != 0 || value < 1 || value > MAX_THREADS) {
+                fprintf(stderr, "Error: --threads needs a number between 1 and %d\n", MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+            num_threads = (int)value;
+        } else if (opt == OPT_RECORD && strcmp(opts.arg, "auto") == 0) {
+            record_auto = 1;
+        } else if (opt == OPT_RECORD) {
+            unsigned long long value;
+            if (nopt_parse_size(opts.arg, &value) != 0 || value < 1 || value > MAX_RECORD_SIZE) {
+                fprintf(stderr, "Error: -c/--record needs a record size between 1 and %d bytes\n", MAX_RECORD_SIZE);
+                return EXIT_FAILURE;
+            }
+            record_size = (int)value;
+        } else if (opt == OPT_RANGES) {
+            ranges_path = opts.arg;
+        } else if (opt == OPT_LABELS) {
+            labels_path = opts.arg;
+        } else if (opt == OPT_DETECT_STRIDE) {
+            detect_stride = 1;
+        } else if (opt == OPT_BLOCK_HASHES) {
+            unsigned long long value;
+            if (nopt_parse_size(opts.arg, &value) != 0 || value < MIN_HASH_BLOCK || value > MAX_HASH_BLOCK) {
+                fprintf(stderr, "Error: --block-hashes needs a block size between %d bytes and 1G\n", MIN_HASH_BLOCK);
+                return EXIT_FAILURE;
+            }
+            hash_block_size = (size_t)value;
+        } else if (opt == OPT_COMPARE_MANIFEST) {
+            // The first manifest, then the second as the next argument
+            manifest_a = opts.arg;
+            manifest_b = opts.index < argc ? argv[opts.index++] : NULL;
+            if (!manifest_b) {
+                print_usage(argv[0]);
+                return 2;
+            }
+        } else if (opt == OPT_COLUMN_STATS) {
+            show_column_stats = 1;
+        } else if (opt == OPT_WATCH_REGION) {
+            // OFFSET:LENGTH, then SECONDS as the next argument
+            const char *colon = strchr(opts.arg, ':');
+            const char *seconds = opts.index < argc ? argv[opts.index++] : NULL;
+            char offset_text[32] = "";
+            char *end = NULL;
+            if (colon && (size_t)(colon - opts.arg) < sizeof(offset_text)) {
+                memcpy(offset_text, opts.arg, (size_t)(colon - opts.arg));
+                offset_text[colon - opts.arg] = '\0';
+            }
+            if (seconds) {
+                watch_interval = strtod(seconds, &end);
+            }
+            if (!colon || nopt_parse_size(offset_text, &watch_offset) != 0 ||
+                nopt_parse_size(colon + 1, &watch_length) != 0 || watch_length == 0 ||
+                watch_length > MAX_WATCH_SIZE || watch_offset > ~0ULL - watch_length || !seconds || *end != '\0' ||
+                !(watch_interval >= 0.001 && watch_interval <= 86400)) {
+                fprintf(stderr, "Error: --watch-region needs OFFSET:LENGTH (LENGTH 1 to %d bytes) and an interval "
+                                "of 0.001 to 86400 seconds\n", MAX_WATCH_SIZE);
+                return EXIT_FAILURE;
+            }
+            watch = 1;
+        } else {
+            print_usage(argv[0]);
+            return opt == OPT_HELP ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (manifest_a) {
+        if (file_path || perf || reference || regex || watch || show_column_stats || ranges_path || labels_path ||
+            record_size || record_auto || detect_stride || hash_block_size) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        int status = compare_manifests(manifest_a, manifest_b);
+        if (mem_stats) {
+            nmem_report();
+        }
+        return status;
+    }
+    if (!file_path || ((regex || watch || show_column_stats || ranges_path) && (perf || reference)) ||
+        (regex != NULL) + watch + show_column_stats + (ranges_path != NULL) > 1 ||
+        (labels_path && (watch || show_column_stats || reference)) ||
+        ((detect_stride || hash_block_size) && (perf || reference || regex || watch || show_column_stats ||
+                                                ranges_path || labels_path || record_size || record_auto)) ||
+        (detect_stride && hash_block_size)) {
+        print_usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    const char *file_path = argv[1];
+    if (hash_block_size) {
+        int status = write_block_hashes(file_path, hash_block_size, num_threads);
+        if (mem_stats) {
+            nmem_report();
+        }
+        return status;
+    }
+
+    if (detect_stride) {
+        int status = print_strides(file_path, num_threads);
+        if (mem_stats) {
+            nmem_report();
+        }
+        return status;
+    }
+
+    // -c auto: the best record size of the file's start. Only a regular file can be read twice.
+    if (record_auto) {
+        struct stat record_st;
+        StrideCandidate best;
+        size_t sample_length = 0;
+        if (stat(file_path, &record_st) == 0 && !S_ISREG(record_st.st_mode)) {
+            fprintf(stderr, "Error: -c auto needs a regular file\n");
+            return EXIT_FAILURE;
+        }
+        int count = sample_strides(file_path, num_threads, &best, 1, &sample_length);
+        if (count < 0) {
+            return EXIT_FAILURE;
+        }
+        if (count == 0) {
+            fprintf(stderr, "Error: -c auto: no record size stands out in the first %zu bytes\n", sample_length);
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "nhex: -c auto: %d-byte records (score %.3f)\n", best.stride, best.score);
+        record_size = best.stride;
+    }
 
     int bytes_per_line = DEFAULT_BYTES_PER_LINE; // Initialize with default
 
     // 2. Determine terminal width to calculate optimal bytes_per_line
     struct winsize ws;
-    // Check if standard output is a terminal (tty) AND if ioctl succeeds
-    if (isatty(STDOUT_FILENO) && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+    // Ask standard output for its window size; this fails with ENOTTY unless it is a terminal,
+    // so a separate isatty check (another ioctl) is not needed
+    int terminal = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0;
+    if (terminal) {
         int terminal_width = ws.ws_col; // Get columns (width)
 
         // Calculate maximum bytes per line that fits within the terminal width.
@@ -66,56 +2378,188 @@ int main(int argc, char *argv[]) {
     }
     // If not a TTY (e.g., piped to a file) or ioctl fails, bytes_per_line remains DEFAULT_BYTES_PER_LINE
 
-    // 3. Open the specified file in binary read mode
-    FILE *fp = fopen(file_path, "rb"); // "rb" means "read binary"
-    if (fp == NULL) {
+    // With -c, every record starts a new line: one line per record, except that a terminal too
+    // narrow for one wraps it over several (a pager such as less -S scrolls the long lines instead)
+    int record = bytes_per_line;
+    if (record_size) {
+        record = record_size;
+        if (!terminal || record_size <= bytes_per_line) {
+            bytes_per_line = record_size;
+        }
+    }
+
+    // The --labels index is built before the file is opened, so it is not charged to --perf's read phase
+    LabelIndex label_index;
+    LabelIndex *labels = NULL;
+    if (labels_path) {
+        if (read_labels(labels_path, &label_index) != 0) {
+            return regex ? 2 : EXIT_FAILURE;
+        }
+        labels = &label_index;
+    }
+
+    if (ranges_path) {
+        int status = dump_ranges(file_path, ranges_path, labels, bytes_per_line);
+        if (labels) {
+            free_labels(labels);
+        }
+        if (mem_stats) {
+            nmem_report();
+        }
+        return status;
+    }
+
+    if (show_column_stats) {
+        int status = column_stats(file_path, record);
+        if (mem_stats) {
+            nmem_report();
+        }
+        return status;
+    }
+
+    if (watch) {
+        int status = watch_region(file_path, watch_offset, watch_length, watch_interval, bytes_per_line);
+        if (mem_stats) {
+            nmem_report();
+        }
+        return status;
+    }
+
+    if (regex) {
+        int status = search_regex(file_path, regex, labels, bytes_per_line, num_threads);
+        if (labels) {
+            free_labels(labels);
+        }
+        if (mem_stats) {
+            nmem_report();
+        }
+        return status;
+    }
+
+    if (reference) {
+        int status = dump_reference(file_path, bytes_per_line, record);
+        if (mem_stats) {
+            nmem_report();
+        }
+        return status;
+    }
+
+    // 3. Open the specified file for reading
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
         perror("Error opening file");
+        if (labels) {
+            free_labels(labels);
+        }
         return EXIT_FAILURE;
     }
 
-    // 4. Allocate buffer dynamically based on calculated bytes_per_line
-    unsigned char *buffer = (unsigned char *)malloc(bytes_per_line);
-    if (buffer == NULL) {
-        perror("Error allocating buffer");
-        fclose(fp); // Close file before exiting on error
-        return EXIT_FAILURE;
+    // 4. Set up the buffers: on the stack for a small regular file, otherwise allocated based on bytes_per_line
+    unsigned char small_input[SMALL_FILE_SIZE];
+    char small_output[SMALL_OUTPUT_SIZE];
+    struct stat st;
+    int small = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < SMALL_FILE_SIZE && record <= SMALL_FILE_SIZE;
+    size_t chunk_size;   // Whole records per read
+    unsigned char *buffer;
+    NWriter out; // Output is formatted straight into this buffer and written in large blocks
+    if (small) {
+        chunk_size = (size_t)(SMALL_FILE_SIZE / record) * record;
+        buffer = small_input;
+        nw_init_buffer(&out, STDOUT_FILENO, small_output, sizeof(small_output));
+    } else {
+        // LINES_PER_READ lines, or as many whole records as take about as much space
+        size_t records_per_read = (size_t)LINES_PER_READ * (size_t)bytes_per_line / (size_t)record;
+        chunk_size = (size_t)record * (records_per_read > 0 ? records_per_read : 1);
+        buffer = (unsigned char *)malloc(chunk_size);
+        if (buffer == NULL || nw_init(&out, STDOUT_FILENO, 0) != 0) {
+            perror("Error allocating buffer");
+            free(buffer);
+            if (labels) {
+                free_labels(labels);
+            }
+            close(fd); // Close file before exiting on error
+            return EXIT_FAILURE;
+        }
     }
 
-    int bytes_read;      // Number of bytes read in current chunk
+    ssize_t bytes_read;  // Number of bytes read in current chunk
     long offset = 0;     // Current file offset (address)
+    int record_pos = 0;  // Position of offset in its record
+    int status = EXIT_SUCCESS;
+
+    if (perf) {
+        nperf_start(phase_names, NUM_PHASES, PHASE_READ);
+    }
 
     // Loop until no more bytes are read (end of file)
-    while ((bytes_read = fread(buffer, 1, bytes_per_line, fp)) > 0) {
-        // Print the file offset (address) in hexadecimal
-        printf("%08lX: ", offset);
+    NTRACE1(read_start, offset);
+    while ((bytes_read = read_fully(fd, buffer, chunk_size)) > 0) {
+        NTRACE2(read_done, offset, bytes_read);
+        nperf_phase(PHASE_FORMAT);
+        NTRACE2(format_start, offset, bytes_read);
+        int count;
+        for (ssize_t line_start = 0; line_start < bytes_read; line_start += count) {
+            // A line ends after bytes_per_line bytes, at the end of its record or at the end of the data
+            count = record - record_pos < bytes_per_line ? record - record_pos : bytes_per_line;
+            if (bytes_read - line_start < count) {
+                count = (int)(bytes_read - line_start);
+            }
+            record_pos = record_pos + count < record ? record_pos + count : 0;
 
-        // Print hexadecimal representation of each byte
-        for (int i = 0; i < bytes_per_line; i++) { // Loop up to calculated bytes_per_line
-            if (i < bytes_read) {
-                printf("%02X ", buffer[i]);
-            } else {
-                printf("   "); // Pad if the last line is not full
+            // Headers of the --labels regions that start on this line go above it
+            enter_labels(labels, &out, (unsigned long long)offset + (unsigned long long)count);
+
+            // Write out a full buffer here rather than inside nw_reserve, so --perf can tell writing from formatting
+            if (out.capacity - out.length < HEX_LINE_SIZE(bytes_per_line)) {
+                nperf_phase(PHASE_WRITE);
+                NTRACE1(write_start, out.length);
+                nw_flush(&out);
+                NTRACE0(write_done);
+                nperf_phase(PHASE_FORMAT);
             }
-            // Add an extra space in the middle of the hex block for readability
-            if (bytes_per_line >= 2 && i == (bytes_per_line / 2) - 1) {
-                printf(" ");
+
+            // Format the offset, hex and ASCII columns of this line directly into the output buffer
+            char *line = nw_reserve(&out, HEX_LINE_SIZE(bytes_per_line));
+            if (!line) {
+                break;
             }
-        }
+            nw_commit(&out, format_hex_line(line, (unsigned long)offset, buffer + line_start, count, bytes_per_line));
 
-        // Print ASCII representation of each byte
-        printf(" |"); // Separator between hex and ASCII
-        for (int i = 0; i < bytes_read; i++) {
-            printf("%c", isprint(buffer[i]) ? buffer[i] : '.'); // Print char or '.'
+            // Increment the offset by the number of bytes shown
+            offset += count;
         }
-        printf("|\n"); // End of the ASCII block and newline for the next line
-
-        // Increment the offset by the number of bytes read
-        offset += bytes_read;
+        NTRACE1(format_done, offset);
+        // read_fully only comes back short at the end of the file, so there is nothing left to read
+        if (out.failed || (size_t)bytes_read < chunk_size) {
+            break;
+        }
+        nperf_phase(PHASE_READ);
+        NTRACE1(read_start, offset);
+    }
+    if (bytes_read < 0) {
+        perror("Error reading file");
+        status = EXIT_FAILURE;
     }
+    nperf_phase(PHASE_WRITE);
+    NTRACE1(write_start, out.length);
+    if (nw_flush(&out) != 0) {
+        status = EXIT_FAILURE;
+    }
+    NTRACE0(write_done);
+    nperf_report();
 
-    // 5. Clean up: free dynamically allocated buffer and close file
-    free(buffer);
-    fclose(fp);
+    // 5. Clean up: free dynamically allocated buffers and close file
+    if (!small) {
+        free(buffer);
+    }
+    if (labels) {
+        free_labels(labels);
+    }
+    nw_free(&out);
+    close(fd);
+    if (mem_stats) {
+        nmem_report();
+    }
 
-    return EXIT_SUCCESS; // Indicate successful execution
+    return status; // Indicate successful execution
 }
@@ -1,9 +1,25 @@
-#include <stdio.h>      // For printf, fprintf, perror
+#define _GNU_SOURCE     // For O_NOATIME (must come before any #include)
+
+#include <stdio.h>      // For fprintf, perror, tmpfile
 #include <stdlib.h>     // For malloc, realloc, free, qsort
 #include <string.h>     // For strcmp, strcpy, strcat, strdup
 #include <dirent.h>     // For opendir, readdir, closedir, struct dirent
-#include <sys/stat.h>   // For stat, S_ISDIR
+#include <sys/stat.h>   // For stat, lstat, S_ISDIR
+#include <sys/types.h>  // For ino_t
+#include <sys/vfs.h>    // For fstatfs
 #include <limits.h>     // For PATH_MAX (if available, otherwise fallback)
+#include <stdint.h>     // For uint64_t
+#include <unistd.h>     // For sysconf, fork, _exit, readlink
+#include <sys/wait.h>   // For waitpid
+#include <spawn.h>      // For posix_spawnp
+#include <errno.h>      // For errno, ENOENT, ENOTDIR, ELOOP
+#include <fcntl.h>      // For open, O_RDONLY
+#include <time.h>       // For time_t
+#include <sys/sendfile.h> // For sendfile
+#include "../common/ncore.h"   // For NWriter, NArena, NPool, the option parser and id names
+#include "../common/hexline.h" // For format_hex_line, the line formatter nhex uses
+#define NTRACE_PROVIDER ntree
+#include "../common/ntrace.h"  // For the NTRACE probes
 
 // Define PATH_MAX if it's not available on the system
 #ifndef PATH_MAX
@@ -14,8 +30,46 @@
 typedef struct {
     char *name;   // Name of the file or directory
     int is_dir;   // 1 if it's a directory, 0 if it's a file
+    ino_t ino;    // Inode number reported by readdir (d_ino), used for inode-ordered stat
+    uid_t uid;    // Owner, from stat
+    gid_t gid;    // Group, from stat
+    off_t size;   // Size in bytes, from stat
+    mode_t mode;  // File type and permissions, from stat
+    time_t mtime; // Modification time, from stat
+    int findings; // FINDING_* flags, only computed with --audit
 } DirEntry;
 
+// Options selected on the command line, shared by the whole traversal
+typedef struct {
+    int inode_order; // 1 to stat entries in inode order instead of readdir order
+    int num_threads; // Number of threads used to sort huge directories (0 = one per CPU, see sort_threads)
+    int spill_limit; // Maximum entries per directory held in memory before spilling to disk (0 = no limit)
+    int by_owner;    // 1 to report bytes and file counts per owner and top-level directory
+    int exec;        // 1 to run a command over every file (--exec CMD {} +) instead of printing
+    int audit;       // 1 to print only the security findings (--audit)
+    int tar;         // 1 to also write every entry to a tar archive (--tar FILE)
+    int peek;        // Number of leading bytes of each regular file to dump (--peek N, 0 = off)
+    int network;     // 1 to tune the walk for directories on NFS/SMB (--network)
+    int perf;        // 1 to report hardware counters per phase on stderr (--perf)
+    int mem_stats;   // 1 to report allocation counts and call sites on stderr at exit (--mem-stats)
+} TreeOptions;
+
+static TreeOptions options = {0};
+
+// Phases reported by --perf
+enum {
+    PHASE_READDIR, // Reading directory entries
+    PHASE_STAT,    // Getting the status of every entry
+    PHASE_SORT,    // Sorting a directory's entries
+    PHASE_OUTPUT,  // Printing (and everything else done per entry: spill merging, --tar, --peek, ...)
+    NUM_PHASES
+};
+
+static const char *const phase_names[NUM_PHASES] = {"readdir", "stat", "sort", "output"};
+
+// Writer the tree is printed to: stdout, or a per-entry buffer while writing a shard snapshot
+static NWriter *tree_out;
+
 // Comparison function for qsort.
 // It sorts entries alphabetically, with directories coming before files.
 int compareDirEntries(const void *a, const void *b) {
@@ -36,148 +90,2649 @@ int compareDirEntries(const void *a, const void *b) {
     return strcmp(entryA->name, entryB->name);
 }
 
+// Comparison function for qsort used before stat'ing a directory's entries.
+// It sorts entries by inode number so the inode table is read sequentially.
+int compareDirEntriesByInode(const void *a, const void *b) {
+    const DirEntry *entryA = (const DirEntry *)a;
+    const DirEntry *entryB = (const DirEntry *)b;
+
+    if (entryA->ino < entryB->ino) {
+        return -1;
+    }
+    if (entryA->ino > entryB->ino) {
+        return 1;
+    }
+    return 0;
+}
+
+// Directories with at least this many entries are sorted in parallel
+#define PARALLEL_SORT_THRESHOLD 65536
+// Maximum number of spill files open for the directory being read; more runs are merged into one
+// first, and directories the walk has descended from keep one each (see compact_entry_stream)
+#define MAX_SPILL_RUNS 64
+// First word of a shard snapshot (see write_shard_snapshot)
+#define SHARD_MAGIC "ntree-shard 1"
+// Maximum number of shards in a sharded traversal
+#define MAX_SHARDS 1024
+// Upper bound on sorting threads, keeps the per-sort stack arrays small
+#define MAX_SORT_THREADS 64
+
+// Compact sort key for large directories. Sorting these instead of DirEntry keeps
+// the hot data contiguous and resolves most comparisons from the name prefix
+// without chasing the name pointer.
+typedef struct {
+    uint64_t prefix;  // First 8 bytes of the name, big-endian, zero padded
+    const char *name; // Full name, only read when the prefixes tie
+    int is_dir;       // Copied from the DirEntry
+    int index;        // Position of the DirEntry in the unsorted array
+} SortKey;
+
+// A slice of the key array handled by one sorting thread
+typedef struct {
+    SortKey *keys; // Source keys
+    SortKey *tmp;  // Scratch space of the same size (used by the merge step)
+    size_t lo;     // First key of the slice
+    size_t mid;    // Boundary between the two runs being merged
+    size_t hi;     // One past the last key of the slice
+} SortTask;
+
+// Packs the first 8 bytes of a name into an integer that orders like strcmp
+static uint64_t name_prefix(const char *name) {
+    uint64_t prefix = 0;
+    int i = 0;
+    for (; i < 8 && name[i] != '\0'; i++) {
+        prefix = (prefix << 8) | (unsigned char)name[i];
+    }
+    return prefix << (8 * (8 - i)); // Pad short names with zero bytes, like the terminator
+}
+
+// Comparison function for SortKey. Produces exactly the order of compareDirEntries.
+int compareSortKeys(const void *a, const void *b) {
+    const SortKey *keyA = (const SortKey *)a;
+    const SortKey *keyB = (const SortKey *)b;
+
+    // Directories first, as in compareDirEntries
+    if (keyA->is_dir != keyB->is_dir) {
+        return keyA->is_dir ? -1 : 1;
+    }
+    if (keyA->prefix != keyB->prefix) {
+        return keyA->prefix < keyB->prefix ? -1 : 1;
+    }
+    // Equal prefixes: if the last prefix byte is zero both names already ended
+    if ((keyA->prefix & 0xFF) == 0) {
+        return 0;
+    }
+    return strcmp(keyA->name + 8, keyB->name + 8);
+}
+
+// Pool task: sorts one slice of keys in place
+static void sort_slice_task(void *arg) {
+    SortTask *task = (SortTask *)arg;
+    qsort(task->keys + task->lo, task->hi - task->lo, sizeof(SortKey), compareSortKeys);
+}
+
+// Pool task: merges the sorted runs [lo, mid) and [mid, hi) from keys into tmp
+static void merge_slice_task(void *arg) {
+    SortTask *task = (SortTask *)arg;
+    size_t i = task->lo, j = task->mid, k = task->lo;
+
+    while (i < task->mid && j < task->hi) {
+        if (compareSortKeys(&task->keys[i], &task->keys[j]) <= 0) {
+            task->tmp[k++] = task->keys[i++];
+        } else {
+            task->tmp[k++] = task->keys[j++];
+        }
+    }
+    while (i < task->mid) {
+        task->tmp[k++] = task->keys[i++];
+    }
+    while (j < task->hi) {
+        task->tmp[k++] = task->keys[j++];
+    }
+}
+
+// Returns the number of threads for the parallel sort (and default --exec jobs). Without --threads
+// that is the number of online CPUs, looked up on first use: sysconf reads it from /sys, which
+// would add three system calls to every run while most runs never sort a directory that big.
+static int sort_threads(void) {
+    if (options.num_threads == 0) {
+        long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        options.num_threads = online_cpus > 0 ? (int)(online_cpus < MAX_SORT_THREADS ? online_cpus : MAX_SORT_THREADS) : 1;
+    }
+    return options.num_threads;
+}
+
+// Pool for the parallel sort, created on first use with sort_threads() threads
+// (its workers plus the thread waiting on it)
+static NPool *sort_pool;
+
+// Runs fn over every task on the sort pool and waits for all of them.
+// Runs the tasks on the calling thread if the pool cannot be created.
+static void run_sort_tasks(NTaskFn fn, SortTask *tasks, int num_tasks) {
+    if (!sort_pool) {
+        sort_pool = np_create(options.num_threads - 1);
+    }
+    for (int t = 0; t < num_tasks; t++) {
+        if (sort_pool) {
+            np_submit(sort_pool, fn, &tasks[t]);
+        } else {
+            fn(&tasks[t]);
+        }
+    }
+    if (sort_pool) {
+        np_wait(sort_pool);
+    }
+}
+
 /**
- * @brief Recursively lists the contents of a directory in a tree-like structure.
+ * @brief Sorts a large entries array with a parallel merge sort over compact keys.
  *
- * @param path The current directory path to list.
- * @param indent_level The current indentation level (for internal use, not directly used for printing here).
- * @param prefix The string prefix to use for indentation (e.g., "│   ", "    ").
+ * The keys are split into one run per thread, each run is sorted with qsort, and the
+ * runs are then merged pairwise (each pair as its own pool task) until one run remains.
+ * Falls back to a plain qsort if the scratch memory cannot be allocated.
+ *
+ * @param entries The array to sort in place.
+ * @param num_entries The number of entries in the array.
+ * @param num_threads The number of runs to sort concurrently.
  */
-void list_directory_recursive(const char *path, int indent_level, const char *prefix) {
-    DIR *dir;               // Directory stream pointer
-    struct dirent *entry;   // Pointer to directory entry
-    struct stat statbuf;    // Structure for file status information
-    char full_path[PATH_MAX]; // Buffer to store the full path of each entry
-
-    // Try to open the directory
-    if (!(dir = opendir(path))) {
-        fprintf(stderr, "Error: Cannot open directory '%s'\n", path);
+void parallel_sort_entries(DirEntry *entries, int num_entries, int num_threads) {
+    size_t n = (size_t)num_entries;
+    SortKey *keys = (SortKey *)malloc(n * sizeof(SortKey));
+    SortKey *tmp = (SortKey *)malloc(n * sizeof(SortKey));
+    DirEntry *sorted = (DirEntry *)malloc(n * sizeof(DirEntry));
+    if (!keys || !tmp || !sorted) {
+        free(keys);
+        free(tmp);
+        free(sorted);
+        qsort(entries, num_entries, sizeof(DirEntry), compareDirEntries);
         return;
     }
 
-    // --- Phase 1: Read all entries into a dynamic array ---
-    DirEntry *entries = NULL; // Pointer to the dynamic array of DirEntry structs
-    int num_entries = 0;      // Current number of entries
-    int capacity = 10;        // Initial capacity for the dynamic array
+    // Build the compact key array
+    for (size_t i = 0; i < n; i++) {
+        keys[i].prefix = name_prefix(entries[i].name);
+        keys[i].name = entries[i].name;
+        keys[i].is_dir = entries[i].is_dir;
+        keys[i].index = (int)i;
+    }
 
-    // Allocate initial memory for entries
-    entries = (DirEntry *)malloc(capacity * sizeof(DirEntry));
-    if (!entries) {
-        perror("Error: Memory allocation failed for entries array");
-        closedir(dir);
-        return;
+    // Sort one run per thread
+    SortTask tasks[num_threads];
+    size_t bounds[num_threads + 1];
+    for (int t = 0; t <= num_threads; t++) {
+        bounds[t] = n * (size_t)t / (size_t)num_threads;
     }
+    for (int t = 0; t < num_threads; t++) {
+        tasks[t] = (SortTask){keys, tmp, bounds[t], bounds[t], bounds[t + 1]};
+    }
+    run_sort_tasks(sort_slice_task, tasks, num_threads);
 
-    // Read directory entries one by one
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip current directory "." and parent directory ".."
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    // Merge neighbouring runs until only one is left, ping-ponging between the two buffers
+    int num_runs = num_threads;
+    while (num_runs > 1) {
+        int num_merges = 0;
+        for (int r = 0; r < num_runs; r += 2) {
+            size_t lo = bounds[r];
+            size_t hi = bounds[r + 2 <= num_runs ? r + 2 : num_runs];
+            size_t mid = r + 1 < num_runs ? bounds[r + 1] : hi; // An odd run out is just copied
+            tasks[num_merges++] = (SortTask){keys, tmp, lo, mid, hi};
         }
+        run_sort_tasks(merge_slice_task, tasks, num_merges);
 
-        // Construct the full path of the current entry
-        // snprintf is safer than sprintf as it prevents buffer overflows
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+        // The merged runs now start at every other boundary
+        for (int r = 0; 2 * r <= num_runs; r++) {
+            bounds[r] = bounds[2 * r <= num_runs ? 2 * r : num_runs];
+        }
+        bounds[num_merges] = n;
+        num_runs = num_merges;
 
-        // Get file status to determine if it's a directory or a regular file.
-        // stat() is used to get information about the file/directory.
-        if (stat(full_path, &statbuf) == -1) {
-            perror("Error getting file status");
-            continue; // Skip this entry if stat fails
+        SortKey *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+
+    // Apply the key order to the entries
+    for (size_t i = 0; i < n; i++) {
+        sorted[i] = entries[keys[i].index];
+    }
+    memcpy(entries, sorted, n * sizeof(DirEntry));
+
+    free(keys);
+    free(tmp);
+    free(sorted);
+}
+
+// Findings reported by --audit (bit flags in DirEntry.findings)
+#define FINDING_SETUID         0x01 // Regular file with the setuid bit
+#define FINDING_SETGID         0x02 // Regular file with the setgid bit
+#define FINDING_WORLD_WRITABLE 0x04 // World-writable file, or world-writable directory without the sticky bit
+#define FINDING_DANGLING_LINK  0x08 // Symbolic link whose target does not exist
+#define FINDING_NO_USER        0x10 // Owner uid has no user account
+#define FINDING_NO_GROUP       0x20 // Group gid has no group entry
+#define NUM_FINDINGS 6
+
+static const char *finding_names[NUM_FINDINGS] = {
+    "setuid", "setgid", "world-writable", "dangling symlink", "no user", "no group"
+};
+
+// One cached id: state is 0 for an empty slot, else 1 + whether the id has an entry in the database
+typedef struct {
+    unsigned long id;
+    char state;
+} IdSlot;
+
+// Remembers which uids (or gids) exist, so every id is looked up in the user/group database only once.
+// Open-addressing hash table like OwnerTable, so trees with many owners stay linear.
+typedef struct {
+    IdSlot *slots;   // Table slots
+    size_t capacity; // Number of slots (a power of two)
+    size_t count;    // Number of used slots
+} IdCache;
+
+static IdCache known_users;
+static IdCache known_groups;
+
+// Slot index for an id given the cache's capacity
+static size_t id_slot(const IdCache *cache, unsigned long id) {
+    uint64_t hash = (uint64_t)id * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(hash ^ (hash >> 29)) & (cache->capacity - 1);
+}
+
+// Returns whether the id exists, asking the database (nc_user_name or nc_group_name) only on a cache miss
+static int id_exists(IdCache *cache, unsigned long id, int is_group) {
+    if (cache->capacity) {
+        for (size_t slot = id_slot(cache, id); cache->slots[slot].state; slot = (slot + 1) & (cache->capacity - 1)) {
+            if (cache->slots[slot].id == id) {
+                return cache->slots[slot].state - 1;
+            }
+        }
+    }
+
+    int exists = (is_group ? nc_group_name(id) : nc_user_name(id)) != NULL;
+
+    // Keep the load factor below 3/4, rehashing into a table twice the size
+    if ((cache->count + 1) * 4 > cache->capacity * 3) {
+        IdCache grown = {0};
+        grown.capacity = cache->capacity ? cache->capacity * 2 : 64;
+        grown.slots = (IdSlot *)calloc(grown.capacity, sizeof(IdSlot));
+        if (!grown.slots) {
+            return exists; // Just don't cache it
+        }
+        for (size_t i = 0; i < cache->capacity; i++) {
+            if (cache->slots[i].state) {
+                size_t slot = id_slot(&grown, cache->slots[i].id);
+                while (grown.slots[slot].state) {
+                    slot = (slot + 1) & (grown.capacity - 1);
+                }
+                grown.slots[slot] = cache->slots[i];
+            }
+        }
+        grown.count = cache->count;
+        free(cache->slots);
+        *cache = grown;
+    }
+    size_t slot = id_slot(cache, id);
+    while (cache->slots[slot].state) {
+        slot = (slot + 1) & (cache->capacity - 1);
+    }
+    cache->slots[slot] = (IdSlot){id, (char)(1 + exists)};
+    cache->count++;
+    return exists;
+}
+
+/**
+ * @brief Works out the --audit findings for an entry from its lstat data.
+ *
+ * @param full_path The path of the entry (only used to resolve symbolic links).
+ * @param statbuf The entry's lstat result.
+ * @return The FINDING_* flags that apply.
+ */
+int audit_findings(const char *full_path, const struct stat *statbuf) {
+    int findings = 0;
+    mode_t mode = statbuf->st_mode;
+
+    if (S_ISREG(mode) && (mode & S_ISUID)) {
+        findings |= FINDING_SETUID;
+    }
+    if (S_ISREG(mode) && (mode & S_ISGID)) {
+        findings |= FINDING_SETGID;
+    }
+    if ((S_ISREG(mode) && (mode & S_IWOTH)) || (S_ISDIR(mode) && (mode & S_IWOTH) && !(mode & S_ISVTX))) {
+        findings |= FINDING_WORLD_WRITABLE;
+    }
+    if (S_ISLNK(mode)) {
+        struct stat target;
+        if (stat(full_path, &target) == -1 && (errno == ENOENT || errno == ENOTDIR || errno == ELOOP)) {
+            findings |= FINDING_DANGLING_LINK;
+        }
+    }
+    if (!id_exists(&known_users, (unsigned long)statbuf->st_uid, 0)) {
+        findings |= FINDING_NO_USER;
+    }
+    if (!id_exists(&known_groups, (unsigned long)statbuf->st_gid, 1)) {
+        findings |= FINDING_NO_GROUP;
+    }
+    return findings;
+}
+
+/*
+ * Network filesystem tuning (--network).
+ *
+ * On NFS and SMB every stat() of a full path is a LOOKUP plus a GETATTR round trip.
+ * Directories on a network filesystem are therefore handled differently:
+ *   - entries are stat'ed with fstatat() relative to the open directory, which the
+ *     client can answer from the attributes READDIRPLUS just returned;
+ *   - when nothing but the entry type is needed, the d_type from readdir is used and
+ *     no stat is issued at all (symbolic links and unknown types are still stat'ed);
+ *   - the remaining stats are spread over NETWORK_STAT_THREADS threads, so round trips overlap.
+ * The filesystem type is looked up with fstatfs once per device and cached, including the
+ * negative "not a network filesystem" answers, so local trees pay one fstat per directory.
+ * That is the only cache: failed stats are not remembered, as the walk never repeats a lookup.
+ */
+
+// Maximum number of threads stat'ing one network directory concurrently
+#define NETWORK_STAT_THREADS 16
+// Entries per thread below which extra threads are not worth starting
+#define NETWORK_ENTRIES_PER_THREAD 8
+
+// statfs f_type values of network filesystems (from linux/magic.h and the filesystems themselves)
+static const unsigned long network_fs_types[] = {
+    0x6969,     // NFS
+    0x517B,     // SMB
+    0xFF534D42, // CIFS
+    0xFE534D42, // SMB2
+    0x00C36400, // Ceph
+    0x01021997, // 9P
+    0x5346414F, // AFS
+    0x0BD00BD0, // Lustre
+};
+
+// Cached answers: device number -> is it on a network filesystem
+typedef struct {
+    dev_t *devices;  // Devices seen so far
+    char *is_network; // Answer for each device
+    size_t count;     // Number of cached devices
+    size_t capacity;  // Allocated size of both arrays
+} FsTypeCache;
+
+static FsTypeCache fs_type_cache;
+
+/**
+ * @brief Tells whether an open directory lives on a network filesystem, asking statfs once per device.
+ */
+int is_network_directory(int dir_fd) {
+    struct stat dir_stat;
+    struct statfs fs;
+
+    if (fstat(dir_fd, &dir_stat) != 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < fs_type_cache.count; i++) {
+        if (fs_type_cache.devices[i] == dir_stat.st_dev) {
+            return fs_type_cache.is_network[i];
+        }
+    }
+
+    int is_network = 0;
+    if (fstatfs(dir_fd, &fs) == 0) {
+        for (size_t i = 0; i < sizeof(network_fs_types) / sizeof(network_fs_types[0]); i++) {
+            if ((unsigned long)fs.f_type == network_fs_types[i]) {
+                is_network = 1;
+            }
+        }
+    }
+
+    if (fs_type_cache.count >= fs_type_cache.capacity) {
+        size_t new_capacity = fs_type_cache.capacity ? fs_type_cache.capacity * 2 : 8;
+        dev_t *new_devices = (dev_t *)realloc(fs_type_cache.devices, new_capacity * sizeof(dev_t));
+        if (!new_devices) {
+            return is_network; // Just don't cache it
+        }
+        fs_type_cache.devices = new_devices;
+        char *new_is_network = (char *)realloc(fs_type_cache.is_network, new_capacity);
+        if (!new_is_network) {
+            return is_network;
+        }
+        fs_type_cache.is_network = new_is_network;
+        fs_type_cache.capacity = new_capacity;
+    }
+    fs_type_cache.devices[fs_type_cache.count] = dir_stat.st_dev;
+    fs_type_cache.is_network[fs_type_cache.count] = (char)is_network;
+    fs_type_cache.count++;
+    return is_network;
+}
+
+// A strided share of one directory's entries for a stat thread
+typedef struct {
+    int dir_fd;           // The directory the names are relative to
+    DirEntry *entries;    // The batch
+    struct stat *results; // One result per entry
+    int *errors;          // errno per entry (0 on success, -1 when the stat was skipped)
+    int first;            // First entry of this thread
+    int step;             // Distance between this thread's entries
+    int num_entries;      // Size of the batch
+} StatTask;
+
+// Pool task: fstatat every step-th entry starting at first
+static void stat_entries_task(void *arg) {
+    StatTask *task = (StatTask *)arg;
+    int flags = options.audit || options.tar || options.by_owner ? AT_SYMLINK_NOFOLLOW : 0;
+
+    for (int i = task->first; i < task->num_entries; i += task->step) {
+        if (task->errors[i] == -1) {
+            continue; // The type from readdir is enough for this entry
+        }
+        task->errors[i] = fstatat(task->dir_fd, task->entries[i].name, &task->results[i], flags) == 0 ? 0 : errno;
+    }
+}
+
+// Pool for network stats, created on first use. Its threads mostly wait on the server, so it
+// is sized for overlapping round trips rather than for the number of CPUs.
+static NPool *network_stat_pool;
+
+/**
+ * @brief Stats a batch of entries of a network directory concurrently.
+ *
+ * @param dir_fd The open directory.
+ * @param entries The batch; entries whose mode was set from d_type may skip the stat.
+ * @param num_entries The size of the batch.
+ * @param results Receives one stat result per entry.
+ * @param errors Receives 0 for a successful stat, an errno value for a failed one, or -1 if skipped.
+ */
+void stat_network_entries(int dir_fd, DirEntry *entries, int num_entries, struct stat *results, int *errors) {
+    int needs_metadata = options.by_owner || options.tar || options.peek || options.audit;
+    int num_threads = num_entries / NETWORK_ENTRIES_PER_THREAD;
+
+    for (int i = 0; i < num_entries; i++) {
+        // The type from readdir is enough unless it is unknown or a link (which stat follows)
+        int skip = !needs_metadata && entries[i].mode != 0 && !S_ISLNK(entries[i].mode);
+        errors[i] = skip ? -1 : 0;
+    }
+
+    if (num_threads > NETWORK_STAT_THREADS) {
+        num_threads = NETWORK_STAT_THREADS;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    if (num_threads > 1 && !network_stat_pool) {
+        network_stat_pool = np_create(NETWORK_STAT_THREADS - 1);
+    }
+
+    StatTask tasks[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        tasks[t] = (StatTask){dir_fd, entries, results, errors, t, num_threads, num_entries};
+        if (num_threads > 1 && network_stat_pool) {
+            np_submit(network_stat_pool, stat_entries_task, &tasks[t]);
+        } else {
+            stat_entries_task(&tasks[t]);
+        }
+    }
+    if (num_threads > 1 && network_stat_pool) {
+        np_wait(network_stat_pool);
+    }
+}
+
+/**
+ * @brief Reads the next batch of entries from an open directory, stats them and sorts them.
+ *
+ * @param dir The open directory stream.
+ * @param path The path of the directory (used to build the full path for stat).
+ * @param entries_ptr The batch array; grown with realloc as needed.
+ * @param capacity_ptr The allocated capacity of the batch array.
+ * @param max_entries The maximum number of entries to read, or 0 for no limit.
+ * @param at_end Set to 1 once readdir has reached the end of the directory.
+ * @param is_network 1 if the directory is on a network filesystem and --network is on.
+ * @param names The arena the entry names are copied into.
+ * @return The number of entries in the batch, or -1 if memory ran out.
+ */
+int read_entry_batch(DIR *dir, const char *path, DirEntry **entries_ptr, int *capacity_ptr,
+                     int max_entries, int *at_end, int is_network, NArena *names) {
+    DirEntry *entries = *entries_ptr;
+    struct dirent *entry;       // Pointer to directory entry
+    struct stat statbuf;        // Structure for file status information
+    char full_path[PATH_MAX];   // Buffer to store the full path of each entry
+    int num_entries = 0;        // Number of entries in this batch
+
+    *at_end = 0;
+
+    // --- Phase 1: Read the next batch of entries into the dynamic array ---
+    nperf_phase(PHASE_READDIR);
+    NTRACE1(readdir_start, path);
+    while (max_entries == 0 || num_entries < max_entries) {
+        if ((entry = readdir(dir)) == NULL) {
+            *at_end = 1;
+            break;
+        }
+
+        // Skip current directory "." and parent directory ".."
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
         }
 
         // Check if the dynamic array needs to be resized
-        if (num_entries >= capacity) {
-            capacity *= 2; // Double the capacity
-            DirEntry *new_entries = (DirEntry *)realloc(entries, capacity * sizeof(DirEntry));
+        if (num_entries >= *capacity_ptr) {
+            int new_capacity = *capacity_ptr * 2; // Double the capacity
+            DirEntry *new_entries = (DirEntry *)realloc(entries, new_capacity * sizeof(DirEntry));
             if (!new_entries) {
                 perror("Error: Memory reallocation failed for entries array");
-                // Clean up already allocated names before exiting
-                for (int i = 0; i < num_entries; i++) {
-                    free(entries[i].name);
-                }
-                free(entries);
-                closedir(dir);
-                return;
+                return -1;
             }
             entries = new_entries; // Update pointer to the new, larger array
+            *entries_ptr = entries;
+            *capacity_ptr = new_capacity;
         }
 
-        // Store the entry's name and type
-        entries[num_entries].name = strdup(entry->d_name); // Duplicate string to own memory
+        // Store the entry's name and inode; its type is filled in by the stat pass below
+        // Names live in the stream's arena: one bump allocation each, all freed together.
+        // Everything else starts zeroed: a --network entry whose stat is skipped keeps these
+        // fields, and --spill writes the whole struct (padding included) to its run files.
+        memset(&entries[num_entries], 0, sizeof(DirEntry));
+        entries[num_entries].name = na_strndup(names, entry->d_name, strlen(entry->d_name));
         if (!entries[num_entries].name) {
             perror("Error: Memory allocation failed for entry name");
-            // Clean up already allocated names and the array itself
-            for (int i = 0; i < num_entries; i++) {
-                free(entries[i].name);
-            }
-            free(entries);
-            closedir(dir);
-            return;
+            return -1;
         }
-        entries[num_entries].is_dir = S_ISDIR(statbuf.st_mode); // Check if it's a directory
+        entries[num_entries].ino = entry->d_ino;
+        entries[num_entries].mode = entry->d_type != DT_UNKNOWN ? DTTOIF(entry->d_type) : 0; // Type hint until stat
+        NTRACE2(entry_read, entries[num_entries].name, entries[num_entries].ino);
         num_entries++;
     }
-    closedir(dir); // Close the directory stream after reading all entries
+    NTRACE2(readdir_done, path, num_entries);
 
-    // --- Phase 2: Sort the collected entries ---
-    qsort(entries, num_entries, sizeof(DirEntry), compareDirEntries);
+    // --- Phase 1b: Get the status of every pending entry ---
+    nperf_phase(PHASE_STAT);
+    NTRACE2(stat_start, path, num_entries);
+    // readdir order is hash order on ext4 htree directories, so stat'ing in that order
+    // seeks randomly around the inode table. Sorting by d_ino first turns those reads
+    // into a mostly sequential sweep, which matters a lot on spinning disks with cold caches.
+    if (options.inode_order) {
+        qsort(entries, num_entries, sizeof(DirEntry), compareDirEntriesByInode);
+    }
 
-    // --- Phase 3: Print entries and recurse for subdirectories ---
+    // Network directories are stat'ed up front, concurrently and relative to the directory
+    struct stat *network_results = NULL;
+    int *network_errors = NULL;
+    if (is_network && num_entries > 0) {
+        network_results = (struct stat *)malloc(num_entries * sizeof(struct stat));
+        network_errors = (int *)malloc(num_entries * sizeof(int));
+        if (network_results && network_errors) {
+            stat_network_entries(dirfd(dir), entries, num_entries, network_results, network_errors);
+        } else {
+            free(network_results); // Fall back to the plain stat loop
+            free(network_errors);
+            network_results = NULL;
+            network_errors = NULL;
+        }
+    }
+
+    int num_valid = 0; // Number of entries kept after stat
     for (int i = 0; i < num_entries; i++) {
-        DirEntry current_entry = entries[i];
-        int is_last_entry = (i == num_entries - 1); // Check if this is the last entry in the current directory
+        // Construct the full path of the current entry
+        // snprintf is safer than sprintf as it prevents buffer overflows
+        snprintf(full_path, sizeof(full_path), "%s/%s", path, entries[i].name);
 
-        // Print the current indentation prefix
-        printf("%s", prefix);
+        if (network_errors && network_errors[i] == -1) {
+            // Only the type is needed and readdir already supplied it
+            entries[i].is_dir = S_ISDIR(entries[i].mode);
+            entries[num_valid++] = entries[i];
+            continue;
+        }
 
-        // Print the appropriate branch connector
-        if (is_last_entry) {
-            printf("└── "); // Last entry in the list
-        } else {
-            printf("├── "); // Not the last entry
+        // Get file status to determine if it's a directory or a regular file.
+        // stat() is used to get information about the file/directory; the audit, --tar and
+        // --by-owner use lstat() so they see symbolic links themselves and never follow them
+        // (a link is charged its own size, not its target's, and linked trees are not counted twice).
+        if (network_errors) {
+            statbuf = network_results[i];
+            errno = network_errors[i];
+        }
+        if (network_errors ? network_errors[i] != 0
+                           : (options.audit || options.tar || options.by_owner
+                                  ? lstat(full_path, &statbuf)
+                                  : stat(full_path, &statbuf)) == -1) {
+            NTRACE2(entry_stat, full_path, errno);
+            perror("Error getting file status");
+            continue; // Skip this entry if stat fails
         }
+        NTRACE2(entry_stat, full_path, 0);
 
-        // Print the name of the file or directory
-        printf("%s\n", current_entry.name);
+        entries[i].is_dir = S_ISDIR(statbuf.st_mode); // Check if it's a directory
+        entries[i].uid = statbuf.st_uid;
+        entries[i].gid = statbuf.st_gid;
+        entries[i].size = statbuf.st_size;
+        entries[i].mode = statbuf.st_mode;
+        entries[i].mtime = statbuf.st_mtime;
+        entries[i].findings = options.audit ? audit_findings(full_path, &statbuf) : 0;
+        entries[num_valid++] = entries[i]; // Compact the array over skipped entries
+    }
+    num_entries = num_valid;
+    free(network_results);
+    free(network_errors);
+    NTRACE2(stat_done, path, num_entries);
 
-        // If the current entry is a directory, recurse into it
-        if (current_entry.is_dir) {
-            char new_prefix[PATH_MAX]; // Buffer for the prefix for the next level of recursion
+    // --- Phase 2: Sort the collected entries ---
+    // Huge directories are sorted on several threads; everything else uses qsort directly
+    nperf_phase(PHASE_SORT);
+    NTRACE2(sort_start, path, num_entries);
+    if (num_entries >= PARALLEL_SORT_THRESHOLD && sort_threads() > 1) {
+        parallel_sort_entries(entries, num_entries, sort_threads());
+    } else {
+        qsort(entries, num_entries, sizeof(DirEntry), compareDirEntries);
+    }
+    NTRACE2(sort_done, path, num_entries);
+    nperf_phase(PHASE_OUTPUT);
 
-            // Construct the new prefix:
-            // If it's the last entry, add 4 spaces ("    ") to the prefix.
-            // If it's not the last, add a vertical line and 3 spaces ("│   ").
-            snprintf(new_prefix, sizeof(new_prefix), "%s%s", prefix, is_last_entry ? "    " : "│   ");
+    return num_entries;
+}
+
+// Appends one record to a spill file. Returns 0 on success, -1 on a write error.
+static int write_spilled_entry(FILE *run, const DirEntry *entry) {
+    size_t name_length = strlen(entry->name);
+    if (fwrite(entry, sizeof(DirEntry), 1, run) != 1 ||
+        fwrite(&name_length, sizeof(name_length), 1, run) != 1 ||
+        fwrite(entry->name, 1, name_length, run) != name_length) {
+        return -1;
+    }
+    return 0;
+}
+
+// Flushes a freshly written spill file and rewinds it for reading. Returns NULL (and closes it) on error.
+static FILE *finish_spill_file(FILE *run) {
+    if (fflush(run) != 0) {
+        perror("Error: Cannot write spill file");
+        fclose(run);
+        return NULL;
+    }
+    rewind(run);
+    return run;
+}
 
-            // Construct the full path for the recursive call
-            snprintf(full_path, sizeof(full_path), "%s/%s", path, current_entry.name);
+/**
+ * @brief Writes a sorted batch of entries to a new temporary file.
+ *
+ * Each record is the DirEntry itself (its name pointer is meaningless on disk)
+ * followed by the name length and the name bytes.
+ *
+ * @return The spill file rewound to its start, or NULL on error.
+ */
+FILE *spill_entry_run(DirEntry *entries, int num_entries) {
+    FILE *run = tmpfile(); // Unlinked temporary file, removed automatically on close
+    if (!run) {
+        perror("Error: Cannot create spill file");
+    }
 
-            // Make the recursive call
-            list_directory_recursive(full_path, indent_level + 1, new_prefix);
+    for (int i = 0; run && i < num_entries; i++) {
+        if (write_spilled_entry(run, &entries[i]) != 0) {
+            perror("Error: Cannot write spill file");
+            fclose(run);
+            run = NULL;
         }
-        free(current_entry.name); // Free the memory allocated by strdup for this entry's name
     }
 
-    free(entries); // Free the dynamic array itself
+    return run ? finish_spill_file(run) : NULL;
 }
 
-int main(int argc, char *argv[]) {
-    const char *start_path = "."; // Default starting path is the current directory
+// Reads the next record of a spill file into entry, with a malloc'd name. Returns 1 on success, 0 at the end of the run.
+static int read_spilled_entry(FILE *run, DirEntry *entry) {
+    size_t name_length;
 
-    // Check for command-line arguments
-    if (argc > 2) {
-        fprintf(stderr, "Usage: %s [directory_path]\n", argv[0]);
-        return 1; // Indicate error
-    } else if (argc == 2) {
-        start_path = argv[1]; // Use the provided directory path
+    if (fread(entry, sizeof(DirEntry), 1, run) != 1) {
+        return 0;
     }
+    if (fread(&name_length, sizeof(name_length), 1, run) != 1 ||
+        !(entry->name = (char *)malloc(name_length + 1))) {
+        perror("Error: Cannot read spill file");
+        return 0;
+    }
+    if (fread(entry->name, 1, name_length, run) != name_length) {
+        perror("Error: Cannot read spill file");
+        free(entry->name);
+        return 0;
+    }
+    entry->name[name_length] = '\0';
+    return 1;
+}
 
-    // Print the starting directory itself
-    printf("%s\n", start_path);
+// Sorted entries of one directory, either held in memory or merged from spilled runs
+typedef struct {
+    DirEntry *entries; // In-memory entries (the whole directory when nothing was spilled)
+    int num_entries;   // Number of in-memory entries
+    int next;          // Index of the next in-memory entry to hand out
+    FILE **runs;       // Spilled runs, each sorted with compareDirEntries
+    DirEntry *heads;   // Current first entry of every run
+    int *heap;         // Run indices ordered as a min-heap on their heads
+    int heap_size;     // Number of runs that still have entries
+    int num_runs;      // Number of spilled runs
+    NArena names;      // Names of the in-memory entries (reset after every spilled batch)
+    char *returned[2]; // Names of the last two entries merged from the runs, freed as the stream moves on
+    int last_returned; // Slot of returned[] that was filled last
+} EntryStream;
 
-    // Start the recursive listing process
-    list_directory_recursive(start_path, 0, ""); // Initial call with no indentation prefix
+// Restores the heap property downwards from position i
+static void sift_down_runs(EntryStream *stream, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1, right = 2 * i + 2;
+        if (left < stream->heap_size &&
+            compareDirEntries(&stream->heads[stream->heap[left]], &stream->heads[stream->heap[smallest]]) < 0) {
+            smallest = left;
+        }
+        if (right < stream->heap_size &&
+            compareDirEntries(&stream->heads[stream->heap[right]], &stream->heads[stream->heap[smallest]]) < 0) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        int swap = stream->heap[i];
+        stream->heap[i] = stream->heap[smallest];
+        stream->heap[smallest] = swap;
+        i = smallest;
+    }
+}
 
-    return 0; // Indicate success
+// Frees the names of the entries already handed out from the spilled runs
+static void free_returned_names(EntryStream *stream) {
+    free(stream->returned[0]);
+    free(stream->returned[1]);
+    stream->returned[0] = NULL;
+    stream->returned[1] = NULL;
+}
+
+// Releases everything an EntryStream still owns
+void close_entry_stream(EntryStream *stream) {
+    na_free(&stream->names);
+    free_returned_names(stream);
+    free(stream->entries);
+    for (int i = 0; i < stream->heap_size; i++) {
+        free(stream->heads[stream->heap[i]].name);
+    }
+    for (int i = 0; i < stream->num_runs; i++) {
+        fclose(stream->runs[i]);
+    }
+    free(stream->runs);
+    free(stream->heads);
+    free(stream->heap);
+    memset(stream, 0, sizeof(*stream));
+}
+
+// Loads the first entry of every spilled run and builds the merge heap. Returns 0 on success, -1 on error.
+static int prime_spilled_runs(EntryStream *stream) {
+    stream->heads = (DirEntry *)malloc(stream->num_runs * sizeof(DirEntry));
+    stream->heap = (int *)malloc(stream->num_runs * sizeof(int));
+    if (!stream->heads || !stream->heap) {
+        perror("Error: Memory allocation failed for spill merge");
+        return -1;
+    }
+    stream->heap_size = 0;
+    for (int r = 0; r < stream->num_runs; r++) {
+        if (read_spilled_entry(stream->runs[r], &stream->heads[r])) {
+            stream->heap[stream->heap_size++] = r;
+        }
+    }
+    for (int i = stream->heap_size / 2 - 1; i >= 0; i--) {
+        sift_down_runs(stream, i);
+    }
+    return 0;
+}
+
+int next_entry(EntryStream *stream, DirEntry *entry);
+
+// Merges all current runs of the stream into a single run, keeping the number of open spill files bounded.
+// Returns 0 on success, -1 on error.
+static int merge_spilled_runs(EntryStream *stream) {
+    FILE *merged = tmpfile();
+    if (!merged) {
+        perror("Error: Cannot create spill file");
+        return -1;
+    }
+    if (prime_spilled_runs(stream) != 0) {
+        fclose(merged);
+        return -1;
+    }
+
+    DirEntry entry;
+    int failed = 0;
+    while (next_entry(stream, &entry)) {
+        if (!failed && write_spilled_entry(merged, &entry) != 0) {
+            perror("Error: Cannot write spill file");
+            failed = 1;
+        }
+    }
+    free_returned_names(stream);
+
+    for (int r = 0; r < stream->num_runs; r++) {
+        fclose(stream->runs[r]);
+    }
+    free(stream->heads);
+    free(stream->heap);
+    stream->heads = NULL;
+    stream->heap = NULL;
+    stream->num_runs = 0;
+
+    if (failed) {
+        fclose(merged);
+        return -1;
+    }
+    if (!(merged = finish_spill_file(merged))) {
+        return -1;
+    }
+    stream->runs[stream->num_runs++] = merged;
+    return 0;
+}
+
+// Appends a spill file to the stream's list of runs. Returns 0 on success, -1 on error.
+static int add_spilled_run(EntryStream *stream, FILE *run) {
+    // Fold the existing runs into one before we run out of file descriptors
+    if (stream->num_runs >= MAX_SPILL_RUNS && merge_spilled_runs(stream) != 0) {
+        fclose(run);
+        return -1;
+    }
+
+    FILE **new_runs = (FILE **)realloc(stream->runs, (stream->num_runs + 1) * sizeof(FILE *));
+    if (!new_runs) {
+        perror("Error: Memory reallocation failed for spill runs");
+        fclose(run);
+        return -1;
+    }
+    stream->runs = new_runs;
+    stream->runs[stream->num_runs++] = run;
+    return 0;
+}
+
+/**
+ * @brief Folds the runs a stream has not handed out yet into a single run.
+ *
+ * Called before the walk descends into a subdirectory: the subdirectory's stream may
+ * spill up to MAX_SPILL_RUNS runs of its own, and without this every open level of a
+ * deep walk would keep as many, until opening the next spill file fails with EMFILE.
+ * Compacted, each open ancestor holds one run, so at most MAX_SPILL_RUNS plus one per
+ * level are open at a time. Entries already taken from the stream stay valid.
+ * If no spill file can be created the runs are simply kept; a write error is reported
+ * and ends the stream early.
+ */
+void compact_entry_stream(EntryStream *stream) {
+    if (stream->num_runs <= 1) {
+        return;
+    }
+    FILE *merged = tmpfile();
+    if (!merged) {
+        return;
+    }
+
+    // Drain the heap into the new run, leaving returned[] (the walker's entries) alone
+    int failed = 0;
+    while (stream->heap_size > 0) {
+        int run = stream->heap[0];
+        if (!failed && write_spilled_entry(merged, &stream->heads[run]) != 0) {
+            perror("Error: Cannot write spill file");
+            failed = 1;
+        }
+        free(stream->heads[run].name);
+        if (!read_spilled_entry(stream->runs[run], &stream->heads[run])) {
+            stream->heap[0] = stream->heap[--stream->heap_size];
+        }
+        sift_down_runs(stream, 0);
+    }
+    for (int r = 0; r < stream->num_runs; r++) {
+        fclose(stream->runs[r]);
+    }
+    stream->num_runs = 0;
+
+    if (failed) {
+        fclose(merged);
+        return;
+    }
+    if (!(merged = finish_spill_file(merged))) {
+        return;
+    }
+    stream->runs[stream->num_runs++] = merged;
+    if (read_spilled_entry(merged, &stream->heads[0])) {
+        stream->heap[stream->heap_size++] = 0;
+    }
+}
+
+/**
+ * @brief Reads, stats and sorts all entries of a directory.
+ *
+ * Without a spill limit the whole directory is kept in memory. With --spill N, the
+ * directory is read in batches of at most N entries; every batch is sorted and written
+ * to a temporary file, and the runs are k-way merged as entries are taken from the stream,
+ * so memory stays bounded no matter how large the directory is.
+ *
+ * @return 0 on success, -1 on error (an error message has been printed).
+ */
+int open_entry_stream(const char *path, EntryStream *stream) {
+    DIR *dir;         // Directory stream pointer
+    int capacity = 10; // Initial capacity for the batch array
+    int at_end = 0;    // Set once the whole directory has been read
+
+    memset(stream, 0, sizeof(*stream));
+    na_init(&stream->names, 0);
+
+    // Try to open the directory
+    NTRACE1(dir_open_start, path);
+    if (!(dir = opendir(path))) {
+        NTRACE2(dir_open_done, path, errno);
+        fprintf(stderr, "Error: Cannot open directory '%s'\n", path);
+        return -1;
+    }
+    NTRACE2(dir_open_done, path, 0);
+
+    // Network filesystems get concurrent, directory-relative stats
+    int is_network = options.network && is_network_directory(dirfd(dir));
+
+    // Allocate initial memory for entries
+    stream->entries = (DirEntry *)malloc(capacity * sizeof(DirEntry));
+    if (!stream->entries) {
+        perror("Error: Memory allocation failed for entries array");
+        closedir(dir);
+        return -1;
+    }
+
+    while (!at_end) {
+        int num_entries = read_entry_batch(dir, path, &stream->entries, &capacity, options.spill_limit, &at_end,
+                                           is_network, &stream->names);
+        if (num_entries < 0) {
+            closedir(dir);
+            close_entry_stream(stream);
+            return -1;
+        }
+
+        // The common case: the whole directory fit in one batch
+        if (at_end && stream->num_runs == 0) {
+            stream->num_entries = num_entries;
+            break;
+        }
+
+        // Otherwise every batch becomes a sorted run on disk
+        if (num_entries > 0) {
+            NTRACE2(spill_run, path, num_entries);
+            FILE *run = spill_entry_run(stream->entries, num_entries);
+            if (!run || add_spilled_run(stream, run) != 0) {
+                closedir(dir);
+                close_entry_stream(stream);
+                return -1;
+            }
+        }
+        na_reset(&stream->names); // The batch's names are on disk now
+
+    }
+    closedir(dir); // Close the directory stream after reading all entries
+
+    if (stream->num_runs > 0) {
+        // Prime the merge with the first entry of every run
+        free(stream->entries);
+        stream->entries = NULL;
+        if (prime_spilled_runs(stream) != 0) {
+            close_entry_stream(stream);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Takes the next entry in sorted order from the stream.
+ *
+ * @param stream The stream to read from.
+ * @param entry Receives the entry. The stream owns its name, which stays valid until the
+ *              stream is closed or next_entry has been called twice more (enough for
+ *              the one-entry lookahead the walkers use).
+ * @return 1 if an entry was returned, 0 once the stream is exhausted.
+ */
+int next_entry(EntryStream *stream, DirEntry *entry) {
+    if (stream->num_runs == 0) {
+        if (stream->next >= stream->num_entries) {
+            return 0;
+        }
+        *entry = stream->entries[stream->next++];
+        return 1;
+    }
+
+    if (stream->heap_size == 0) {
+        return 0;
+    }
+    int run = stream->heap[0];
+    *entry = stream->heads[run];
+
+    // Keep this name alive and let go of the one handed out two calls ago
+    stream->last_returned ^= 1;
+    free(stream->returned[stream->last_returned]);
+    stream->returned[stream->last_returned] = entry->name;
+
+    // Refill the head of the run we just consumed, or drop the run once it is exhausted
+    if (!read_spilled_entry(stream->runs[run], &stream->heads[run])) {
+        stream->heap[0] = stream->heap[--stream->heap_size];
+    }
+    sift_down_runs(stream, 0);
+    return 1;
+}
+
+// Bytes and file count of one owner (uid, gid) below one top-level directory
+typedef struct {
+    char *top;                // Top-level directory name, "." for files directly in the start directory
+    uint64_t top_hash;        // Hash of top, so probing rarely needs strcmp
+    uid_t uid;                // Owning user
+    gid_t gid;                // Owning group
+    unsigned long long files; // Number of non-directory entries
+    unsigned long long bytes; // Sum of their sizes (st_size)
+} OwnerUsage;
+
+// Open-addressing hash table of OwnerUsage keyed on (top, uid, gid)
+typedef struct {
+    OwnerUsage *slots;  // Table slots; a slot is empty when its top is NULL
+    size_t capacity;    // Number of slots (a power of two)
+    size_t count;       // Number of used slots
+} OwnerTable;
+
+// Usage accumulated by this process for --by-owner
+static OwnerTable owner_usage;
+// Top-level directory the walk is currently below, and its hash
+static const char *current_top = ".";
+static uint64_t current_top_hash;
+
+// FNV-1a hash of a string
+static uint64_t hash_string(const char *s) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *s; s++) {
+        hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Slot index for a key given the table's capacity
+static size_t owner_slot(const OwnerTable *table, uint64_t top_hash, uid_t uid, gid_t gid) {
+    uint64_t hash = top_hash ^ ((uint64_t)uid * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)gid * 0xC2B2AE3D27D4EB4FULL);
+    return (size_t)(hash ^ (hash >> 29)) & (table->capacity - 1);
+}
+
+/**
+ * @brief Adds files and bytes to the usage of (top, uid, gid), creating the row if needed.
+ *
+ * @return 0 on success, -1 if memory ran out.
+ */
+int owner_table_add(OwnerTable *table, const char *top, uint64_t top_hash, uid_t uid, gid_t gid,
+                    unsigned long long files, unsigned long long bytes) {
+    // Keep the load factor below 3/4, rehashing into a table twice the size
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        OwnerTable grown = {0};
+        grown.capacity = table->capacity ? table->capacity * 2 : 64;
+        grown.slots = (OwnerUsage *)calloc(grown.capacity, sizeof(OwnerUsage));
+        if (!grown.slots) {
+            perror("Error: Memory allocation failed for owner table");
+            return -1;
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            OwnerUsage *usage = &table->slots[i];
+            if (usage->top) {
+                size_t slot = owner_slot(&grown, usage->top_hash, usage->uid, usage->gid);
+                while (grown.slots[slot].top) {
+                    slot = (slot + 1) & (grown.capacity - 1);
+                }
+                grown.slots[slot] = *usage;
+            }
+        }
+        grown.count = table->count;
+        free(table->slots);
+        *table = grown;
+    }
+
+    size_t slot = owner_slot(table, top_hash, uid, gid);
+    for (;;) {
+        OwnerUsage *usage = &table->slots[slot];
+        if (!usage->top) {
+            if (!(usage->top = strdup(top))) {
+                perror("Error: Memory allocation failed for owner table");
+                return -1;
+            }
+            usage->top_hash = top_hash;
+            usage->uid = uid;
+            usage->gid = gid;
+            table->count++;
+        }
+        if (usage->top_hash == top_hash && usage->uid == uid && usage->gid == gid && strcmp(usage->top, top) == 0) {
+            usage->files += files;
+            usage->bytes += bytes;
+            return 0;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+}
+
+// Comparison function for qsort: report rows by top-level name ("." first), then uid, then gid
+int compareOwnerUsage(const void *a, const void *b) {
+    const OwnerUsage *usageA = *(const OwnerUsage *const *)a;
+    const OwnerUsage *usageB = *(const OwnerUsage *const *)b;
+    int by_top = strcmp(usageA->top, usageB->top);
+
+    if (by_top != 0) {
+        return by_top;
+    }
+    if (usageA->uid != usageB->uid) {
+        return usageA->uid < usageB->uid ? -1 : 1;
+    }
+    if (usageA->gid != usageB->gid) {
+        return usageA->gid < usageB->gid ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Prints the --by-owner report after the tree and releases the table.
+ */
+void print_owner_report(OwnerTable *table) {
+    OwnerUsage **rows = (OwnerUsage **)malloc((table->count ? table->count : 1) * sizeof(OwnerUsage *));
+    size_t num_rows = 0;
+
+    if (!rows) {
+        perror("Error: Memory allocation failed for owner report");
+        return;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].top) {
+            rows[num_rows++] = &table->slots[i];
+        }
+    }
+    qsort(rows, num_rows, sizeof(OwnerUsage *), compareOwnerUsage);
+
+    nw_printf(tree_out, "\n%-24s %-12s %-12s %12s %16s\n", "TOP-LEVEL", "USER", "GROUP", "FILES", "BYTES");
+    for (size_t i = 0; i < num_rows; i++) {
+        char user[32], group[32];
+        const char *name;
+
+        // Fall back to the numeric ids for owners without a name
+        if ((name = nc_user_name(rows[i]->uid))) {
+            snprintf(user, sizeof(user), "%s", name);
+        } else {
+            snprintf(user, sizeof(user), "%lu", (unsigned long)rows[i]->uid);
+        }
+        if ((name = nc_group_name(rows[i]->gid))) {
+            snprintf(group, sizeof(group), "%s", name);
+        } else {
+            snprintf(group, sizeof(group), "%lu", (unsigned long)rows[i]->gid);
+        }
+        nw_printf(tree_out, "%-24s %-12s %-12s %12llu %16llu\n", rows[i]->top, user, group, rows[i]->files, rows[i]->bytes);
+    }
+    free(rows);
+
+    for (size_t i = 0; i < table->capacity; i++) {
+        free(table->slots[i].top);
+    }
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+// Pending and running commands for --exec CMD {} +
+typedef struct {
+    char **command;      // CMD and its fixed arguments (without the {} placeholder)
+    int command_argc;    // Number of fixed arguments
+    size_t command_size; // Bytes the fixed arguments take in the new process's argument area
+    char **paths;        // Matched paths waiting for the next batch
+    int num_paths;       // Number of pending paths
+    int paths_capacity;  // Allocated size of paths
+    size_t batch_size;   // Bytes the pending paths take in the argument area
+    size_t batch_limit;  // Largest argument area a batch may use (derived from ARG_MAX)
+    pid_t *running;      // Commands that have not finished yet
+    int num_running;     // Number of running commands
+    int max_running;     // Maximum number of concurrent commands
+    int failed;          // Set once any command fails or cannot be started
+} ExecBatch;
+
+static ExecBatch exec_batch;
+
+extern char **environ;
+
+// Waits for one running command to finish and records whether it failed
+static void exec_wait_one(ExecBatch *batch) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+
+    if (pid < 0) {
+        perror("Error: waitpid failed");
+        batch->num_running = 0; // Nothing left to wait for
+        batch->failed = 1;
+        return;
+    }
+    for (int i = 0; i < batch->num_running; i++) {
+        if (batch->running[i] == pid) {
+            batch->running[i] = batch->running[--batch->num_running];
+            break;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        batch->failed = 1;
+    }
+}
+
+/**
+ * @brief Launches the pending paths as one command and starts a new, empty batch.
+ *
+ * Uses posix_spawnp, so no copy of ntree's address space is made per batch. When the
+ * concurrency limit is reached, waits for a running command to finish first.
+ */
+void exec_flush(ExecBatch *batch) {
+    if (batch->num_paths == 0) {
+        return;
+    }
+    while (batch->num_running >= batch->max_running) {
+        exec_wait_one(batch);
+    }
+
+    // argv = fixed arguments, then the batch of paths, then NULL
+    char **argv = (char **)malloc((batch->command_argc + batch->num_paths + 1) * sizeof(char *));
+    if (!argv) {
+        perror("Error: Memory allocation failed for command arguments");
+        batch->failed = 1;
+    } else {
+        memcpy(argv, batch->command, batch->command_argc * sizeof(char *));
+        memcpy(argv + batch->command_argc, batch->paths, batch->num_paths * sizeof(char *));
+        argv[batch->command_argc + batch->num_paths] = NULL;
+
+        pid_t pid;
+        int error = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+        if (error != 0) {
+            fprintf(stderr, "Error: Cannot run '%s': %s\n", argv[0], strerror(error));
+            batch->failed = 1;
+        } else {
+            batch->running[batch->num_running++] = pid;
+        }
+        free(argv);
+    }
+
+    for (int i = 0; i < batch->num_paths; i++) {
+        free(batch->paths[i]);
+    }
+    batch->num_paths = 0;
+    batch->batch_size = 0;
+}
+
+/**
+ * @brief Adds a matched path to the current batch, launching the batch first if the path would not fit.
+ */
+void exec_add_path(ExecBatch *batch, const char *path) {
+    size_t size = strlen(path) + 1 + sizeof(char *); // The string plus its argv slot
+
+    if (batch->num_paths > 0 && batch->batch_size + size > batch->batch_limit) {
+        exec_flush(batch);
+    }
+    if (batch->num_paths >= batch->paths_capacity) {
+        int new_capacity = batch->paths_capacity ? batch->paths_capacity * 2 : 256;
+        char **new_paths = (char **)realloc(batch->paths, new_capacity * sizeof(char *));
+        if (!new_paths) {
+            perror("Error: Memory reallocation failed for command arguments");
+            batch->failed = 1;
+            return;
+        }
+        batch->paths = new_paths;
+        batch->paths_capacity = new_capacity;
+    }
+    if (!(batch->paths[batch->num_paths] = strdup(path))) {
+        perror("Error: Memory allocation failed for command argument");
+        batch->failed = 1;
+        return;
+    }
+    batch->num_paths++;
+    batch->batch_size += size;
+}
+
+/**
+ * @brief Sets up --exec: sizes batches to ARG_MAX and allocates the list of running commands.
+ *
+ * @param command The command and its fixed arguments (the {} and + are not included).
+ * @param command_argc The number of fixed arguments.
+ * @param max_running The maximum number of commands running at once.
+ * @return 0 on success, -1 on error.
+ */
+int exec_init(ExecBatch *batch, char **command, int command_argc, int max_running) {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t reserved = 2048; // Headroom POSIX asks for, as xargs does
+
+    memset(batch, 0, sizeof(*batch));
+    batch->command = command;
+    batch->command_argc = command_argc;
+    batch->max_running = max_running;
+
+    // The argument area is shared by argv and the environment
+    for (int i = 0; i < command_argc; i++) {
+        batch->command_size += strlen(command[i]) + 1 + sizeof(char *);
+    }
+    for (char **env = environ; *env; env++) {
+        reserved += strlen(*env) + 1 + sizeof(char *);
+    }
+    if (arg_max <= 0) {
+        arg_max = _POSIX_ARG_MAX;
+    }
+    if ((size_t)arg_max <= reserved + batch->command_size + PATH_MAX) {
+        fprintf(stderr, "Error: The environment leaves no room for --exec arguments\n");
+        return -1;
+    }
+    batch->batch_limit = (size_t)arg_max - reserved - batch->command_size;
+
+    batch->running = (pid_t *)malloc(max_running * sizeof(pid_t));
+    if (!batch->running) {
+        perror("Error: Memory allocation failed for running commands");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Launches the last batch and waits for every command to finish.
+ *
+ * @return 0 if every command succeeded, -1 otherwise.
+ */
+int exec_finish(ExecBatch *batch) {
+    exec_flush(batch);
+    while (batch->num_running > 0) {
+        exec_wait_one(batch);
+    }
+    free(batch->paths);
+    free(batch->running);
+    return batch->failed ? -1 : 0;
+}
+
+/*
+ * Archive mode (--tar FILE).
+ *
+ * Every entry printed by the walk is also appended to a POSIX ustar stream, in the
+ * tree's sorted order. Ownership is normalised to 0:0 and, if SOURCE_DATE_EPOCH is set,
+ * modification times are clamped to it, so the same tree always gives the same archive.
+ * Entries are lstat'ed like --audit's, so symbolic links are archived as links and never
+ * followed. Names, link targets or sizes that don't fit the ustar fields get a pax extended header.
+ */
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_RECORD_SIZE (20 * TAR_BLOCK_SIZE) // Default blocking factor, as tar writes it
+
+// The ustar header layout
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+} TarHeader;
+
+// State of the archive being written
+typedef struct {
+    int fd;                    // Output file descriptor
+    unsigned long long offset; // Bytes written so far
+    int clamp_mtime;           // 1 if SOURCE_DATE_EPOCH was set
+    time_t source_date;        // Value of SOURCE_DATE_EPOCH
+    int is_file;               // 1 if the archive is a regular file, which the walk may come across
+    dev_t device;              // Its device and inode, so that it is not archived into itself
+    ino_t inode;
+    int failed;                // Set once a write fails
+    int incomplete;            // Set when an entry could not be archived (the archive stays well-formed)
+} TarWriter;
+
+static TarWriter tar_writer;
+// Length of the start path, stripped from full paths to get archive member names
+static size_t start_path_length;
+
+// Writes a whole buffer to the archive
+static void tar_write(TarWriter *tar, const void *data, size_t length) {
+    const char *bytes = (const char *)data;
+    while (length > 0 && !tar->failed) {
+        ssize_t written = write(tar->fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error: Cannot write archive");
+            tar->failed = 1;
+            return;
+        }
+        bytes += written;
+        length -= (size_t)written;
+        tar->offset += (size_t)written;
+    }
+}
+
+// Pads the archive with zero bytes up to the next multiple of block
+static void tar_pad(TarWriter *tar, unsigned long long block) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    unsigned long long remainder = tar->offset % block;
+    if (remainder != 0) {
+        unsigned long long missing = block - remainder;
+        while (missing > 0) {
+            size_t chunk = missing < sizeof(zeros) ? (size_t)missing : sizeof(zeros);
+            tar_write(tar, zeros, chunk);
+            missing -= chunk;
+        }
+    }
+}
+
+// Writes value as a zero-padded octal number filling field (including the terminating NUL).
+// Returns 0 if the value does not fit.
+static int tar_octal(char *field, size_t width, unsigned long long value) {
+    char digits[32];
+    int length = snprintf(digits, sizeof(digits), "%0*llo", (int)width - 1, value);
+    if (length < 0 || (size_t)length > width - 1) {
+        return 0;
+    }
+    memcpy(field, digits, width);
+    return 1;
+}
+
+// Appends one "length key=value\n" pax record to buf, where length counts the whole record
+static size_t pax_record(char *buf, size_t used, size_t capacity, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3; // ' ', '=' and '\n'
+    size_t length = body + 1;
+    char digits[24];
+
+    // The length includes its own digits, so settle on a fixed point
+    while ((size_t)snprintf(digits, sizeof(digits), "%zu", length) + body != length) {
+        length = (size_t)snprintf(digits, sizeof(digits), "%zu", length) + body;
+    }
+    if (used + length <= capacity) {
+        snprintf(buf + used, capacity - used + 1, "%zu %s=%s\n", length, key, value);
+    }
+    return used + length;
+}
+
+// Fills in the checksum and writes a header block
+static void tar_write_header(TarWriter *tar, TarHeader *header) {
+    unsigned int sum = 0;
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    for (size_t i = 0; i < sizeof(TarHeader); i++) {
+        sum += ((unsigned char *)header)[i];
+    }
+    snprintf(header->checksum, sizeof(header->checksum), "%06o", sum);
+    header->checksum[7] = ' ';
+    tar_write(tar, header, sizeof(TarHeader));
+}
+
+// Starts a header with the fields shared by every member
+static void tar_init_header(TarHeader *header, char typeflag, mode_t mode, time_t mtime) {
+    memset(header, 0, sizeof(*header));
+    tar_octal(header->mode, sizeof(header->mode), mode & 07777);
+    tar_octal(header->uid, sizeof(header->uid), 0);
+    tar_octal(header->gid, sizeof(header->gid), 0);
+    tar_octal(header->size, sizeof(header->size), 0);
+    tar_octal(header->mtime, sizeof(header->mtime), mtime < 0 ? 0 : (unsigned long long)mtime);
+    header->typeflag = typeflag;
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+}
+
+/**
+ * @brief Writes the header (and pax extended header, if needed) for one archive member.
+ *
+ * @param name The member name (directories end with '/').
+ * @param typeflag '0' for a regular file, '2' for a symbolic link, '5' for a directory.
+ * @param mode, mtime, size The member's metadata.
+ * @param linkname The target of a symbolic link, NULL for other members.
+ */
+void tar_write_member_header(TarWriter *tar, const char *name, char typeflag, mode_t mode, time_t mtime,
+                             unsigned long long size, const char *linkname) {
+    TarHeader header;
+    size_t name_length = strlen(name);
+    size_t linkname_length = linkname ? strlen(linkname) : 0;
+    int needs_pax = 0;
+
+    if (tar->clamp_mtime && mtime > tar->source_date) {
+        mtime = tar->source_date;
+    }
+    tar_init_header(&header, typeflag, mode, mtime);
+
+    // Prefer the plain name field, then the ustar prefix/name split, then a pax header
+    if (name_length <= sizeof(header.name)) {
+        memcpy(header.name, name, name_length);
+    } else {
+        const char *split = NULL;
+        for (const char *slash = strchr(name, '/'); slash; slash = strchr(slash + 1, '/')) {
+            size_t prefix_length = (size_t)(slash - name);
+            if (prefix_length <= sizeof(header.prefix) && name_length - prefix_length - 1 <= sizeof(header.name) &&
+                name_length - prefix_length - 1 > 0) {
+                split = slash;
+                break;
+            }
+        }
+        if (split) {
+            memcpy(header.prefix, name, (size_t)(split - name));
+            memcpy(header.name, split + 1, name_length - (size_t)(split - name) - 1);
+        } else {
+            memcpy(header.name, name, sizeof(header.name)); // Truncated; the pax path wins
+            needs_pax = 1;
+        }
+    }
+    if (linkname && linkname_length <= sizeof(header.linkname)) {
+        memcpy(header.linkname, linkname, linkname_length);
+    } else if (linkname) {
+        memcpy(header.linkname, linkname, sizeof(header.linkname)); // Truncated; the pax linkpath wins
+        needs_pax = 1;
+    }
+    if (!tar_octal(header.size, sizeof(header.size), size)) {
+        needs_pax = 1; // Larger than 8 GiB
+    }
+
+    if (needs_pax) {
+        char records[2 * PATH_MAX + 128];
+        char size_text[24];
+        size_t used = 0;
+        if (name_length > sizeof(header.name) && header.prefix[0] == '\0') {
+            used = pax_record(records, used, sizeof(records) - 1, "path", name);
+        }
+        if (linkname_length > sizeof(header.linkname)) {
+            used = pax_record(records, used, sizeof(records) - 1, "linkpath", linkname);
+        }
+        if (!tar_octal(header.size, sizeof(header.size), size)) {
+            snprintf(size_text, sizeof(size_text), "%llu", size);
+            used = pax_record(records, used, sizeof(records) - 1, "size", size_text);
+        }
+
+        TarHeader pax;
+        tar_init_header(&pax, 'x', 0644, mtime);
+        snprintf(pax.name, sizeof(pax.name), "PaxHeaders/%.88s", header.name);
+        tar_octal(pax.size, sizeof(pax.size), used);
+        tar_write_header(tar, &pax);
+        tar_write(tar, records, used);
+        tar_pad(tar, TAR_BLOCK_SIZE);
+    }
+
+    tar_write_header(tar, &header);
+}
+
+// Copies exactly length bytes of in_fd to the archive, zero-filling if the file shrank
+static void tar_copy_body(TarWriter *tar, int in_fd, unsigned long long length) {
+    static char buffer[65536];
+    int use_sendfile = 1;
+
+    while (length > 0 && !tar->failed) {
+        size_t chunk = length < (1ULL << 30) ? (size_t)length : (1U << 30);
+        ssize_t copied = -1;
+
+        // sendfile moves the data inside the kernel; fall back to read/write where it isn't supported
+        if (use_sendfile) {
+            copied = sendfile(tar->fd, in_fd, NULL, chunk);
+            if (copied < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = 0;
+                continue;
+            }
+            if (copied > 0) {
+                tar->offset += (size_t)copied;
+            }
+        } else {
+            copied = read(in_fd, buffer, chunk < sizeof(buffer) ? chunk : sizeof(buffer));
+            if (copied > 0) {
+                tar_write(tar, buffer, (size_t)copied);
+            }
+        }
+
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            if (copied < 0) {
+                perror("Error: Cannot read file for archive");
+                tar->incomplete = 1;
+            }
+            // Keep the archive well-formed: the header promised length bytes
+            static const char zeros[TAR_BLOCK_SIZE];
+            while (length > 0 && !tar->failed) {
+                size_t fill = length < sizeof(zeros) ? (size_t)length : sizeof(zeros);
+                tar_write(tar, zeros, fill);
+                length -= fill;
+            }
+            return;
+        }
+        length -= (unsigned long long)copied;
+    }
+}
+
+/**
+ * @brief Appends one entry of the walk (a directory, regular file or symbolic link) to the archive.
+ *
+ * @param full_path The path of the entry as the walk sees it.
+ * @param entry The entry, with the metadata gathered by the walk.
+ */
+void tar_add_entry(TarWriter *tar, const char *full_path, const DirEntry *entry) {
+    char name[PATH_MAX + 1];
+
+    snprintf(name, sizeof(name), "%s%s", full_path + start_path_length + 1, entry->is_dir ? "/" : "");
+
+    if (entry->is_dir) {
+        tar_write_member_header(tar, name, '5', entry->mode, entry->mtime, 0, NULL);
+        return;
+    }
+    if (S_ISLNK(entry->mode)) {
+        char target[PATH_MAX + 1];
+        ssize_t target_length = readlink(full_path, target, sizeof(target) - 1);
+        if (target_length < 0) {
+            fprintf(stderr, "Error: Cannot read link '%s' for archive: %s\n", full_path, strerror(errno));
+            tar->incomplete = 1;
+            return;
+        }
+        target[target_length] = '\0';
+        tar_write_member_header(tar, name, '2', entry->mode, entry->mtime, 0, target);
+        return;
+    }
+    if (!S_ISREG(entry->mode)) {
+        fprintf(stderr, "Error: Not archiving special file '%s'\n", full_path);
+        tar->incomplete = 1;
+        return;
+    }
+
+    int in_fd = open(full_path, O_RDONLY | O_NOCTTY);
+    if (in_fd < 0) {
+        fprintf(stderr, "Error: Cannot open '%s' for archive: %s\n", full_path, strerror(errno));
+        tar->incomplete = 1;
+        return;
+    }
+    // The archive being written lies inside the tree when it is written there (or stdout is redirected there)
+    struct stat in_stat;
+    if (tar->is_file && fstat(in_fd, &in_stat) == 0 && in_stat.st_dev == tar->device &&
+        in_stat.st_ino == tar->inode) {
+        fprintf(stderr, "Warning: Not archiving '%s', the archive itself\n", full_path);
+        close(in_fd);
+        return;
+    }
+    tar_write_member_header(tar, name, '0', entry->mode, entry->mtime, (unsigned long long)entry->size, NULL);
+    tar_copy_body(tar, in_fd, (unsigned long long)entry->size);
+    tar_pad(tar, TAR_BLOCK_SIZE);
+    close(in_fd);
+}
+
+/**
+ * @brief Opens the archive output ("-" for standard output) and reads SOURCE_DATE_EPOCH.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int tar_open(TarWriter *tar, const char *archive_path) {
+    const char *source_date = getenv("SOURCE_DATE_EPOCH");
+
+    memset(tar, 0, sizeof(*tar));
+    if (source_date && *source_date) {
+        tar->clamp_mtime = 1;
+        tar->source_date = (time_t)strtoll(source_date, NULL, 10);
+    }
+
+    if (strcmp(archive_path, "-") == 0) {
+        tar->fd = STDOUT_FILENO;
+    } else {
+        tar->fd = open(archive_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (tar->fd < 0) {
+            fprintf(stderr, "Error: Cannot create archive '%s': %s\n", archive_path, strerror(errno));
+            return -1;
+        }
+    }
+
+    struct stat archive_stat;
+    if (fstat(tar->fd, &archive_stat) == 0 && S_ISREG(archive_stat.st_mode)) {
+        tar->is_file = 1;
+        tar->device = archive_stat.st_dev;
+        tar->inode = archive_stat.st_ino;
+    }
+    return 0;
+}
+
+/**
+ * @brief Ends the archive with two zero blocks, pads it to a full record and closes it.
+ *
+ * @return 0 if the whole archive was written with every entry in it, -1 otherwise (like
+ *         tar's exit status 2, also when entries had to be left out of a well-formed archive).
+ */
+int tar_close(TarWriter *tar) {
+    static const char zeros[2 * TAR_BLOCK_SIZE];
+
+    tar_write(tar, zeros, sizeof(zeros));
+    tar_pad(tar, TAR_RECORD_SIZE);
+    if (tar->fd != STDOUT_FILENO && close(tar->fd) != 0) {
+        perror("Error: Cannot write archive");
+        tar->failed = 1;
+    }
+    return tar->failed || tar->incomplete ? -1 : 0;
+}
+
+// Bytes per line of a --peek dump (nhex's default width when not on a terminal)
+#define PEEK_BYTES_PER_LINE 16
+
+// Reusable buffer for the file header read by --peek
+static unsigned char *peek_buffer;
+
+/**
+ * @brief Prints the first options.peek bytes of a regular file in nhex's layout, under its tree entry.
+ *
+ * The header is fetched with a single pread (O_NOATIME where permitted, so triaging a tree
+ * does not dirty every inode) and each dump line is formatted straight into tree_out's buffer.
+ *
+ * @param full_path The file to read.
+ * @param prefix The indentation prefix for the dump lines.
+ */
+void print_peek(const char *full_path, const char *prefix) {
+    int fd = open(full_path, O_RDONLY | O_NOCTTY | O_NOATIME);
+    if (fd < 0 && errno == EPERM) {
+        fd = open(full_path, O_RDONLY | O_NOCTTY); // O_NOATIME needs ownership of the file
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open '%s' for --peek: %s\n", full_path, strerror(errno));
+        return;
+    }
+
+    size_t length = 0;
+    while (length < (size_t)options.peek) {
+        ssize_t bytes_read = pread(fd, peek_buffer + length, (size_t)options.peek - length, (off_t)length);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        length += (size_t)bytes_read;
+    }
+    close(fd);
+
+    size_t prefix_length = strlen(prefix);
+    for (size_t offset = 0; offset < length; offset += PEEK_BYTES_PER_LINE) {
+        int count = (int)(length - offset < PEEK_BYTES_PER_LINE ? length - offset : PEEK_BYTES_PER_LINE);
+        char *out = nw_reserve(tree_out, prefix_length + HEX_LINE_SIZE(PEEK_BYTES_PER_LINE));
+        if (!out) {
+            return;
+        }
+        memcpy(out, prefix, prefix_length);
+        nw_commit(tree_out, prefix_length + format_hex_line(out + prefix_length, (unsigned long)offset,
+                                                            peek_buffer + offset, count, PEEK_BYTES_PER_LINE));
+    }
+}
+
+/**
+ * @brief Allocates the --peek buffer.
+ *
+ * @return 0 on success, -1 if memory ran out.
+ */
+int init_peek(void) {
+    peek_buffer = (unsigned char *)malloc((size_t)options.peek);
+    if (!peek_buffer) {
+        perror("Error: Memory allocation failed for --peek buffer");
+        return -1;
+    }
+    return 0;
+}
+
+void list_directory_recursive(const char *path, int indent_level, const char *prefix);
+
+/**
+ * @brief Prints one entry with its branch connector and, for directories, its whole subtree.
+ *
+ * @param path The path of the directory containing the entry.
+ * @param indent_level The indentation level of the containing directory.
+ * @param prefix The indentation prefix of the containing directory.
+ * @param entry The entry to print.
+ * @param is_last_entry 1 if this is the last entry of its directory.
+ */
+void print_entry(const char *path, int indent_level, const char *prefix, const DirEntry *entry, int is_last_entry) {
+    char full_path[PATH_MAX]; // Buffer to store the full path of the entry
+
+    // With --exec the walk feeds commands instead of printing the tree
+    if (options.exec) {
+        if (!entry->is_dir) {
+            snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->name);
+            exec_add_path(&exec_batch, full_path);
+        }
+    } else {
+        // Print the current indentation prefix
+        nw_printf(tree_out, "%s", prefix);
+
+        // Print the appropriate branch connector
+        if (is_last_entry) {
+            nw_printf(tree_out, "└── "); // Last entry in the list
+        } else {
+            nw_printf(tree_out, "├── "); // Not the last entry
+        }
+
+        // Print the name of the file or directory
+        nw_printf(tree_out, "%s\n", entry->name);
+
+        // Show the start of regular files, indented like children of the entry would be
+        if (options.peek > 0 && S_ISREG(entry->mode)) {
+            char peek_prefix[PATH_MAX];
+            snprintf(peek_prefix, sizeof(peek_prefix), "%s%s", prefix, is_last_entry ? "    " : "│   ");
+            snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->name);
+            print_peek(full_path, peek_prefix);
+        }
+    }
+
+    // Archive the entry in the same walk, in the same order as it is listed
+    if (options.tar) {
+        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->name);
+        tar_add_entry(&tar_writer, full_path, entry);
+    }
+
+    // Charge files to their owner below the current top-level directory
+    if (options.by_owner && !entry->is_dir) {
+        owner_table_add(&owner_usage, current_top, current_top_hash, entry->uid, entry->gid,
+                        1, (unsigned long long)entry->size);
+    }
+
+    // If the current entry is a directory, recurse into it
+    if (entry->is_dir) {
+        char new_prefix[PATH_MAX]; // Buffer for the prefix for the next level of recursion
+
+        // Construct the new prefix:
+        // If it's the last entry, add 4 spaces ("    ") to the prefix.
+        // If it's not the last, add a vertical line and 3 spaces ("│   ").
+        snprintf(new_prefix, sizeof(new_prefix), "%s%s", prefix, is_last_entry ? "    " : "│   ");
+
+        // Construct the full path for the recursive call
+        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->name);
+
+        // Everything below a top-level directory is charged to it
+        if (indent_level == 0) {
+            current_top = entry->name;
+            current_top_hash = hash_string(current_top);
+        }
+
+        // Make the recursive call
+        list_directory_recursive(full_path, indent_level + 1, new_prefix);
+
+        if (indent_level == 0) {
+            current_top = ".";
+            current_top_hash = hash_string(current_top);
+        }
+    }
+}
+
+/**
+ * @brief Recursively lists the contents of a directory in a tree-like structure.
+ *
+ * @param path The current directory path to list.
+ * @param indent_level The current indentation level (for internal use, not directly used for printing here).
+ * @param prefix The string prefix to use for indentation (e.g., "│   ", "    ").
+ */
+void list_directory_recursive(const char *path, int indent_level, const char *prefix) {
+    EntryStream stream; // Sorted entries of this directory
+
+    // --- Phases 1 and 2: Read, stat and sort all entries ---
+    if (open_entry_stream(path, &stream) != 0) {
+        return;
+    }
+
+    // --- Phase 3: Print entries and recurse for subdirectories ---
+    // One entry of lookahead tells us whether the current entry is the last one
+    DirEntry current_entry;
+    DirEntry next_in_line;
+    int has_next = next_entry(&stream, &next_in_line);
+
+    while (has_next) {
+        current_entry = next_in_line;
+        has_next = next_entry(&stream, &next_in_line);
+
+        if (current_entry.is_dir) {
+            compact_entry_stream(&stream); // Keep one spill file open while the subtree is walked
+        }
+        print_entry(path, indent_level, prefix, &current_entry, !has_next);
+    }
+
+    close_entry_stream(&stream); // Free the stream and any spill files
+}
+
+/*
+ * Audit mode.
+ *
+ * The walk keeps only entries that have findings and the directories leading to them,
+ * as a small in-memory tree, and prints that pruned tree once the walk is done (the
+ * connectors depend on which siblings survive, which is only known afterwards).
+ */
+
+// One entry of the pruned audit tree
+typedef struct AuditNode {
+    char *name;                  // Name of the file or directory
+    int findings;                // FINDING_* flags of the entry itself
+    struct AuditNode **children; // Surviving children, in tree order
+    int num_children;            // Number of surviving children
+} AuditNode;
+
+// Findings counted over the whole walk, for the summary line
+static unsigned long finding_counts[NUM_FINDINGS];
+
+// Frees an audit node and its subtree
+static void free_audit_node(AuditNode *node) {
+    for (int i = 0; i < node->num_children; i++) {
+        free_audit_node(node->children[i]);
+    }
+    free(node->children);
+    free(node->name);
+    free(node);
+}
+
+/**
+ * @brief Walks a directory (without following symbolic links) and collects the entries with findings.
+ *
+ * @param path The directory to audit.
+ * @param num_children Receives the number of surviving children.
+ * @return The surviving children (NULL if there are none).
+ */
+AuditNode **audit_directory_recursive(const char *path, int *num_children) {
+    EntryStream stream;
+    AuditNode **children = NULL;
+    int capacity = 0;
+    char full_path[PATH_MAX];
+
+    *num_children = 0;
+    if (open_entry_stream(path, &stream) != 0) {
+        return NULL;
+    }
+
+    DirEntry entry;
+    while (next_entry(&stream, &entry)) {
+        AuditNode **grandchildren = NULL;
+        int num_grandchildren = 0;
+
+        if (entry.is_dir) {
+            snprintf(full_path, sizeof(full_path), "%s/%s", path, entry.name);
+            compact_entry_stream(&stream);
+            grandchildren = audit_directory_recursive(full_path, &num_grandchildren);
+        }
+        for (int f = 0; f < NUM_FINDINGS; f++) {
+            if (entry.findings & (1 << f)) {
+                finding_counts[f]++;
+            }
+        }
+
+        // Prune entries without findings of their own or below them
+        if (entry.findings == 0 && num_grandchildren == 0) {
+            continue;
+        }
+
+        AuditNode *node = (AuditNode *)malloc(sizeof(AuditNode));
+        char *name = strdup(entry.name); // The stream owns entry.name, the node outlives it
+        if (node && !name) {
+            free(node);
+            node = NULL;
+        }
+        if (*num_children >= capacity) {
+            int new_capacity = capacity ? capacity * 2 : 8;
+            AuditNode **new_children = (AuditNode **)realloc(children, new_capacity * sizeof(AuditNode *));
+            if (!new_children) {
+                free(node);
+                node = NULL;
+            } else {
+                children = new_children;
+                capacity = new_capacity;
+            }
+        }
+        if (!node) {
+            perror("Error: Memory allocation failed for audit tree");
+            for (int i = 0; i < num_grandchildren; i++) {
+                free_audit_node(grandchildren[i]);
+            }
+            free(grandchildren);
+            free(name);
+            continue;
+        }
+        node->name = name;
+        node->findings = entry.findings;
+        node->children = grandchildren;
+        node->num_children = num_grandchildren;
+        children[(*num_children)++] = node;
+    }
+
+    close_entry_stream(&stream);
+    return children;
+}
+
+/**
+ * @brief Prints (and frees) a pruned audit tree with the usual connectors and each entry's findings.
+ */
+void print_audit_tree(AuditNode **nodes, int num_nodes, const char *prefix) {
+    for (int i = 0; i < num_nodes; i++) {
+        AuditNode *node = nodes[i];
+        int is_last_entry = (i == num_nodes - 1);
+
+        nw_printf(tree_out, "%s%s%s", prefix, is_last_entry ? "└── " : "├── ", node->name);
+
+        // List the findings after the name, e.g. "  [setuid, world-writable]"
+        const char *separator = "  [";
+        for (int f = 0; f < NUM_FINDINGS; f++) {
+            if (node->findings & (1 << f)) {
+                nw_printf(tree_out, "%s%s", separator, finding_names[f]);
+                separator = ", ";
+            }
+        }
+        nw_printf(tree_out, "%s\n", node->findings ? "]" : "");
+
+        if (node->num_children > 0) {
+            char new_prefix[PATH_MAX];
+            snprintf(new_prefix, sizeof(new_prefix), "%s%s", prefix, is_last_entry ? "    " : "│   ");
+            print_audit_tree(node->children, node->num_children, new_prefix);
+            node->children = NULL; // Already freed by the recursive call
+            node->num_children = 0;
+        }
+        free_audit_node(node);
+    }
+    free(nodes);
+}
+
+/**
+ * @brief Runs --audit over a directory: prints the pruned tree of findings and a summary.
+ *
+ * @return 1 if anything was found, 0 if the tree is clean.
+ */
+int run_audit(const char *start_path) {
+    int num_nodes;
+    unsigned long total = 0;
+    AuditNode **nodes = audit_directory_recursive(start_path, &num_nodes);
+
+    nw_printf(tree_out, "%s\n", start_path);
+    print_audit_tree(nodes, num_nodes, "");
+
+    nw_printf(tree_out, "\n");
+    for (int f = 0; f < NUM_FINDINGS; f++) {
+        nw_printf(tree_out, "%s%lu %s", f ? ", " : "", finding_counts[f], finding_names[f]);
+        total += finding_counts[f];
+    }
+    nw_printf(tree_out, "\n");
+    return total > 0;
+}
+
+/*
+ * Sharded traversal.
+ *
+ * The top-level entries of the start directory are dealt round-robin to N shards
+ * (entry i belongs to shard i % N). Every shard reads the top level itself, so it knows
+ * each entry's connector, but only walks the subtrees it owns. A shard writes a snapshot:
+ *
+ *     ntree-shard 1 <shard> <count> <root length>\n<root path>\n
+ *     @<entry index> <byte length>\n<exact tree output of that entry and its subtree>
+ *     ...
+ *     by-owner\n                                                            (with --by-owner)
+ *     owner <uid> <gid> <files> <bytes> <top length>\n<top-level name>\n   (with --by-owner)
+ *     ...
+ *     end <number of top-level entries>\n
+ *
+ * Merging the snapshots of all N shards in entry order reproduces a single full run byte for byte.
+ */
+
+/**
+ * @brief Walks the subtrees owned by one shard and writes its snapshot.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int write_shard_snapshot(const char *start_path, int shard_index, int shard_count, NWriter *snapshot) {
+    EntryStream stream;
+    NWriter *saved_out = tree_out;
+    NWriter block; // Captures one entry's output so it can be written with its length
+
+    if (open_entry_stream(start_path, &stream) != 0) {
+        return -1;
+    }
+    current_top_hash = hash_string(current_top);
+
+    if (nw_init(&block, -1, 0) != 0) {
+        perror("Error: Cannot buffer shard output");
+        close_entry_stream(&stream);
+        return -1;
+    }
+
+    nw_printf(snapshot, "%s %d %d %zu\n%s\n", SHARD_MAGIC, shard_index, shard_count, strlen(start_path), start_path);
+
+    DirEntry current_entry;
+    DirEntry next_in_line;
+    int has_next = next_entry(&stream, &next_in_line);
+    int index = 0;
+    int status = 0;
+
+    while (has_next) {
+        current_entry = next_in_line;
+        has_next = next_entry(&stream, &next_in_line);
+
+        if (index % shard_count == shard_index && status == 0) {
+            if (current_entry.is_dir) {
+                compact_entry_stream(&stream);
+            }
+            block.length = 0;
+            tree_out = &block;
+            print_entry(start_path, 0, "", &current_entry, !has_next);
+            tree_out = saved_out;
+            if (block.failed) {
+                perror("Error: Cannot buffer shard output");
+                status = -1;
+            } else {
+                nw_printf(snapshot, "@%d %zu\n", index, block.length);
+                nw_write(snapshot, block.buffer, block.length);
+            }
+        }
+        index++;
+    }
+    close_entry_stream(&stream);
+    nw_free(&block);
+
+    // The shard's own owner table travels with the snapshot and is merged with the others.
+    // The marker makes the merge print the report even when no shard found any files.
+    if (options.by_owner) {
+        nw_printf(snapshot, "by-owner\n");
+    }
+    for (size_t i = 0; i < owner_usage.capacity; i++) {
+        const OwnerUsage *usage = &owner_usage.slots[i];
+        if (usage->top) {
+            nw_printf(snapshot, "owner %lu %lu %llu %llu %zu\n%s\n", (unsigned long)usage->uid,
+                    (unsigned long)usage->gid, usage->files, usage->bytes, strlen(usage->top), usage->top);
+        }
+    }
+
+    nw_printf(snapshot, "end %d\n", index);
+    if (nw_flush(snapshot) != 0) {
+        perror("Error: Cannot write shard snapshot");
+        return -1;
+    }
+    return status;
+}
+
+// Reads the next control line of a snapshot, folding any owner records it passes into
+// this process's owner table (and turning on --by-owner at the marker).
+// Returns 1 on success, 0 on end of file or a malformed record.
+static int read_snapshot_line(FILE *snapshot, char *line, size_t line_size) {
+    char top[PATH_MAX];
+    unsigned long uid, gid;
+    unsigned long long files, bytes;
+    size_t top_length;
+
+    while (fgets(line, (int)line_size, snapshot)) {
+        if (strcmp(line, "by-owner\n") == 0) {
+            options.by_owner = 1;
+            continue;
+        }
+        if (strncmp(line, "owner ", 6) != 0) {
+            return 1;
+        }
+        if (sscanf(line, "owner %lu %lu %llu %llu %zu", &uid, &gid, &files, &bytes, &top_length) != 5 ||
+            top_length >= sizeof(top) || fread(top, 1, top_length + 1, snapshot) != top_length + 1) {
+            return 0;
+        }
+        top[top_length] = '\0';
+        if (owner_table_add(&owner_usage, top, hash_string(top), (uid_t)uid, (gid_t)gid, files, bytes) != 0) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Merges the snapshots of all shards of one traversal and prints the full tree.
+ *
+ * Entry i is read from shard i % N, so the merge streams through the snapshots
+ * without holding more than one copy buffer in memory. Owner records from shards
+ * walked with --by-owner are summed into one report.
+ *
+ * @param snapshots One open snapshot per shard, in any order.
+ * @param num_snapshots The number of snapshots.
+ * @return 0 on success, -1 if the snapshots are incomplete or inconsistent.
+ */
+int merge_shard_snapshots(FILE **snapshots, int num_snapshots) {
+    char line[128];
+    char root[PATH_MAX];       // The root of the first snapshot, which every other one must share
+    char shard_root[PATH_MAX];
+    FILE **by_shard = (FILE **)calloc(num_snapshots, sizeof(FILE *));
+    int status = -1;
+
+    if (!by_shard) {
+        perror("Error: Memory allocation failed for shard list");
+        return -1;
+    }
+
+    // Read every header and order the snapshots by shard number
+    for (int s = 0; s < num_snapshots; s++) {
+        int shard_index, shard_count;
+        size_t root_length;
+        if (!fgets(line, sizeof(line), snapshots[s]) ||
+            sscanf(line, SHARD_MAGIC " %d %d %zu", &shard_index, &shard_count, &root_length) != 3 ||
+            root_length >= sizeof(shard_root) ||
+            fread(shard_root, 1, root_length + 1, snapshots[s]) != root_length + 1) {
+            fprintf(stderr, "Error: Snapshot %d is not an ntree shard snapshot\n", s + 1);
+            goto out;
+        }
+        shard_root[root_length] = '\0';
+        if (s == 0) {
+            memcpy(root, shard_root, root_length + 1);
+        } else if (strcmp(root, shard_root) != 0) {
+            fprintf(stderr, "Error: Snapshot %d is of %s, not of %s\n", s + 1, shard_root, root);
+            goto out;
+        }
+        if (shard_count != num_snapshots || shard_index < 0 || shard_index >= shard_count ||
+            by_shard[shard_index]) {
+            fprintf(stderr, "Error: Expected one snapshot for each of %d shards\n", num_snapshots);
+            goto out;
+        }
+        by_shard[shard_index] = snapshots[s];
+    }
+
+    nw_printf(tree_out, "%s\n", root);
+
+    // Copy the blocks in entry order until the shard whose turn it is reports the end
+    int total = -1;
+    for (int index = 0; total < 0; index++) {
+        FILE *snapshot = by_shard[index % num_snapshots];
+        int block_index;
+        size_t block_length;
+
+        if (!read_snapshot_line(snapshot, line, sizeof(line))) {
+            fprintf(stderr, "Error: Shard %d snapshot is truncated\n", index % num_snapshots);
+            goto out;
+        }
+        if (sscanf(line, "end %d", &total) == 1) {
+            if (total != index) {
+                fprintf(stderr, "Error: Shard %d snapshot is incomplete\n", index % num_snapshots);
+                goto out;
+            }
+            break;
+        }
+        if (sscanf(line, "@%d %zu", &block_index, &block_length) != 2 || block_index != index) {
+            fprintf(stderr, "Error: Shard %d snapshot is missing entry %d\n", index % num_snapshots, index);
+            goto out;
+        }
+
+        char buffer[65536];
+        while (block_length > 0) {
+            size_t chunk = block_length < sizeof(buffer) ? block_length : sizeof(buffer);
+            if (fread(buffer, 1, chunk, snapshot) != chunk) {
+                fprintf(stderr, "Error: Shard %d snapshot is truncated\n", index % num_snapshots);
+                goto out;
+            }
+            nw_write(tree_out, buffer, chunk);
+            block_length -= chunk;
+        }
+    }
+
+    // Every other shard must agree on the number of top-level entries
+    for (int s = 0; s < num_snapshots; s++) {
+        int shard_total;
+        if (by_shard[s] == by_shard[total % num_snapshots]) {
+            continue;
+        }
+        if (!read_snapshot_line(by_shard[s], line, sizeof(line)) || sscanf(line, "end %d", &shard_total) != 1 ||
+            shard_total != total) {
+            fprintf(stderr, "Error: Shard %d snapshot does not match the others\n", s);
+            goto out;
+        }
+    }
+
+    // Shards walked with --by-owner carry owner records; report their sum
+    if (options.by_owner) {
+        print_owner_report(&owner_usage);
+    }
+    status = 0;
+
+out:
+    free(by_shard);
+    return status;
+}
+
+/**
+ * @brief Runs a sharded traversal with one forked worker process per shard on this host.
+ *
+ * Every worker writes its snapshot to an unlinked temporary file; the parent waits for
+ * all of them and merges the snapshots to standard output.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int run_sharded_processes(const char *start_path, int num_processes) {
+    FILE *snapshots[num_processes];
+    pid_t workers[num_processes];
+    int status = 0;
+
+    // Don't let the workers inherit buffered output
+    fflush(NULL);
+    nw_flush(tree_out);
+
+    for (int s = 0; s < num_processes; s++) {
+        snapshots[s] = tmpfile();
+        if (!snapshots[s]) {
+            perror("Error: Cannot create shard snapshot file");
+            for (int i = 0; i < s; i++) {
+                fclose(snapshots[i]);
+            }
+            return -1;
+        }
+    }
+
+    for (int s = 0; s < num_processes; s++) {
+        workers[s] = fork();
+        if (workers[s] == 0) {
+            NWriter snapshot;
+            if (nw_init(&snapshot, fileno(snapshots[s]), 0) != 0) {
+                _exit(1);
+            }
+            _exit(write_shard_snapshot(start_path, s, num_processes, &snapshot) == 0 ? 0 : 1);
+        }
+        if (workers[s] < 0) {
+            perror("Error: Cannot start shard worker");
+            status = -1;
+        }
+    }
+
+    for (int s = 0; s < num_processes; s++) {
+        int worker_status;
+        if (workers[s] > 0 &&
+            (waitpid(workers[s], &worker_status, 0) < 0 || !WIFEXITED(worker_status) ||
+             WEXITSTATUS(worker_status) != 0)) {
+            fprintf(stderr, "Error: Shard worker %d failed\n", s);
+            status = -1;
+        }
+    }
+
+    if (status == 0) {
+        for (int s = 0; s < num_processes; s++) {
+            rewind(snapshots[s]);
+        }
+        status = merge_shard_snapshots(snapshots, num_processes);
+    }
+
+    for (int s = 0; s < num_processes; s++) {
+        fclose(snapshots[s]);
+    }
+    return status;
+}
+
+// Option ids for nopt_next
+enum {
+    OPT_INODE_ORDER = 1,
+    OPT_THREADS,
+    OPT_SPILL,
+    OPT_SHARD,
+    OPT_PROCESSES,
+    OPT_BY_OWNER,
+    OPT_TAR,
+    OPT_PEEK,
+    OPT_NETWORK,
+    OPT_AUDIT,
+    OPT_EXEC,
+    OPT_EXEC_JOBS,
+    OPT_MERGE,
+    OPT_PERF,
+    OPT_REFERENCE,
+    OPT_MEM_STATS,
+    OPT_HELP,
+};
+
+static const NOption ntree_options[] = {
+    {"inode-order", 0, 0, OPT_INODE_ORDER},
+    {"threads", 0, 1, OPT_THREADS},
+    {"spill", 0, 1, OPT_SPILL},
+    {"shard", 0, 1, OPT_SHARD},
+    {"processes", 0, 1, OPT_PROCESSES},
+    {"by-owner", 0, 0, OPT_BY_OWNER},
+    {"tar", 0, 1, OPT_TAR},
+    {"peek", 0, 1, OPT_PEEK},
+    {"network", 0, 0, OPT_NETWORK},
+    {"audit", 0, 0, OPT_AUDIT},
+    {"exec", 0, 0, OPT_EXEC},
+    {"exec-jobs", 0, 1, OPT_EXEC_JOBS},
+    {"merge", 0, 0, OPT_MERGE},
+    {"perf", 0, 0, OPT_PERF},
+    {"reference", 0, 0, OPT_REFERENCE},
+    {"mem-stats", 0, 0, OPT_MEM_STATS},
+    {"help", 'h', 0, OPT_HELP},
+    {NULL, 0, 0, 0},
+};
+
+// Prints the command-line usage
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--inode-order] [--network] [--threads N] [--spill N] [--by-owner] [--peek N] [--perf] [--mem-stats]\n"
+                    "          [--processes N | --shard I/N] [directory_path]\n", program);
+    fprintf(stderr, "       %s --tar FILE|- [directory_path]\n", program);
+    fprintf(stderr, "       %s --audit [directory_path]\n", program);
+    fprintf(stderr, "       %s [--exec-jobs N] --exec CMD [ARG...] {} + [directory_path]\n", program);
+    fprintf(stderr, "       %s --merge snapshot...\n", program);
+    fprintf(stderr, "--reference turns off every fast path (parallel sort, spilling, --network, --processes),\n"
+                    "giving the output the optimized modes must match byte for byte.\n"
+                    "--mem-stats counts allocations per call site; it needs a build with make MEM_STATS=1.\n");
+}
+
+// Parses a positive integer option value no larger than max. Returns -1 (after a message) if it isn't one.
+static int parse_count(const char *option, const char *text, int max) {
+    unsigned long long value;
+    if (nopt_parse_size(text, &value) != 0 || value < 1 || value > (unsigned long long)max) {
+        fprintf(stderr, "Error: %s needs a number between 1 and %d\n", option, max);
+        return -1;
+    }
+    return (int)value;
+}
+
+/**
+ * @brief Runs ntree with parsed arguments. Output goes to tree_out, which main flushes.
+ *
+ * @return The process exit status.
+ */
+static int run_ntree(int argc, char *argv[]) {
+    const char *start_path = "."; // Default starting path is the current directory
+    const char *paths[argc];      // Positional arguments (the directory, or snapshots with --merge)
+    int num_paths = 0;
+    int shard_index = -1, shard_count = 0; // --shard I/N
+    int num_processes = 0;                 // --processes N
+    int merge = 0;                         // --merge
+    char **exec_command = NULL;            // --exec CMD [ARG...] {} +
+    int exec_argc = 0;
+    int exec_jobs = 0;                     // --exec-jobs N
+    const char *archive_path = NULL;       // --tar FILE
+    int reference = 0;                     // --reference
+
+    // Check for command-line arguments
+    NOptState opts = {0};
+    int opt;
+    while ((opt = nopt_next(&opts, argc, argv, ntree_options)) != NOPT_END) {
+        switch (opt) {
+            case OPT_INODE_ORDER:
+                options.inode_order = 1; // stat entries in inode order (helps HDDs and ext4)
+                break;
+            case OPT_THREADS:
+                if ((options.num_threads = parse_count("--threads", opts.arg, MAX_SORT_THREADS)) < 0) {
+                    return 1;
+                }
+                break;
+            case OPT_SPILL:
+                if ((options.spill_limit = parse_count("--spill", opts.arg, INT_MAX)) < 0) {
+                    return 1;
+                }
+                break;
+            case OPT_SHARD:
+                if (sscanf(opts.arg, "%d/%d", &shard_index, &shard_count) != 2 ||
+                    shard_count < 1 || shard_index < 0 || shard_index >= shard_count) {
+                    fprintf(stderr, "Error: --shard needs I/N with 0 <= I < N\n");
+                    return 1;
+                }
+                break;
+            case OPT_PROCESSES:
+                if ((num_processes = parse_count("--processes", opts.arg, MAX_SHARDS)) < 0) {
+                    return 1;
+                }
+                break;
+            case OPT_BY_OWNER:
+                options.by_owner = 1; // Report usage per owner and top-level directory
+                break;
+            case OPT_TAR:
+                archive_path = opts.arg; // Write a tar archive of the tree while listing it
+                options.tar = 1;
+                break;
+            case OPT_PEEK:
+                if ((options.peek = parse_count("--peek", opts.arg, INT_MAX)) < 0) { // Dump the first N bytes of every file
+                    return 1;
+                }
+                break;
+            case OPT_NETWORK:
+                options.network = 1; // Fewer, overlapping round trips on NFS/SMB directories
+                break;
+            case OPT_AUDIT:
+                options.audit = 1; // Flag setuid/setgid, world-writable, dangling links and unowned files
+                break;
+            case OPT_EXEC: {
+                // Everything up to "{} +" is the command; {} stands for the batch of file paths
+                int end = opts.index;
+                while (end < argc && strcmp(argv[end], "+") != 0) {
+                    end++;
+                }
+                exec_command = &argv[opts.index];
+                exec_argc = end - opts.index - 1; // Arguments before the {}
+                if (end >= argc || exec_argc < 1 || strcmp(argv[end - 1], "{}") != 0) {
+                    fprintf(stderr, "Error: --exec needs a command followed by {} +\n");
+                    return 1;
+                }
+                opts.index = end + 1; // Continue after the "+"
+                options.exec = 1;
+                break;
+            }
+            case OPT_EXEC_JOBS:
+                if ((exec_jobs = parse_count("--exec-jobs", opts.arg, INT_MAX)) < 0) {
+                    return 1;
+                }
+                break;
+            case OPT_MERGE:
+                merge = 1;
+                break;
+            case OPT_PERF:
+                options.perf = 1; // Cycles, instructions, IPC, cache and branch misses per phase
+                break;
+            case OPT_REFERENCE:
+                reference = 1;
+                break;
+            case OPT_MEM_STATS:
+                options.mem_stats = 1;
+                break;
+            case NOPT_POSITIONAL:
+                paths[num_paths++] = opts.arg;
+                break;
+            default: // OPT_HELP or NOPT_ERROR
+                print_usage(argv[0]);
+                return opt == OPT_HELP ? 0 : 1; // Indicate error
+        }
+    }
+
+    // The reference walk: one process, one thread, whole directories in memory, stat in readdir order
+    if (reference) {
+        options.num_threads = 1;
+        options.spill_limit = 0;
+        options.network = 0;
+        options.inode_order = 0;
+        num_processes = 0;
+    }
+
+    // Counters must be open before the sort and stat pools start their threads
+    if (options.perf) {
+        nperf_start(phase_names, NUM_PHASES, PHASE_OUTPUT);
+    }
+
+    // Merge mode: the positional arguments are shard snapshots
+    if (merge) {
+        if (num_paths == 0 || num_paths > MAX_SHARDS || shard_count > 0 || num_processes > 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        FILE *snapshots[num_paths];
+        for (int i = 0; i < num_paths; i++) {
+            if (!(snapshots[i] = fopen(paths[i], "rb"))) {
+                perror(paths[i]);
+                for (int j = 0; j < i; j++) {
+                    fclose(snapshots[j]);
+                }
+                return 1;
+            }
+        }
+        int status = merge_shard_snapshots(snapshots, num_paths);
+        for (int i = 0; i < num_paths; i++) {
+            fclose(snapshots[i]);
+        }
+        return status == 0 ? 0 : 1;
+    }
+
+    if (num_paths > 1 || (shard_count > 0 && num_processes > 0) ||
+        ((options.exec || options.audit) && (shard_count > 0 || num_processes > 1 || options.by_owner)) ||
+        (options.exec && options.audit) ||
+        (options.tar && (options.exec || options.audit || shard_count > 0 || num_processes > 1))) {
+        print_usage(argv[0]);
+        return 1; // Indicate error
+    } else if (num_paths == 1) {
+        start_path = paths[0]; // Use the provided directory path
+    }
+
+    if (options.peek > 0 && init_peek() != 0) {
+        return 1;
+    }
+
+    // Write one shard's snapshot to standard output, to be merged later with --merge
+    if (shard_count > 0) {
+        return write_shard_snapshot(start_path, shard_index, shard_count, tree_out) == 0 ? 0 : 1;
+    }
+
+    // Split the walk across local worker processes and merge their snapshots
+    if (num_processes > 1) {
+        return run_sharded_processes(start_path, num_processes) == 0 ? 0 : 1;
+    }
+
+    // Print only the entries with security findings; exit status 1 means something was found
+    if (options.audit) {
+        return run_audit(start_path);
+    }
+
+    // Run the command over batches of files instead of printing the tree
+    if (options.exec) {
+        if (exec_init(&exec_batch, exec_command, exec_argc, exec_jobs ? exec_jobs : sort_threads()) != 0) {
+            return 1;
+        }
+        list_directory_recursive(start_path, 0, "");
+        return exec_finish(&exec_batch) == 0 ? 0 : 1;
+    }
+
+    // The archive is written while the tree is listed; like tar -v, the listing moves
+    // to stderr when the archive itself goes to standard output
+    if (options.tar) {
+        if (tar_open(&tar_writer, archive_path) != 0) {
+            return 1;
+        }
+        if (tar_writer.fd == STDOUT_FILENO) {
+            tree_out->fd = STDERR_FILENO;
+        }
+        start_path_length = strlen(start_path);
+    }
+
+    // Print the starting directory itself
+    nw_printf(tree_out, "%s\n", start_path);
+
+    // Start the recursive listing process
+    current_top_hash = hash_string(current_top);
+    list_directory_recursive(start_path, 0, ""); // Initial call with no indentation prefix
+
+    if (options.by_owner) {
+        print_owner_report(&owner_usage);
+    }
+
+    if (options.tar && tar_close(&tar_writer) != 0) {
+        return 1;
+    }
+
+    return 0; // Indicate success
+}
+
+NCOMMAND_MAIN(ntree) {
+    static NWriter stdout_writer; // All tree output is buffered here and written in large blocks
+    static char stdout_buffer[NW_DEFAULT_CAPACITY]; // Its memory, static so a small tree needs no malloc
+
+    nw_init_buffer(&stdout_writer, STDOUT_FILENO, stdout_buffer, sizeof(stdout_buffer));
+    tree_out = &stdout_writer;
+
+    int status = run_ntree(argc, argv);
+
+    if (nw_flush(&stdout_writer) != 0 && status == 0) {
+        status = 1; // Output could not be written (e.g. a closed pipe)
+    }
+    nperf_report();
+    nw_free(&stdout_writer);
+    if (options.mem_stats) {
+        nmem_report();
+    }
+    return status;
 }